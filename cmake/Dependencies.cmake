@@ -14,6 +14,16 @@ list(APPEND Caffe_LINKER_LIBS PUBLIC ${Boost_LIBRARIES})
 find_package(Threads REQUIRED)
 list(APPEND Caffe_LINKER_LIBS PRIVATE ${CMAKE_THREAD_LIBS_INIT})
 
+# ---[ POSIX shared memory for the OGN data layers (librt before glibc 2.34)
+if(UNIX AND NOT APPLE)
+  list(APPEND Caffe_LINKER_LIBS PRIVATE rt)
+endif()
+
+# ---[ OGN octree key width
+if(USE_OGN_64BIT_KEYS)
+  list(APPEND Caffe_DEFINITIONS PUBLIC -DUSE_OGN_64BIT_KEYS)
+endif()
+
 # ---[ OpenMP
 if(USE_OPENMP)
   # Ideally, this should be provided by the BLAS library IMPORTED target. However,
@@ -0,0 +1,213 @@
+#ifndef OGN_BASE_DATA_LAYER_HPP_
+#define OGN_BASE_DATA_LAYER_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+namespace caffe {
+
+/// Position of the sampler: the model stream of epoch 'epoch' is at 'pos',
+/// and 'batches' batches have been drawn. The model order of an epoch only
+/// depends on the seed and the epoch, so this is all it takes to resume.
+struct OGNSamplerState {
+  OGNSamplerState() : seed(0), epoch(0), pos(0), batches(0) {}
+
+  bool operator==(const OGNSamplerState& other) const {
+    return seed == other.seed && epoch == other.epoch && pos == other.pos &&
+        batches == other.batches;
+  }
+  bool operator!=(const OGNSamplerState& other) const {
+    return !(*this == other);
+  }
+
+  uint32_t seed;
+  uint32_t epoch;
+  uint32_t pos;
+  uint32_t batches;
+};
+
+/// One batch of octrees, ready to be handed to the net: the padded values,
+/// the labels and the key octrees that map every cell to its column, and
+/// the sampler state right after the batch.
+template <typename Dtype>
+class OGNBatch {
+ public:
+  Blob<Dtype> values_, labels_;
+  std::vector<GeneralOctree<int> > keys_;
+  OGNSamplerState state_;
+};
+
+/**
+ * @brief Common base of the OGN data layers. Models come from a text list
+ *        of .ot files or a dataset pack (octree_pack.h), either preloaded or
+ *        read on demand.
+ *
+ * Batches are assembled on an InternalThread, prefetch batches ahead, like
+ * BasePrefetchingDataLayer; Reshape only swaps in a batch that is ready.
+ * With prefetch 0, or if the model indices come from a bottom blob, batches
+ * are loaded synchronously in Reshape instead.
+ *
+ * Every epoch visits each model once, in order or in a permutation drawn
+ * from the seed and the epoch, and is split into disjoint shards, one per
+ * process or solver (see init_sampler). Shards are padded to equal size and
+ * shuffled size buckets fill up their last batch, both with repeated models
+ * (see init_size_buckets). The sampler state can be saved with
+ * the net's parameters to resume a snapshot (see init_sampler_snapshot).
+ *
+ * Every batch is padded to its largest model. With size buckets, models of
+ * similar cell count are batched together (see init_size_buckets); with a
+ * cell budget, the batch size varies so that padded batches cost about the
+ * same (see init_cell_budget). Models can be flipped and rotated at random
+ * as they are loaded (see init_augmentation), and loaded only down to a
+ * level that follows a schedule (see init_level_schedule).
+ */
+template <typename Dtype>
+class OGNBasePrefetchingDataLayer : public OGNLayer<Dtype>,
+    public InternalThread {
+ public:
+  OGNBasePrefetchingDataLayer(const LayerParameter& param, int prefetch);
+  // Calls DataLayerSetUp, then starts the prefetch thread. Subclasses have
+  // to call StopInternalThread in their destructor.
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+
+  int num_models() const;
+  // Reads a model from the list or pack, bypassing the preload store; with
+  // max_level >= 0 only down to that level.
+  void load_model(int ind, Octree& tree, int max_level = -1) const;
+  // Cells of a model, from the pack index, the preload store or the file
+  // header; only text octrees are read completely.
+  int model_num_cells(int ind) const;
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top);
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
+  // Sets _batch_size, opens the models, e.g. with open_models, and sets up
+  // the sampler with init_sampler.
+  virtual void DataLayerSetUp() = 0;
+  virtual Dtype model_label(int ind) const = 0;
+
+  virtual void InternalThreadEntry();
+  void load_batch(const std::vector<int>& models, OGNBatch<Dtype>* batch);
+
+  // Preloads into a CompactOctreeStore on preload_threads threads (0 for
+  // all) until it holds preload_memory_mb (0 for no limit); models beyond
+  // the budget are read on demand. With a shared_memory_name, the store is
+  // shared by all processes that open the same source (octree_shm.h).
+  void open_models(const std::string& source, bool preload_data,
+      int preload_threads, int preload_memory_mb,
+      const std::string& shared_memory_name = "");
+
+  // Samples models [0, num_models) epoch by epoch, shuffled with a seed
+  // (-1 to draw one from the Caffe RNG) or in order. Each epoch is split
+  // into num_shards shards, padded to equal size with models from its start,
+  // and this layer reads shard shard_rank; num_shards 0 takes the solver
+  // rank and count of multi-GPU training. Shards only partition an epoch if
+  // all of them use the same seed.
+  void init_sampler(int num_models, bool shuffle, int64_t seed,
+      int shard_rank, int num_shards);
+
+  // Keeps the sampler state in a parameter blob of the layer (lr_mult 0),
+  // so that it is saved with snapshots and broadcast to all solvers of
+  // multi-GPU training. If the blob is overwritten, e.g. when a snapshot is
+  // restored, sampling resumes from its state. Only used in TRAIN.
+  void init_sampler_snapshot();
+
+  // Sorts the models by cell count into num_buckets buckets of equal size.
+  // With shuffle, each epoch shuffles every bucket, cuts the buckets, in
+  // size order, into batches and shuffles the order of the batches, which
+  // are then sharded; the last batch is filled up with models of the
+  // largest bucket, which are then read twice in that epoch. Without
+  // shuffle, every epoch reads each model once in size order and ends with
+  // a short batch.
+  void init_size_buckets(int num_buckets);
+
+  // Makes batches of up to _batch_size models whose padded size stays
+  // within max_batch_cells; a model larger than that is a batch of its own.
+  void init_cell_budget(int max_batch_cells);
+
+  // Transforms every loaded model by a random symmetry of the cube
+  // (octree_augment.h): mirrored axes, a permutation of the axes, or both.
+  void init_augmentation(bool flip, bool permute_axes);
+
+  // Loads levels up to max_level (-1 for all), plus one for each of the
+  // steps, given in batches, that have passed.
+  void init_level_schedule(int max_level, const std::vector<int>& steps);
+
+  int _batch_size;
+
+ private:
+  CompactOctreeStore<KeyType> _store;
+  // holds the records of _store if it is in shared memory
+  SharedImage _shared_image;
+  std::vector<std::string> _file_names;
+  // set if the source is a dataset pack instead of a list
+  OctreePack _pack;
+  bool _use_pack;
+
+  void count_model_cells();
+  // Builds the model order of this shard for epoch _state.epoch.
+  void make_epoch();
+  // Next model of the stream, crossing into the next epoch if needed.
+  int peek_model();
+  // Next _batch_size models, cut to the cell budget if there is one.
+  void sample_batch(std::vector<int>& models);
+  // Restarts sampling and prefetching from the state in the blob.
+  void restore_sampler_state();
+  void write_sampler_state(const OGNSamplerState& state);
+  OGNSamplerState read_sampler_state() const;
+
+  int _num_samples;
+  bool _shuffle;
+  int _shard_rank, _num_shards;
+  OGNSamplerState _state;
+  // models of this shard in epoch _epoch, batch after batch
+  std::vector<int> _epoch_models;
+  int _epoch;
+  // state of the batch in the net, as written to the blob
+  OGNSamplerState _current_state;
+  bool _snapshot_state;
+
+  std::vector<int> _model_cells;
+  size_t _max_batch_cells;
+  std::vector<std::vector<int> > _buckets;
+  OctreeTransform random_transform();
+
+  int load_level(int batch) const;
+
+  int _max_level;
+  std::vector<int> _level_steps;
+
+  bool _augment_flip;
+  bool _augment_permute_axes;
+  shared_ptr<Caffe::RNG> _augment_rng;
+
+  double _padding_sum;
+  size_t _batch_size_sum;
+  int _num_batches;
+
+  bool _done_initial_reshape;
+  bool _prefetching;
+  vector<shared_ptr<OGNBatch<Dtype> > > prefetch_;
+  BlockingQueue<OGNBatch<Dtype>*> prefetch_free_;
+  BlockingQueue<OGNBatch<Dtype>*> prefetch_full_;
+  OGNBatch<Dtype>* prefetch_current_;
+  OGNBatch<Dtype> sync_batch_;
+};
+
+}  // namespace caffe
+
+#endif  // OGN_BASE_DATA_LAYER_HPP_
@@ -23,6 +23,10 @@ class OGNConcatLayer : public OGNLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  void forward_sample_cpu(int n, const Dtype* input_arr1, const Dtype* input_arr2,
+      Dtype* output_arr, OGNLayer<Dtype>* l1_ptr, OGNLayer<Dtype>* l2_ptr);
+  void backward_sample_cpu(int n, const Dtype* input_arr, Dtype* output_arr1,
+      Dtype* output_arr2, OGNLayer<Dtype>* l1_ptr, OGNLayer<Dtype>* l2_ptr);
 
   string _key1_layer_name;
   string _key2_layer_name;
@@ -1,7 +1,7 @@
 #ifndef OGN_DATA_LABEL_LAYER_HPP_
 #define OGN_DATA_LABEL_LAYER_HPP_
 
-#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/layers/ogn_base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 
 #include "image_tree_tools/image_tree_tools.h"
@@ -9,38 +9,23 @@
 namespace caffe {
 
 template <typename Dtype>
-class OGNDataLabelLayer : public OGNLayer<Dtype> {
+class OGNDataLabelLayer : public OGNBasePrefetchingDataLayer<Dtype> {
  public:
   explicit OGNDataLabelLayer(const LayerParameter& param)
-      : OGNLayer<Dtype>(param) {}
-  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
-  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
+      : OGNBasePrefetchingDataLayer<Dtype>(param,
+          param.ogn_data_label_param().prefetch()) {}
+  virtual ~OGNDataLabelLayer();
 
   virtual inline const char* type() const { return "OGNDataLabel"; }
   // virtual inline int ExactNumBottomBlobs() const { return 1; }
   // virtual inline int MinTopBlobs() const { return 1; }
 
  protected:
-  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top);
-  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
-      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  virtual void DataLayerSetUp();
+  virtual Dtype model_label(int ind) const { return _model_labels[ind]; }
 
  private:
-   void load_data_from_disk();
-   int select_next_batch_models(std::vector<int> labels);
-
-   std::vector<Octree> _octrees;
-   std::vector<Octree> _batch_octrees;
-   std::vector<int> _batch_labels;
-   std::vector<std::string> _file_names;
    std::vector<int> _model_labels;
-
-   bool _done_initial_reshape;
-   int _model_counter;
-   int _current_model_ind;
 };
 
 }  // namespace caffe
@@ -29,15 +29,33 @@ class OGNDownConvLayer : public OGNLayer<Dtype> {
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
 
   void propagate_keys_cpu();
+  void next_level_keys_cpu(int batch_ind, OGNLayer<Dtype>* key_layer);
+  void propagate_sample_keys_cpu(int batch_ind);
   void resize_computation_buffers_cpu(int batch_num_pixels);
   void backward_cpu_gemm(const Dtype* top_diff, const Dtype* weights, Dtype* col_buff);
   void backward_cpu_bias(Dtype* bias, const Dtype* input);
   void weight_cpu_gemm(const Dtype* input, const Dtype* output, Dtype* weights);
+  // the rulebooks of all samples, shared with the other layers on the
+  // same key layer; get_rulebook(n) is the one of sample n
+  void prepare_rulebooks_cpu();
+  const OctreeRulebook& get_rulebook(int batch_ind) { return *_sample_rulebooks[batch_ind]; }
   void col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
   void im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
+  // the same on the num_cols wide col buffer starting at col_buff
+  void col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top,
+      const Dtype* col_buff, int num_cols);
+  void im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top,
+      Dtype* col_buff, int num_cols);
   void forward_cpu_bias(Dtype* output, const Dtype* bias);
   void forward_cpu_gemm(const Dtype* weights, const Dtype* input, Dtype* output);
 
+  // fuse_batch: the output cells of all samples side by side,
+  // _column_offsets[n] being the first of sample n
+  int fuse_columns_cpu();
+  void forward_fused_cpu(const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top);
+  void backward_fused_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+
   vector<int> _weight_shape;
   vector<int> _bias_shape;
   vector<int> _col_buffer_shape;
@@ -46,6 +64,11 @@ class OGNDownConvLayer : public OGNLayer<Dtype> {
 
   Blob<Dtype> _col_buffer;
   Blob<Dtype> _bias_multiplier;
+  vector<const OctreeRulebook*> _sample_rulebooks;
+
+  bool _fuse_batch;
+  vector<int> _column_offsets;
+  Blob<Dtype> _fused_features;
 
   int _num_input_pixels;
   int _num_output_pixels;
@@ -1,19 +1,51 @@
 #ifndef OGN_LAYER_HPP_
 #define OGN_LAYER_HPP_
 
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/function.hpp>
+
 #include "caffe/layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
 
 #include "image_tree_tools/image_tree_tools.h"
 
 namespace caffe {
 
+/// Threads of the CPU loops of the OGN layers, 0 (the default) for the
+/// hardware threads divided by Caffe::solver_count(). Every solver thread
+/// runs its loops on a pool of that many threads, started once. The loops
+/// run over samples or over ranges of cells_per_task cells in Morton order,
+/// and every cell is written by one task only, so the results do not depend
+/// on either setting.
+void set_ogn_threads(int num_threads, int cells_per_task = 4096);
+/// Threads of the calling solver thread's loops.
+int ogn_num_threads();
+int ogn_cells_per_task();
+
+/// Calls task(i) for every i < num_tasks, e.g. for every sample, on
+/// ogn_num_threads() threads unless the num_cells cells that the tasks
+/// cover in all fit into a single task.
+void ogn_parallel_for(int num_tasks, int num_cells,
+    const boost::function<void(int)>& task);
+
+/// Calls task(n, begin, end) for ranges [begin, end) of at most
+/// ogn_cells_per_task() cells that cover the num_cells[n] cells of every
+/// sample n, on ogn_num_threads() threads.
+void ogn_parallel_for_cells(const std::vector<int>& num_cells,
+    const boost::function<void(int, int, int)>& task);
+
 template <typename Dtype>
 class OGNLayer : public Layer<Dtype> {
 
 public:
   explicit OGNLayer(const LayerParameter& param)
-      : Layer<Dtype>(param) {}
+      : Layer<Dtype>(param), _rulebook_ms(0), _rulebook_builds(0),
+        _rulebook_reuses(0) {}
 
   //TODO: make these references constant
   GeneralOctree<int>& get_keys_octree(int batch_ind)
@@ -28,12 +60,99 @@ public:
 
   int get_level() {return _level;}
 
+  /// Rulebooks of a convolution of the given kind and filter size on the
+  /// key octrees of the samples n < rows.size(), built from rows[n] and
+  /// lookup[n] (see build_octree_rulebook) when they are first asked for,
+  /// all samples together on ogn_num_threads() threads. Every layer whose
+  /// key_layer is this one gets the same rulebooks until the key octrees
+  /// change, i.e. once per iteration, in forward and backward.
+  void get_rulebooks(OctreeRulebookKind kind, int filter_size,
+      const std::vector<const GeneralOctree<int>*>& rows,
+      const std::vector<const GeneralOctree<int>*>& lookup,
+      std::vector<const OctreeRulebook*>& rulebooks);
+
+  /// Time spent building rulebooks on the key octrees of this layer, and
+  /// how often they were built and reused.
+  double rulebook_ms() const { return _rulebook_ms; }
+  int rulebook_builds() const { return _rulebook_builds; }
+  int rulebook_reuses() const { return _rulebook_reuses; }
+  void reset_rulebook_stats()
+  {
+      _rulebook_ms = 0;
+      _rulebook_builds = 0;
+      _rulebook_reuses = 0;
+  }
+
 protected:
 
+  /// Fills the num_cols wide col buffer of a convolution on the channels x
+  /// pixels features of a sample from its rulebook, with zeros where a
+  /// neighbour is missing. Ranges of columns run on different threads.
+  static void im2col_rulebook_cpu(const OctreeRulebook& rulebook, const Dtype* features,
+      int channels, int pixels, Dtype* col_buff, int num_cols);
+
+  /// The transpose of im2col_rulebook_cpu: every feature cell of the rulebook
+  /// is set to the sum of the col buffer entries that read it, gathered in
+  /// offset order. Ranges of cells run on different threads.
+  static void col2im_rulebook_cpu(const OctreeRulebook& rulebook, const Dtype* col_buff,
+      int num_cols, int channels, int pixels, Dtype* features);
+
+  /// Copies the first offsets[n+1] - offsets[n] cells of every sample n of
+  /// a [N x channels x pixels] blob side by side into the columns of a
+  /// [channels x offsets[N]] matrix, to run one GEMM for the whole batch.
+  static void gather_columns_cpu(const Dtype* features, int channels, int pixels,
+      const std::vector<int>& offsets, Dtype* columns)
+  {
+      const int batch_size = offsets.size() - 1;
+      const int num_columns = offsets[batch_size];
+      for(int n=0; n<batch_size; n++)
+      {
+          for(int c=0; c<channels; c++)
+          {
+              caffe_copy(offsets[n + 1] - offsets[n], features + (n * channels + c) * pixels,
+                  columns + c * num_columns + offsets[n]);
+          }
+      }
+  }
+
+  /// The inverse of gather_columns_cpu, clearing the padding cells.
+  static void scatter_columns_cpu(const Dtype* columns, int channels, int pixels,
+      const std::vector<int>& offsets, Dtype* features)
+  {
+      const int batch_size = offsets.size() - 1;
+      const int num_columns = offsets[batch_size];
+      for(int n=0; n<batch_size; n++)
+      {
+          const int sample_columns = offsets[n + 1] - offsets[n];
+          for(int c=0; c<channels; c++)
+          {
+              Dtype* row = features + (n * channels + c) * pixels;
+              caffe_copy(sample_columns, columns + c * num_columns + offsets[n], row);
+              caffe_set(pixels - sample_columns, Dtype(0), row + sample_columns);
+          }
+      }
+  }
+
   std::vector<GeneralOctree<int> > _octree_keys;
   std::vector<GeneralOctree<int> > _octree_prop;
   int _level;
 
+private:
+  struct CachedRulebook
+  {
+      CachedRulebook() : valid(false) {}
+
+      GeneralOctree<int> keys;
+      OctreeRulebook rulebook;
+      bool valid;
+  };
+
+  // by kind and filter size, then by sample
+  std::map<std::pair<int, int>, std::vector<CachedRulebook> > _rulebooks;
+  double _rulebook_ms;
+  int _rulebook_builds;
+  int _rulebook_reuses;
+
 };
 
 }  // namespace caffe
@@ -22,6 +22,10 @@ class OGNLevelPredLayer : public OGNLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  void forward_sample_cpu(int n, const Dtype* input_arr, Dtype* output_arr,
+      OGNLayer<Dtype>* l_ptr);
+  void backward_sample_cpu(int n, const Dtype* input_arr, Dtype* output_arr,
+      OGNLayer<Dtype>* l_ptr);
  
   string _key_layer_name;
 
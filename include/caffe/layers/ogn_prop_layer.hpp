@@ -29,6 +29,12 @@ class OGNPropLayer : public OGNLayer<Dtype> {
 
   void compute_pixel_propagation(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
+  void propagate_sample_cpu(int bt, const Dtype* input_values, int pixels,
+      OGNLayer<Dtype>* key_layer);
+  void forward_cells_cpu(int bt, int begin, int end, const Dtype* input_features,
+      int channels, int input_pixels, Dtype* output_features, OGNLayer<Dtype>* key_layer);
+  void backward_cells_cpu(int bt, int begin, int end, const Dtype* top_diff,
+      Dtype* bottom_diff, int channels, int pixels, OGNLayer<Dtype>* key_layer);
 
   virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
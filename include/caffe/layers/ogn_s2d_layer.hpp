@@ -22,6 +22,10 @@ class OGNS2DLayer : public OGNLayer<Dtype> {
       const vector<Blob<Dtype>*>& top);
   virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom);
+  void forward_cells_cpu(int n, int begin, int end, const Dtype* input_arr,
+      Dtype* output_arr, OGNLayer<Dtype>* l_ptr);
+  void backward_cells_cpu(int n, int begin, int end, const Dtype* input_arr,
+      Dtype* output_arr, OGNLayer<Dtype>* l_ptr);
  
   string _key_layer_name;
 
@@ -2,8 +2,14 @@
 #define IMAGE_TREE_TOOLS_H_
 
 #include "zindex.h"
+#include "zindex_batch.h"
 #include "voxel_grid.h"
 #include "octree.h"
+#include "octree_augment.h"
+#include "octree_pack.h"
+#include "octree_store.h"
+#include "octree_shm.h"
+#include "octree_rulebook.h"
 #include "common_util.h"
 
 #define CLASS_MIXED 2
@@ -14,7 +20,7 @@
 
 #define OGN_NUM_CLASSES 3
 
-typedef unsigned int KeyType;
+typedef OctreeKey KeyType;
 typedef byte SignalType;
 typedef OccupancyVoxelGrid VoxelGrid;
 typedef GeneralOctree<SignalType> Octree;
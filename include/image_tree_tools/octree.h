@@ -7,7 +7,10 @@
 #include <string>
 #include <sstream>
 #include <fstream>
-#include <tr1/unordered_map>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <cstddef>
 
 #include <math.h>
 
@@ -16,7 +19,11 @@
 #include <boost/archive/text_oarchive.hpp>
 
 #include "zindex.h"
+#include "zindex_batch.h"
+#include "octree_file.h"
 #include "voxel_grid.h"
+#include "octree_builder.h"
+#include "shared_array.h"
 #include "common_util.h"
 
 struct OctreeCoord
@@ -27,19 +34,94 @@ struct OctreeCoord
     int l;
 };
 
-template <class VALUE>
+/// Morton key type used by default. 32-bit keys address up to level 10
+/// (1024^3); building with USE_OGN_64BIT_KEYS raises the limit to level 21.
+#ifdef USE_OGN_64BIT_KEYS
+typedef uint64_t OctreeKey;
+#else
+typedef uint32_t OctreeKey;
+#endif
+
+/// Linear octree: cells are kept in two contiguous arrays (keys and values)
+/// sorted by Morton key. Lookups are binary searches over the key array and
+/// iteration visits cells in Z-order, so consumers that assign feature
+/// columns in iteration order get spatially coherent column layouts.
+template <class VALUE, class KEY_TYPE = OctreeKey>
 class GeneralOctree
 {
 
 public:
-  typedef unsigned int KEY;
+  typedef KEY_TYPE KEY;
+
+  /// Proxy returned when dereferencing an iterator. Mimics std::pair so
+  /// that existing code can keep using it->first / it->second.
+  template <class V>
+  class ElementRef
+  {
+  public:
+    ElementRef(const KEY& k, V& v) : first(k), second(v) {}
+    const ElementRef* operator->() const { return this; }
+
+    const KEY& first;
+    V& second;
+  };
+
+  template <class V>
+  class Iterator
+  {
+  public:
+    Iterator() : _key(0), _value(0) {}
+    Iterator(const KEY* key, V* value) : _key(key), _value(value) {}
+    template <class W>
+    Iterator(const Iterator<W>& other) : _key(other.key_ptr()), _value(other.value_ptr()) {}
+
+    ElementRef<V> operator*() const { return ElementRef<V>(*_key, *_value); }
+    ElementRef<V> operator->() const { return ElementRef<V>(*_key, *_value); }
+
+    Iterator& operator++() { ++_key; ++_value; return *this; }
+    Iterator operator++(int) { Iterator tmp(*this); ++(*this); return tmp; }
+    Iterator& operator--() { --_key; --_value; return *this; }
+    Iterator operator--(int) { Iterator tmp(*this); --(*this); return tmp; }
+    Iterator& operator+=(std::ptrdiff_t n) { _key += n; _value += n; return *this; }
+    Iterator operator+(std::ptrdiff_t n) const { Iterator tmp(*this); tmp += n; return tmp; }
+    std::ptrdiff_t operator-(const Iterator& other) const { return _key - other._key; }
+
+    bool operator==(const Iterator& other) const { return _key == other._key; }
+    bool operator!=(const Iterator& other) const { return _key != other._key; }
+
+    const KEY* key_ptr() const { return _key; }
+    V* value_ptr() const { return _value; }
+
+  private:
+    const KEY* _key;
+    V* _value;
+  };
+
+  // copies of an octree share their arrays (see shared_array.h), so
+  // iteration is read-only; values are changed through add_element
+  typedef Iterator<const VALUE> iterator;
+  typedef Iterator<const VALUE> const_iterator;
 
 private:
-  typedef std::tr1::unordered_map<KEY, VALUE> HashTable;
+  template <class V, class K> friend class GeneralOctree;
 
-  HashTable _hash_table;
+  SharedArray<KEY> _keys;
+  SharedArray<VALUE> _values;
   int _max_level;
 
+  /// Index of the first key not less than the given one.
+  int lower_bound(KEY key) const
+  {
+      return std::lower_bound(_keys.begin(), _keys.end(), key) - _keys.begin();
+  }
+
+  int find(KEY key) const
+  {
+      int ind = lower_bound(key);
+      if(ind < int(_keys.size()) && _keys[ind] == key) return ind;
+      return -1;
+  }
+
 public:
 
   static int MIN_LEVEL() { return 0; }
@@ -56,8 +138,8 @@ public:
   static bool IS_VALID_KEY(const KEY& key)
   {
     if(key == INVALID_KEY()) return false;
-    int lz = __builtin_clz(key) - 1;
-    if(lz % 3) return false;
+    int msb = sizeof(KEY) * 8 - 1 - count_leading_zeros(key);
+    if(msb % 3) return false;
     return true;
   }
 
@@ -66,10 +148,152 @@ public:
       _max_level = max_level;
   }
 
-  typedef typename HashTable::iterator iterator;
-  typedef typename HashTable::const_iterator const_iterator;
-  iterator begin() { return _hash_table.begin(); }
-  iterator end() { return _hash_table.end(); }
+  const_iterator begin() const { return _keys.empty() ? const_iterator() : const_iterator(&_keys[0], &_values[0]); }
+  const_iterator end() const { return begin() + _keys.size(); }
+
+  /// Sorted key array, e.g. for merging or building derived structures.
+  const std::vector<KEY>& keys() const { return _keys.get(); }
+  const std::vector<VALUE>& values() const { return _values.get(); }
+
+  int max_level() const { return _max_level; }
+  void set_max_level(int max_level) { _max_level = max_level; }
+
+  /// True if both octrees use the same key and value arrays, and so hold
+  /// the same cells, without comparing them. While a copy is kept, the
+  /// arrays cannot change: writes go to a copy (see SharedArray::mutate).
+  bool shares_arrays(const GeneralOctree& other) const
+  {
+      return &_keys.get() == &other._keys.get() && &_values.get() == &other._values.get() &&
+             _max_level == other._max_level;
+  }
+
+  void reserve(int num_elements)
+  {
+      _keys.mutate().reserve(num_elements);
+      _values.mutate().reserve(num_elements);
+  }
+
+  void clear()
+  {
+      _keys.clear();
+      _values.clear();
+  }
+
+  /// Bulk construction from keys that are already sorted in ascending
+  /// Morton order and free of duplicates. Runs in linear time.
+  void build_from_sorted(const std::vector<KEY>& keys, const std::vector<VALUE>& values)
+  {
+      _keys.assign(keys);
+      _values.assign(values);
+  }
+
+  /// Like build_from_sorted, but takes over the arrays instead of copying
+  /// them; keys and values are left empty.
+  void take_sorted(std::vector<KEY>& keys, std::vector<VALUE>& values)
+  {
+      _keys.take(keys);
+      _values.take(values);
+  }
+
+  /// Like take_sorted, for the cells of levels 0..level of an octree that
+  /// goes deeper. The subdivided cells of that level are added as leaves
+  /// with internal_value, e.g. CLASS_MIXED.
+  ///
+  /// Which cells are subdivided follows from the coarser levels alone: a
+  /// subdivided cell has all 8 children, as leaves or subdivided, which holds
+  /// for octrees built from voxel grids. So finer levels are never needed.
+  void take_levels(std::vector<KEY>& keys, std::vector<VALUE>& values, int level, VALUE internal_value)
+  {
+      // subdivided cells of level l are the children of those of level l-1
+      // that are not leaves; the root is subdivided unless it is a leaf
+      std::vector<KEY> internal, children;
+      if(keys.empty() || keys[0] != KEY(1)) internal.push_back(KEY(1));
+      size_t begin = 0;
+      for(int l=1; l<=level; l++)
+      {
+          begin = std::lower_bound(keys.begin(), keys.end(), KEY(1) << 3 * l) - keys.begin();
+          const size_t end = l < level ? std::lower_bound(keys.begin(), keys.end(), KEY(1) << 3 * (l + 1)) - keys.begin()
+                                       : keys.size();
+          children.clear();
+          size_t leaf = begin;
+          for(size_t i=0; i<internal.size(); i++)
+          {
+              for(int c=0; c<8; c++)
+              {
+                  const KEY child = child_key(internal[i], c);
+                  while(leaf < end && keys[leaf] < child) leaf++;
+                  if(leaf == end || keys[leaf] != child) children.push_back(child);
+              }
+          }
+          internal.swap(children);
+      }
+
+      // merge them into the leaves of the last level
+      std::vector<KEY> leaf_keys(keys.begin() + begin, keys.end());
+      std::vector<VALUE> leaf_values(values.begin() + begin, values.end());
+      keys.resize(begin);
+      values.resize(begin);
+      keys.reserve(begin + leaf_keys.size() + internal.size());
+      values.reserve(begin + leaf_keys.size() + internal.size());
+      size_t i = 0, j = 0;
+      while(i < leaf_keys.size() || j < internal.size())
+      {
+          if(j == internal.size() || (i < leaf_keys.size() && leaf_keys[i] < internal[j]))
+          {
+              keys.push_back(leaf_keys[i]);
+              values.push_back(leaf_values[i++]);
+          }
+          else
+          {
+              keys.push_back(internal[j++]);
+              values.push_back(internal_value);
+          }
+      }
+
+      take_sorted(keys, values);
+      _max_level = level;
+  }
+
+  /// Drops the levels below level, see take_levels.
+  void truncate(int level, VALUE internal_value)
+  {
+      if(level >= _max_level || _keys.empty()) return;
+      const int end = lower_bound(KEY(1) << 3 * (level + 1));
+      std::vector<KEY> keys(_keys.begin(), _keys.begin() + end);
+      std::vector<VALUE> values(_values.begin(), _values.begin() + end);
+      take_levels(keys, values, level, internal_value);
+  }
+
+  /// Shares the key array of another octree without copying it and takes
+  /// over values, one per key. Used for octrees that map the cells of a
+  /// feature map to their columns.
+  template <class V>
+  void build_from_keys(const GeneralOctree<V, KEY>& other, std::vector<VALUE>& values)
+  {
+      _keys = other._keys;
+      _values.take(values);
+      _max_level = other._max_level;
+  }
+
+  /// Bulk construction from an arbitrary list of elements. When a key occurs
+  /// more than once the last occurrence wins, like repeated add_element calls.
+  void build_from_unsorted(const std::vector<std::pair<KEY, VALUE> >& elements)
+  {
+      std::vector<std::pair<KEY, int> > order(elements.size());
+      for(size_t i=0; i<elements.size(); i++) order[i] = std::make_pair(elements[i].first, int(i));
+      std::sort(order.begin(), order.end());
+
+      clear();
+      reserve(order.size());
+      std::vector<KEY>& keys = _keys.mutate();
+      std::vector<VALUE>& values = _values.mutate();
+      for(size_t i=0; i<order.size(); i++)
+      {
+          if(i+1 < order.size() && order[i+1].first == order[i].first) continue;
+          keys.push_back(order[i].first);
+          values.push_back(elements[order[i].second].second);
+      }
+  }
 
   static int resolution_from_level(int level)
   {
@@ -78,9 +302,12 @@ public:
 
   static int compute_level(const KEY& key)
   {
-      return (MAX_LEVEL() * 3 - __builtin_clz(key) + 1) / 3;
+      return (int(sizeof(KEY) * 8) - 1 - count_leading_zeros(key)) / 3;
   }
 
+  static KEY parent_key(KEY key) { return key >> 3; }
+  static KEY child_key(KEY key, int child) { return (key << 3) | KEY(child); }
+
   static KEY compute_key(const OctreeCoord& c)
   {
       if(!IS_VALID_COORD(c)) return INVALID_KEY();
@@ -100,21 +327,126 @@ public:
     return c;
   }
 
-  int num_elements() {return _hash_table.size();}
+  int num_elements() const {return _keys.size();}
 
+  /// Inserts or overwrites a cell. Appending keys in ascending order is
+  /// amortized O(1); out-of-order keys are inserted in place.
   void add_element(KEY key, VALUE value)
   {
-      _hash_table[key] = value;
+      std::vector<KEY>& keys = _keys.mutate();
+      std::vector<VALUE>& values = _values.mutate();
+      if(keys.empty() || key > keys.back())
+      {
+          keys.push_back(key);
+          values.push_back(value);
+          return;
+      }
+
+      int ind = lower_bound(key);
+      if(keys[ind] == key)
+      {
+          values[ind] = value;
+      }
+      else
+      {
+          keys.insert(keys.begin() + ind, key);
+          values.insert(values.begin() + ind, value);
+      }
+  }
+
+  std::pair<KEY, VALUE> get_element(int i) const
+  {
+      return std::pair<KEY, VALUE>(_keys[i], _values[i]);
+  }
+
+  /// Enumerates the NBH_SIZE^3 neighbor keys of key (NBH_SIZE 2: offsets
+  /// 0..1, NBH_SIZE 3: offsets -1..1, x-major like get_neighbor_keys) into a
+  /// caller-provided buffer. Offsets are applied to the interleaved key by
+  /// dilated addition, so the key is never decoded. Neighbors outside the
+  /// grid are INVALID_KEY; whether they exist in the octree is not checked.
+  template <int NBH_SIZE>
+  static void neighbor_candidates(KEY key, KEY* neighbors)
+  {
+      const int min_ind = NBH_SIZE % 2 ? -NBH_SIZE / 2 : 0;
+      const KEY level_bit = KEY(1) << 3 * compute_level(key);
+      const KEY lane_x = (level_bit - 1) / 7;
+      const KEY code = key ^ level_bit;
+
+      KEY lane_vals[3][NBH_SIZE];
+      bool lane_valid[3][NBH_SIZE];
+      for(int axis=0; axis<3; axis++)
+      {
+          const KEY lane = lane_x << axis;
+          for(int o=0; o<NBH_SIZE; o++)
+              lane_valid[axis][o] = dilated_offset(code & lane, lane, min_ind + o, lane_vals[axis][o]);
+      }
+
+      int ind = 0;
+      for(int i=0; i<NBH_SIZE; i++)
+      {
+          for(int j=0; j<NBH_SIZE; j++)
+          {
+              for(int k=0; k<NBH_SIZE; k++)
+              {
+                  if(lane_valid[0][i] && lane_valid[1][j] && lane_valid[2][k])
+                      neighbors[ind++] = level_bit | lane_vals[0][i] | lane_vals[1][j] | lane_vals[2][k];
+                  else neighbors[ind++] = INVALID_KEY();
+              }
+          }
+      }
+  }
+
+  /// Like get_neighbor_keys, but fills a buffer of NBH_SIZE^3 keys and
+  /// returns the number of neighbors present in the octree.
+  template <int NBH_SIZE>
+  int get_neighbor_keys(KEY key, KEY* neighbors) const
+  {
+      int indices[NBH_SIZE * NBH_SIZE * NBH_SIZE];
+      int count = get_neighbor_indices<NBH_SIZE>(key, indices);
+      for(int el=0; el<NBH_SIZE * NBH_SIZE * NBH_SIZE; el++)
+          neighbors[el] = indices[el] == -1 ? INVALID_KEY() : _keys[indices[el]];
+      return count;
   }
 
-  std::pair<KEY, VALUE> get_element(int i)
+  /// Element indices of the NBH_SIZE^3 neighbors of key, -1 where a neighbor
+  /// is missing. values()[index] is what get_value would return for it.
+  template <int NBH_SIZE>
+  int get_neighbor_indices(KEY key, int* indices) const
   {
-      typename std::map<KEY, VALUE>::iterator it = _hash_table.begin();
-      std::advance(it, i);
-      return *it;
+      const int nbh_count = NBH_SIZE * NBH_SIZE * NBH_SIZE;
+      if(_max_level > compute_level(key)) return get_neighbor_indices(key, NBH_SIZE, indices);
+
+      KEY neighbors[nbh_count];
+      neighbor_candidates<NBH_SIZE>(key, neighbors);
+      int count = 0;
+      for(int el=0; el<nbh_count; el++)
+      {
+          indices[el] = neighbors[el] == INVALID_KEY() ? -1 : find(neighbors[el]);
+          if(indices[el] != -1) count++;
+      }
+      return count;
+  }
+
+  /// Runtime filter size version; the buffer has to hold nbh_size^3 entries.
+  int get_neighbor_indices(KEY key, int nbh_size, int* indices) const
+  {
+      if(_max_level <= compute_level(key))
+      {
+          if(nbh_size == 2) return get_neighbor_indices<2>(key, indices);
+          if(nbh_size == 3) return get_neighbor_indices<3>(key, indices);
+      }
+
+      std::vector<KEY> neighbors = get_neighbor_keys(key, nbh_size);
+      int count = 0;
+      for(size_t el=0; el<neighbors.size(); el++)
+      {
+          indices[el] = neighbors[el] == INVALID_KEY() ? -1 : find(neighbors[el]);
+          if(indices[el] != -1) count++;
+      }
+      return count;
   }
 
-  std::vector<KEY> get_neighbor_keys(KEY key, int nbh_size)
+  std::vector<KEY> get_neighbor_keys(KEY key, int nbh_size) const
   {
     std::vector<KEY> ret;
 
@@ -141,10 +473,8 @@ public:
             OctreeCoord nb_c;
             nb_c.x = c.x+i; nb_c.y = c.y+j; nb_c.z = c.z+k; nb_c.l = c.l;
             KEY new_code = compute_key(nb_c);
-            //typename std::map<KEY, VALUE>::iterator it = _hash_table.find(new_code);
-            typename std::tr1::unordered_map<KEY, VALUE>::iterator it = _hash_table.find(new_code);
 
-            if(it != _hash_table.end()) ret.push_back(it->first);
+            if(find(new_code) != -1) ret.push_back(new_code);
             else ret.push_back(INVALID_KEY());
           }
         }
@@ -154,10 +484,10 @@ public:
     return ret;
   }
 
-  VALUE get_value(KEY key, bool use_vg_info = false)
+  VALUE get_value(KEY key, bool use_vg_info = false) const
   {
-      typename HashTable::iterator it = _hash_table.find(key);
-      if(it != _hash_table.end()) return it->second;
+      int ind = find(key);
+      if(ind != -1) return _values[ind];
       else
       {
           if(use_vg_info)
@@ -167,162 +497,178 @@ public:
               for(int i=0; i<level; i++)
               {
                   inner_key >>= 3;
-                  it = _hash_table.find(inner_key);
-                  if(it != _hash_table.end())
-                    return it->second;
+                  ind = find(inner_key);
+                  if(ind != -1)
+                    return _values[ind];
               }
           }
           return -1;
       }
   }
 
-  GeneralVoxelGrid<VALUE> to_voxel_grid()
+  /// Expands the leaves into a dense grid of resolution 2^max_level.
+  GeneralVoxelGrid<VALUE> to_voxel_grid() const
   {
-      int resolution = pow(2, _max_level);
+      int resolution = _max_level < 0 ? 0 : 1 << _max_level;
       GeneralVoxelGrid<VALUE> ret(resolution, resolution, resolution);
+      for(int s=0; s<num_voxel_subtrees(); s++) to_voxel_subtree(ret, s);
+      return ret;
+  }
+
+  /// to_voxel_grid works on the subtrees below level 2 independently; they
+  /// cover disjoint blocks of the grid and may be filled concurrently.
+  int num_voxel_subtrees() const
+  {
+      if(_max_level < 0) return 0;
+      return 1 << 3 * std::min(2, _max_level);
+  }
 
-      int counter = 0;
-      for(typename std::map<KEY, VALUE>::iterator iter = _hash_table.begin(); iter != _hash_table.end(); ++iter)
+  void to_voxel_subtree(GeneralVoxelGrid<VALUE>& vg, int ind) const
+  {
+      const int split_level = std::min(2, _max_level);
+      const KEY subtree_key = (KEY(1) << 3 * split_level) | KEY(ind);
+
+      // a leaf at or above the split level covers the whole subtree
+      for(int l=0; l<=split_level; l++)
       {
-          int level = compute_level(iter->first);
-
-          KEY code = (iter->first & ~(KEY(1) << level * 3)) << (_max_level - level) * 3;
-          OctreeCoord c;
-          c.l = level;
-          KEY x, y, z;
-          inverse_morton_3d(x, y, z, code);
-          c.x = x;
-          c.y = y;
-          c.z = z;
-
-          int len = int(pow(2, _max_level - level));
-          for(int i=0; i < len; i++)
+          int el = find(subtree_key >> 3 * (split_level - l));
+          if(el == -1) continue;
+          fill_voxel_block(vg, subtree_key, _values[el]);
+          return;
+      }
+
+      // below it, the leaves of each level form one contiguous key range,
+      // decoded in blocks by the batched morton kernels
+      const int block = 256;
+      KEY codes[block];
+      uint32_t x[block], y[block], z[block];
+      for(int l=split_level+1; l<=_max_level; l++)
+      {
+          const KEY level_bit = KEY(1) << 3 * l;
+          int begin = lower_bound(subtree_key << 3 * (l - split_level));
+          int end = lower_bound((subtree_key + 1) << 3 * (l - split_level));
+          for(int first=begin; first<end; first+=block)
           {
-              for(int j=0; j < len; j++)
-              {
-                  for(int k=0; k < len; k++)
-                  {
-                      if(iter->second) ret.set_element(i, j, k, iter->second);
-                  }
-              }
+              const int n = std::min(block, end - first);
+              for(int i=0; i<n; i++) codes[i] = _keys[first + i] ^ level_bit;
+              inverse_morton_3d_batch(codes, x, y, z, n);
+              for(int i=0; i<n; i++) fill_voxel_block(vg, x[i], y[i], z[i], l, _values[first + i]);
           }
-          counter++;
       }
-
-      return ret;
   }
 
+  /// Converts a dense grid into leaves, merging uniform 2x2x2 blocks down to
+  /// min_level. See octree_builder.h; parallel version in octree_parallel.h.
   void from_voxel_grid(GeneralVoxelGrid<VALUE>& vg, int min_level)
   {
-      int level = log2((float)vg.depth());
-      int dim = vg.depth();
+      VoxelOctreeBuilder<VALUE, KEY> builder(vg, min_level);
+      for(int s=0; s<builder.num_subtrees(); s++) builder.build_subtree(s);
+      from_builder(builder);
+  }
 
-      _max_level = level;
+  /// Takes the leaves of a builder (octree_builder.h) whose subtrees have
+  /// all been built.
+  template <class BUILDER>
+  void from_builder(BUILDER& builder)
+  {
+      clear();
+      builder.finish(_keys.mutate(), _values.mutate());
+      _max_level = builder.leaf_level();
+  }
 
-      KEY *keys_arr = new KEY[dim*dim*dim];
-      VALUE *values_arr = new VALUE[dim*dim*dim];
+  /// Writes the binary .ot format (see octree_file.h).
+  bool to_file(std::string fname) const
+  {
+      std::vector<char> buffer;
+      to_buffer(buffer);
+      std::ofstream ff(fname.c_str(), std::ios_base::binary);
+      ff.write(&buffer[0], buffer.size());
+      ff.close();
+      return !ff.fail();
+  }
 
-      //initially fill the hash map
-      for(unsigned int i=0; i<vg.depth(); i++)
+  /// Serializes the octree in the binary .ot format into buffer.
+  void to_buffer(std::vector<char>& buffer) const
+  {
+      std::vector<OctreeFileLevel> levels(MAX_LEVEL() + 1);
+      for(size_t i=0; i<levels.size(); i++)
       {
-          for(unsigned int j=0; j<vg.width(); j++)
-          {
-              for(unsigned int k=0; k<vg.height(); k++)
-              {
-                  VALUE val = vg.get_element(i, j, k);
-                  OctreeCoord crd;
-                  crd.x = i; crd.y = j; crd.z = k; crd.l = level;
-                  KEY key = compute_key(crd);
-                  keys_arr[i*dim*dim + j*dim + k] = key;
-                  values_arr[i*dim*dim + j*dim + k] = val;
-              }
-          }
+          levels[i].begin = lower_bound(KEY(1) << 3 * i);
+          levels[i].count = 0;
       }
-
-      while(level > min_level)
+      for(size_t i=0; i+1<levels.size(); i++) levels[i].count = levels[i+1].begin - levels[i].begin;
+      levels.back().count = _keys.size() - levels.back().begin;
+
+      OctreeFileHeader header;
+      memcpy(header.magic, OCTREE_FILE_MAGIC(), 4);
+      header.version = OCTREE_FILE_VERSION;
+      header.key_size = sizeof(KEY);
+      header.value_size = sizeof(VALUE);
+      header.max_level = _max_level;
+      header.num_levels = levels.size();
+      header.num_elements = _keys.size();
+
+      const size_t levels_size = sizeof(OctreeFileLevel) * levels.size();
+      const size_t keys_size = sizeof(KEY) * _keys.size();
+      buffer.resize(sizeof(header) + levels_size + keys_size + sizeof(VALUE) * _values.size());
+      char* out = &buffer[0];
+      memcpy(out, &header, sizeof(header));
+      memcpy(out + sizeof(header), &levels[0], levels_size);
+      if(!_keys.empty())
       {
-          int step = pow(2, _max_level - level + 1);
-          for(unsigned int i=0; i<vg.depth(); i+=step)
-          {
-              for(unsigned int j=0; j<vg.width(); j+=step)
-              {
-                  for(unsigned int k=0; k<vg.height(); k+=step)
-                  {
-                      KEY key = keys_arr[i*dim*dim + j*dim + k];
-                      if(compute_level(key) == level)
-                      {
-                          VALUE comp_val = 0;
-                          int el_count = 0;
-                          for(int ii=0; ii<2; ii++)
-                          {
-                              for(int jj=0; jj<2; jj++)
-                              {
-                                  for(int kk=0; kk<2; kk++)
-                                  {
-                                      KEY comp_key = keys_arr[(i+ii*step/2)*dim*dim + (j+jj*step/2)*dim + k+kk*step/2];
-                                      int comp_lev = compute_level(comp_key);
-                                      if(comp_lev == level)
-                                      {
-                                          VALUE val = values_arr[(i+ii*step/2)*dim*dim + (j+jj*step/2)*dim + k+kk*step/2];
-                                          if(val == CLASS_FILLED) comp_val += 1;
-                                          el_count += 1;
-                                      }
-                                  }
-                              }
-                          }
-
-                          if( (comp_val==0 || comp_val==8) && el_count==8 )
-                          {
-                              KEY new_key = key >> 3;
-                              for(int ii=0; ii<step; ii++)
-                              {
-                                  for(int jj=0; jj<step; jj++)
-                                  {
-                                      for(int kk=0; kk<step; kk++)
-                                      {
-                                          keys_arr[(i+ii)*dim*dim + (j+jj)*dim + k+kk] = new_key;
-                                      }
-                                  }
-                              }
-                          }
-                      }
-                  }
-              }
-          }
-          level--;
+          memcpy(out + sizeof(header) + levels_size, &_keys[0], keys_size);
+          memcpy(out + sizeof(header) + levels_size + keys_size, &_values[0], sizeof(VALUE) * _values.size());
       }
+  }
 
-      for(unsigned int i=0; i<vg.depth(); i++)
+  /// Writes the legacy boost text archive format.
+  bool to_text_file(std::string fname) const
+  {
+      std::ofstream ff(fname.c_str(), std::ios_base::binary);
       {
-          for(unsigned int j=0; j<vg.width(); j++)
-          {
-              for(unsigned int k=0; k<vg.height(); k++)
-              {
-                  KEY key = keys_arr[i*dim*dim + j*dim + k];
-                  _hash_table[key] = values_arr[i*dim*dim + j*dim + k];
-              }
-          }
+        boost::archive::text_oarchive oarch(ff);
+        std::map<KEY, VALUE> tmp_hash;
+        for(size_t i=0; i<_keys.size(); i++)
+        {
+          tmp_hash.insert(tmp_hash.end(), std::pair<KEY, VALUE>(_keys[i], _values[i]));
+        }
+        oarch << tmp_hash;
       }
-
-      delete[] keys_arr;
-      delete[] values_arr;
+      ff.close();
+      return !ff.fail();
   }
 
-  void to_file(std::string fname)
+  /// Reads either format; binary files are memory mapped and copied as is.
+  /// With max_level >= 0, finer levels are dropped (see take_levels); binary
+  /// files are then only read up to that level.
+  bool from_file(std::string fname, int max_level = -1, VALUE internal_value = VALUE())
   {
-      std::ofstream ff(fname.c_str(), std::ios_base::binary);
-      boost::archive::text_oarchive oarch(ff);
-      std::map<KEY, VALUE> tmp_hash;
-      for(typename std::tr1::unordered_map<KEY, VALUE>::iterator it=_hash_table.begin(); it!=_hash_table.end(); it++)
+      MappedFile file;
+      if(!file.open(fname))
       {
-        tmp_hash[it->first] = it->second;
+          std::cout << "Error: cannot open octree file " << fname << std::endl;
+          return false;
       }
-      oarch << tmp_hash;
-      ff.flush();
-      ff.close();
+
+      if(is_binary_octree(file.data(), file.size()))
+      {
+          if(!from_buffer(file.data(), file.size(), max_level, internal_value))
+          {
+              std::cout << "Error: corrupt or incompatible octree file " << fname << std::endl;
+              return false;
+          }
+      }
+      else
+      {
+          file.close();
+          from_text_file(fname);
+          if(max_level >= 0) truncate(max_level, internal_value);
+      }
+      return true;
   }
 
-  void from_file(std::string fname)
+
+  void from_text_file(std::string fname)
   {
       std::ifstream ff(fname.c_str(), std::ios_base::binary);
       boost::archive::text_iarchive iarch(ff);
@@ -330,12 +676,135 @@ public:
       iarch >> tmp_map;
       ff.close();
 
+      clear();
+      reserve(tmp_map.size());
+      std::vector<KEY>& keys = _keys.mutate();
+      std::vector<VALUE>& values = _values.mutate();
       for(typename std::map<KEY, VALUE>::iterator it=tmp_map.begin(); it!=tmp_map.end(); it++)
       {
-        _hash_table.insert(std::pair<KEY, VALUE>(it->first, it->second));
-        int level = compute_level(it->first);
-        if(level > _max_level) _max_level = level;
+        keys.push_back(it->first);
+        values.push_back(it->second);
+      }
+      update_max_level();
+  }
+
+  /// Loads a binary octree that is already in memory (e.g. mapped). With
+  /// max_level >= 0, only the cells up to that level are copied, using the
+  /// level table, and the finer ones are never touched (see take_levels).
+  bool from_buffer(const char* data, size_t size, int max_level = -1, VALUE internal_value = VALUE())
+  {
+      if(!is_binary_octree(data, size)) return false;
+
+      OctreeFileHeader header;
+      memcpy(&header, data, sizeof(header));
+      if(header.version != OCTREE_FILE_VERSION || header.value_size != sizeof(VALUE)) return false;
+
+      size_t keys_offset = sizeof(OctreeFileHeader) + header.num_levels * sizeof(OctreeFileLevel);
+      size_t values_offset = keys_offset + header.num_elements * header.key_size;
+      if(values_offset + header.num_elements * sizeof(VALUE) > size) return false;
+
+      // levels are contiguous in the arrays, so coarse ones are a prefix
+      size_t num_elements = header.num_elements;
+      const bool truncated = max_level >= 0 && max_level < header.max_level && uint32_t(max_level) < header.num_levels;
+      if(truncated)
+      {
+          OctreeFileLevel level;
+          memcpy(&level, data + sizeof(OctreeFileHeader) + max_level * sizeof(OctreeFileLevel), sizeof(level));
+          num_elements = level.begin + level.count;
+          if(num_elements > header.num_elements) return false;
+      }
+
+      clear();
+      std::vector<KEY> keys(num_elements);
+      std::vector<VALUE> values(num_elements);
+      if(num_elements)
+      {
+          // files written with a different key width are converted on load;
+          // keys keep their numeric value, only too deep levels are rejected
+          if(header.key_size == sizeof(KEY))
+              memcpy(&keys[0], data + keys_offset, num_elements * sizeof(KEY));
+          else if(header.key_size == sizeof(uint32_t))
+              copy_keys(reinterpret_cast<const uint32_t*>(data + keys_offset), keys);
+          else if(header.key_size == sizeof(uint64_t))
+          {
+              if(!copy_keys(reinterpret_cast<const uint64_t*>(data + keys_offset), keys)) return false;
+          }
+          else return false;
+          memcpy(&values[0], data + values_offset, num_elements * sizeof(VALUE));
+      }
+      if(truncated)
+      {
+          take_levels(keys, values, max_level, internal_value);
+          return true;
+      }
+      take_sorted(keys, values);
+      if(header.max_level > _max_level) _max_level = header.max_level;
+      update_max_level();
+      return true;
+  }
+
+private:
+
+  template <class FILE_KEY>
+  static bool copy_keys(const FILE_KEY* src, std::vector<KEY>& keys)
+  {
+      for(size_t i=0; i<keys.size(); i++)
+      {
+          keys[i] = KEY(src[i]);
+          if(FILE_KEY(keys[i]) != src[i]) return false;
+      }
+      return true;
+  }
+
+  /// Writes value into the block of the grid covered by the cell key.
+  void fill_voxel_block(GeneralVoxelGrid<VALUE>& vg, KEY key, VALUE value) const
+  {
+      OctreeCoord c = compute_coord(key);
+      fill_voxel_block(vg, c.x, c.y, c.z, c.l, value);
+  }
+
+  void fill_voxel_block(GeneralVoxelGrid<VALUE>& vg, int x, int y, int z, int level, VALUE value) const
+  {
+      if(value == VALUE()) return;  // grids start out zeroed
+
+      const int len = 1 << (_max_level - level);
+      const int width = vg.width(), height = vg.height();
+      VALUE* data = vg.data();
+      for(int i=0; i<len; i++)
+      {
+          for(int j=0; j<len; j++)
+          {
+              VALUE* row = data + ((x * len + i) * width + y * len + j) * size_t(height) + z * len;
+              std::fill(row, row + len, value);
+          }
+      }
+  }
+
+  /// Adds offset (-1, 0 or 1) to the coordinate stored in the bits of lane.
+  /// Returns false if the result leaves the grid of the key's level.
+  static bool dilated_offset(KEY coord, KEY lane, int offset, KEY& result)
+  {
+      const KEY one = lane & (~lane + 1);
+      if(offset == 0) result = coord;
+      else if(offset > 0)
+      {
+          if(coord == lane) return false;
+          result = ((coord | ~lane) + one) & lane;
       }
+      else
+      {
+          if(coord == 0) return false;
+          result = (coord - one) & lane;
+      }
+      return true;
+  }
+
+  void update_max_level()
+  {
+      // keys are sorted, so the last one lives on the finest level
+      if(_keys.empty()) return;
+      int level = compute_level(_keys.back());
+      if(level > _max_level) _max_level = level;
   }
 
 };
@@ -0,0 +1,117 @@
+#ifndef OCTREE_AUGMENT_H_
+#define OCTREE_AUGMENT_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "octree.h"
+
+/// A symmetry of the cube: output axis a is input axis perm[a], mirrored if
+/// flip[a] is set. Flips and axis permutations together give all 48
+/// rotations and reflections that map the grid onto itself.
+///
+/// Such a transform changes every 3-bit digit of an interleaved key (one
+/// step of the path from the root) the same way and keeps the level bit, so
+/// it is applied to the keys directly; no coordinates are decoded.
+struct OctreeTransform
+{
+    OctreeTransform()
+    {
+        for(int a=0; a<3; a++)
+        {
+            perm[a] = a;
+            flip[a] = false;
+        }
+    }
+
+    bool is_identity() const
+    {
+        for(int a=0; a<3; a++) if(perm[a] != a || flip[a]) return false;
+        return true;
+    }
+
+    int perm[3];
+    bool flip[3];
+};
+
+template <class KEY>
+KEY transform_key(KEY key, int level, const OctreeTransform& t)
+{
+    const KEY level_bit = KEY(1) << 3 * level;
+    const KEY lane_x = (level_bit - 1) / 7;
+    const KEY code = key ^ level_bit;
+
+    KEY result = level_bit;
+    for(int a=0; a<3; a++)
+    {
+        const int src = t.perm[a];
+        KEY lane = code & (lane_x << src);
+        lane = a > src ? lane << (a - src) : lane >> (src - a);
+        if(t.flip[a]) lane ^= lane_x << a;
+        result |= lane;
+    }
+    return result;
+}
+
+/// Stable LSD radix sort of [begin, end) by the key bits below 'bits', 11
+/// per pass, so a level of up to 33 key bits takes three passes. Returns
+/// true if the result ended up in tmp.
+template <class KEY, class VALUE>
+bool radix_sort_keys(KEY* keys, VALUE* values, KEY* tmp_keys, VALUE* tmp_values,
+                     size_t begin, size_t end, int bits)
+{
+    const int digit_bits = 11;
+    const KEY digit_mask = (KEY(1) << digit_bits) - 1;
+    bool in_tmp = false;
+    for(int shift=0; shift<bits; shift+=digit_bits)
+    {
+        std::vector<size_t> offsets((1 << digit_bits) + 1, 0);
+        for(size_t i=begin; i<end; i++) offsets[((keys[i] >> shift) & digit_mask) + 1]++;
+        for(int d=0; d<(1 << digit_bits); d++) offsets[d + 1] += offsets[d];
+        for(size_t i=begin; i<end; i++)
+        {
+            const size_t pos = begin + offsets[(keys[i] >> shift) & digit_mask]++;
+            tmp_keys[pos] = keys[i];
+            tmp_values[pos] = values[i];
+        }
+        std::swap(keys, tmp_keys);
+        std::swap(values, tmp_values);
+        in_tmp = !in_tmp;
+    }
+    return in_tmp;
+}
+
+/// Applies t to every cell of an octree. A level keeps its cells, and the
+/// sorted arrays hold one level after the other, so every level is sorted
+/// on its own 3*level key bits in a few linear passes.
+template <class VALUE, class KEY>
+void transform_octree(GeneralOctree<VALUE, KEY>& octree, const OctreeTransform& t)
+{
+    if(t.is_identity() || !octree.num_elements()) return;
+
+    const std::vector<KEY>& keys = octree.keys();
+    const size_t n = keys.size();
+    std::vector<KEY> new_keys(n), tmp_keys(n);
+    std::vector<VALUE> new_values(octree.values()), tmp_values(n);
+
+    size_t begin = 0;
+    while(begin < n)
+    {
+        const int level = GeneralOctree<VALUE, KEY>::compute_level(keys[begin]);
+        size_t end = begin;
+        for(; end < n && GeneralOctree<VALUE, KEY>::compute_level(keys[end]) == level; end++)
+        {
+            new_keys[end] = transform_key(keys[end], level, t);
+        }
+
+        if(radix_sort_keys(&new_keys[0], &new_values[0], &tmp_keys[0], &tmp_values[0], begin, end, 3 * level))
+        {
+            std::copy(tmp_keys.begin() + begin, tmp_keys.begin() + end, new_keys.begin() + begin);
+            std::copy(tmp_values.begin() + begin, tmp_values.begin() + end, new_values.begin() + begin);
+        }
+        begin = end;
+    }
+    octree.take_sorted(new_keys, new_values);
+}
+
+#endif //OCTREE_AUGMENT_H_
@@ -0,0 +1,300 @@
+#ifndef OCTREE_BUILDER_H_
+#define OCTREE_BUILDER_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "zindex.h"
+#include "voxel_grid.h"
+
+/// Leaves collected per level. Builders that walk the tree depth first in
+/// Morton order append to each level in ascending key order, so the levels
+/// only have to be concatenated to get a sorted octree.
+template <class KEY, class VALUE>
+struct OctreeLevels
+{
+    std::vector<std::vector<KEY> > keys;
+    std::vector<std::vector<VALUE> > values;
+
+    void init(int num_levels)
+    {
+        keys.resize(num_levels);
+        values.resize(num_levels);
+    }
+
+    void emit(int level, KEY key, VALUE value)
+    {
+        keys[level].push_back(key);
+        values[level].push_back(value);
+    }
+};
+
+/// Concatenates level by level the leaves above the subtrees (top) and those
+/// of the subtrees, which have to be given in Morton order.
+template <class KEY, class VALUE>
+void concatenate_levels(OctreeLevels<KEY, VALUE>& top, std::vector<OctreeLevels<KEY, VALUE> >& subtrees,
+                        std::vector<KEY>& keys, std::vector<VALUE>& values)
+{
+    const int num_levels = top.keys.size();
+    size_t total = 0;
+    for(int l=0; l<num_levels; l++)
+    {
+        total += top.keys[l].size();
+        for(size_t s=0; s<subtrees.size(); s++) total += subtrees[s].keys[l].size();
+    }
+
+    keys.clear();
+    values.clear();
+    keys.reserve(total);
+    values.reserve(total);
+    for(int l=0; l<num_levels; l++)
+    {
+        for(size_t s=0; s<=subtrees.size(); s++)
+        {
+            OctreeLevels<KEY, VALUE>& src = s ? subtrees[s-1] : top;
+            keys.insert(keys.end(), src.keys[l].begin(), src.keys[l].end());
+            values.insert(values.end(), src.values[l].begin(), src.values[l].end());
+            std::vector<KEY>().swap(src.keys[l]);
+            std::vector<VALUE>().swap(src.values[l]);
+        }
+    }
+}
+
+/// Bottom-up conversion of a dense voxel grid into octree leaves.
+///
+/// The grid is traversed depth first in Morton order. Every cell returns
+/// whether it is uniform, i.e. all its children are uniform and share one
+/// value; uniform cells are handed to the parent, and only the children of
+/// non-uniform cells are written out. Cells of one level therefore leave
+/// the traversal in ascending key order and the output is sorted without
+/// any scratch volume or sort.
+///
+/// The subtrees rooted at split_level() are independent; build_subtree may
+/// run concurrently for different subtrees, finish() then merges the levels
+/// above them and concatenates the per-subtree results.
+template <class VALUE, class KEY>
+class VoxelOctreeBuilder
+{
+
+public:
+    VoxelOctreeBuilder(GeneralVoxelGrid<VALUE>& vg, int min_level) :
+        _voxels(vg.data()), _depth(vg.depth()), _width(vg.width()), _height(vg.height()),
+        _min_level(min_level)
+    {
+        int dim = std::max(_depth, std::max(_width, _height));
+        _leaf_level = 0;
+        while((1 << _leaf_level) < dim) _leaf_level++;
+
+        // 64 subtrees give enough work items for a thread pool without
+        // fragmenting the output of small grids
+        _split_level = std::max(0, std::min(2, _leaf_level - 1));
+        int num_subtrees = 1 << 3 * _split_level;
+        _subtrees.resize(num_subtrees);
+        _uniform.resize(num_subtrees, 0);
+        _values.resize(num_subtrees);
+    }
+
+    int leaf_level() const { return _leaf_level; }
+    int split_level() const { return _split_level; }
+    int num_subtrees() const { return _subtrees.size(); }
+
+    void build_subtree(int ind)
+    {
+        Levels& out = _subtrees[ind];
+        out.init(_leaf_level + 1);
+
+        KEY key = (KEY(1) << 3 * _split_level) | KEY(ind);
+        KEY x, y, z;
+        inverse_morton_3d(x, y, z, KEY(ind));
+        if(_leaf_level == 0)
+        {
+            _uniform[ind] = 1;
+            _values[ind] = voxel(0, 0, 0);
+        }
+        else _uniform[ind] = build_cell(key, x, y, z, _split_level, out, _values[ind]);
+    }
+
+    /// Sorted leaves of the whole grid; all subtrees must have been built.
+    void finish(std::vector<KEY>& keys, std::vector<VALUE>& values)
+    {
+        Levels top;
+        top.init(_leaf_level + 1);
+        VALUE root_value;
+        if(merge_top(KEY(1), 0, top, root_value)) top.emit(0, KEY(1), root_value);
+        concatenate_levels(top, _subtrees, keys, values);
+        _subtrees.clear();
+    }
+
+private:
+    typedef OctreeLevels<KEY, VALUE> Levels;
+
+    VALUE voxel(int x, int y, int z) const
+    {
+        if(x >= _depth || y >= _width || z >= _height) return VALUE(CLASS_EMPTY);
+        return _voxels[(x * _width + y) * _height + z];
+    }
+
+    /// Emits the uniform children of a non-uniform cell, or reports the cell
+    /// itself as uniform if it may become a leaf.
+    bool merge_children(KEY key, int level, const bool* child_uniform, const VALUE* child_values,
+                        Levels& out, VALUE& value) const
+    {
+        bool uniform = level >= _min_level;
+        for(int i=0; i<8 && uniform; i++)
+            uniform = child_uniform[i] && child_values[i] == child_values[0];
+
+        if(uniform)
+        {
+            value = child_values[0];
+            return true;
+        }
+
+        for(int i=0; i<8; i++)
+        {
+            if(child_uniform[i]) out.emit(level + 1, (key << 3) | KEY(i), child_values[i]);
+        }
+        return false;
+    }
+
+    bool build_cell(KEY key, int x, int y, int z, int level, Levels& out, VALUE& value) const
+    {
+        bool child_uniform[8];
+        VALUE child_values[8];
+        for(int i=0; i<8; i++)
+        {
+            int cx = 2 * x + (i & 1);
+            int cy = 2 * y + ((i >> 1) & 1);
+            int cz = 2 * z + (i >> 2);
+            if(level + 1 == _leaf_level)
+            {
+                child_uniform[i] = true;
+                child_values[i] = voxel(cx, cy, cz);
+            }
+            else child_uniform[i] = build_cell((key << 3) | KEY(i), cx, cy, cz, level + 1, out, child_values[i]);
+        }
+        return merge_children(key, level, child_uniform, child_values, out, value);
+    }
+
+    bool merge_top(KEY key, int level, Levels& out, VALUE& value) const
+    {
+        if(level == _split_level)
+        {
+            int ind = key ^ (KEY(1) << 3 * level);
+            value = _values[ind];
+            return _uniform[ind];
+        }
+
+        bool child_uniform[8];
+        VALUE child_values[8];
+        for(int i=0; i<8; i++) child_uniform[i] = merge_top((key << 3) | KEY(i), level + 1, out, child_values[i]);
+        return merge_children(key, level, child_uniform, child_values, out, value);
+    }
+
+    const VALUE* _voxels;
+    int _depth, _width, _height;
+    int _min_level, _leaf_level, _split_level;
+
+    std::vector<Levels> _subtrees;
+    std::vector<char> _uniform;
+    std::vector<VALUE> _values;
+};
+
+/// Top-down conversion of any grid that can tell whether an aligned cube is
+/// uniform, via SOURCE::uniform(x, y, z, size, value) and its dimensions.
+/// Cells are only split where they are not uniform, so sparse sources such
+/// as RunLengthVoxelGrid are converted without touching every voxel. The
+/// interface matches VoxelOctreeBuilder: the subtrees that remain open at
+/// split_level() may be built concurrently.
+template <class SOURCE, class VALUE, class KEY>
+class RegionOctreeBuilder
+{
+
+public:
+    RegionOctreeBuilder(const SOURCE& source, int min_level) :
+        _source(source), _min_level(min_level)
+    {
+        int dim = std::max(source.depth(), std::max(source.width(), source.height()));
+        _leaf_level = 0;
+        while((1 << _leaf_level) < dim) _leaf_level++;
+        _split_level = std::min(2, _leaf_level);
+
+        _top.init(_leaf_level + 1);
+        expand_top(KEY(1), 0, 0, 0, 0);
+        _subtrees.resize(_open.size());
+    }
+
+    int leaf_level() const { return _leaf_level; }
+    int split_level() const { return _split_level; }
+    int num_subtrees() const { return _open.size(); }
+
+    void build_subtree(int ind)
+    {
+        const Cell& c = _open[ind];
+        _subtrees[ind].init(_leaf_level + 1);
+        build_cell(c.key, c.x, c.y, c.z, _split_level, _subtrees[ind]);
+    }
+
+    void finish(std::vector<KEY>& keys, std::vector<VALUE>& values)
+    {
+        concatenate_levels(_top, _subtrees, keys, values);
+        _subtrees.clear();
+        _open.clear();
+    }
+
+private:
+    typedef OctreeLevels<KEY, VALUE> Levels;
+
+    struct Cell
+    {
+        KEY key;
+        int x, y, z;
+    };
+
+    bool is_leaf(int x, int y, int z, int level, VALUE& value) const
+    {
+        if(level < _min_level && level < _leaf_level) return false;
+        int size = 1 << (_leaf_level - level);
+        return _source.uniform(x * size, y * size, z * size, size, value);
+    }
+
+    void expand_top(KEY key, int x, int y, int z, int level)
+    {
+        if(level == _split_level)
+        {
+            Cell c;
+            c.key = key; c.x = x; c.y = y; c.z = z;
+            _open.push_back(c);
+            return;
+        }
+
+        VALUE value;
+        if(is_leaf(x, y, z, level, value))
+        {
+            _top.emit(level, key, value);
+            return;
+        }
+        for(int i=0; i<8; i++)
+            expand_top((key << 3) | KEY(i), 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2), level + 1);
+    }
+
+    void build_cell(KEY key, int x, int y, int z, int level, Levels& out) const
+    {
+        VALUE value;
+        if(is_leaf(x, y, z, level, value))
+        {
+            out.emit(level, key, value);
+            return;
+        }
+        for(int i=0; i<8; i++)
+            build_cell((key << 3) | KEY(i), 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2), level + 1, out);
+    }
+
+    const SOURCE& _source;
+    int _min_level, _leaf_level, _split_level;
+
+    Levels _top;
+    std::vector<Cell> _open;
+    std::vector<Levels> _subtrees;
+};
+
+#endif //OCTREE_BUILDER_H_
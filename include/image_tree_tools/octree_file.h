@@ -0,0 +1,110 @@
+#ifndef OCTREE_FILE_H_
+#define OCTREE_FILE_H_
+
+#include <string>
+#include <cstring>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/// Binary .ot layout (native byte order):
+///
+///   OctreeFileHeader
+///   OctreeFileLevel[num_levels]   element range of every octree level
+///   KEY[num_elements]             keys, sorted; level-major by construction
+///   VALUE[num_elements]           values in key order
+///
+/// Keys of level l lie in [2^(3l), 2^(3l+3)), so sorting all keys globally
+/// groups them by level and the arrays can be copied into a GeneralOctree
+/// without any parsing or re-sorting.
+
+#define OCTREE_FILE_VERSION 1
+
+inline const char* OCTREE_FILE_MAGIC() { return "OTB\n"; }
+
+struct OctreeFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t value_size;
+    int32_t max_level;
+    uint32_t num_levels;
+    uint64_t num_elements;
+};
+
+struct OctreeFileLevel
+{
+    uint64_t begin;
+    uint64_t count;
+};
+
+inline bool is_binary_octree(const char* data, size_t size)
+{
+    return size >= sizeof(OctreeFileHeader) && !memcmp(data, OCTREE_FILE_MAGIC(), 4);
+}
+
+/// Reads only the header of a binary .ot file; false for text octrees.
+inline bool read_octree_file_header(const std::string& fname, OctreeFileHeader& header)
+{
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    ssize_t size = ::read(fd, &header, sizeof(header));
+    ::close(fd);
+    return size == ssize_t(sizeof(header)) && !memcmp(header.magic, OCTREE_FILE_MAGIC(), 4);
+}
+
+/// Read-only memory mapping of a whole file. advice is passed to madvise;
+/// single octrees are read front to back, packs (octree_pack.h) at random.
+class MappedFile
+{
+
+public:
+    MappedFile() : _data(0), _size(0) {}
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& fname, int advice = MADV_SEQUENTIAL)
+    {
+        close();
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+
+        struct stat st;
+        if(fstat(fd, &st) || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void* ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if(ptr == MAP_FAILED) return false;
+
+        madvise(ptr, st.st_size, advice);
+        _data = static_cast<const char*>(ptr);
+        _size = st.st_size;
+        return true;
+    }
+
+    void close()
+    {
+        if(_data) munmap(const_cast<char*>(_data), _size);
+        _data = 0;
+        _size = 0;
+    }
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* _data;
+    size_t _size;
+};
+
+#endif //OCTREE_FILE_H_
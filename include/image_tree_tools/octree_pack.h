@@ -0,0 +1,202 @@
+#ifndef OCTREE_PACK_H_
+#define OCTREE_PACK_H_
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "octree.h"
+
+/// Dataset pack layout (.otp, native byte order):
+///
+///   OctreePackHeader
+///   OctreePackEntry[num_models]   where each model is and what it contains
+///   binary .ot files              one per model, each starting at a multiple of 8
+///
+/// Every model is stored exactly as a binary .ot file (octree_file.h), so a
+/// model is loaded with GeneralOctree::from_buffer straight from the mapping.
+/// The index is fixed size per model, which makes random access O(1).
+
+#define OCTREE_PACK_VERSION 1
+#define OCTREE_PACK_LEVELS 24
+
+inline const char* OCTREE_PACK_MAGIC() { return "OTP\n"; }
+
+struct OctreePackHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_levels;
+    uint32_t reserved;
+    uint64_t num_models;
+    uint64_t data_offset;
+};
+
+struct OctreePackEntry
+{
+    uint64_t offset;
+    uint64_t length;
+    uint64_t num_cells;
+    int32_t max_level;
+    uint32_t key_size;
+    uint32_t level_cells[OCTREE_PACK_LEVELS];
+};
+
+/// Tells packs from text lists of .ot files by their first bytes.
+inline bool is_octree_pack(const std::string& fname)
+{
+    char magic[4];
+    std::ifstream ff(fname.c_str(), std::ios_base::binary);
+    ff.read(magic, 4);
+    return ff.good() && !memcmp(magic, OCTREE_PACK_MAGIC(), 4);
+}
+
+/// Read-only access to a pack through a memory mapping; models are only
+/// paged in when they are loaded.
+class OctreePack
+{
+
+public:
+    OctreePack() : _entries(0), _num_models(0) {}
+
+    bool open(const std::string& fname)
+    {
+        _entries = 0;
+        _num_models = 0;
+        if(!_file.open(fname, MADV_RANDOM)) return false;
+        if(read_index()) return true;
+        _file.close();
+        return false;
+    }
+
+    size_t size() const { return _num_models; }
+    const OctreePackEntry& entry(size_t ind) const { return _entries[ind]; }
+    const char* data(size_t ind) const { return _file.data() + _entries[ind].offset; }
+
+    template <class VALUE, class KEY>
+    bool load(size_t ind, GeneralOctree<VALUE, KEY>& octree, int max_level = -1, VALUE internal_value = VALUE()) const
+    {
+        return ind < _num_models && octree.from_buffer(data(ind), _entries[ind].length, max_level, internal_value);
+    }
+
+private:
+    /// Checks header and index of the mapped file; the bounds are written so
+    /// that corrupt counts or offsets cannot overflow them.
+    bool read_index()
+    {
+        OctreePackHeader header;
+        const size_t size = _file.size();
+        if(size < sizeof(header) || memcmp(_file.data(), OCTREE_PACK_MAGIC(), 4)) return false;
+        memcpy(&header, _file.data(), sizeof(header));
+        if(header.version != OCTREE_PACK_VERSION || header.num_levels != OCTREE_PACK_LEVELS) return false;
+        if(header.num_models > (size - sizeof(header)) / sizeof(OctreePackEntry)) return false;
+
+        const OctreePackEntry* entries = reinterpret_cast<const OctreePackEntry*>(_file.data() + sizeof(header));
+        for(uint64_t i=0; i<header.num_models; i++)
+        {
+            if(entries[i].offset > size || entries[i].length > size - entries[i].offset) return false;
+        }
+        _entries = entries;
+        _num_models = header.num_models;
+        return true;
+    }
+
+    MappedFile _file;
+    const OctreePackEntry* _entries;
+    size_t _num_models;
+};
+
+/// Writes a pack of a known number of models. The index is reserved up front
+/// and filled in by close(), so models are streamed to disk one at a time.
+class OctreePackWriter
+{
+
+public:
+    OctreePackWriter() : _num_models(0), _offset(0) {}
+
+    bool open(const std::string& fname, size_t num_models)
+    {
+        _entries.clear();
+        _entries.reserve(num_models);
+        _num_models = num_models;
+        _offset = sizeof(OctreePackHeader) + num_models * sizeof(OctreePackEntry);
+        _offset = (_offset + 7) & ~uint64_t(7);
+
+        _ff.open(fname.c_str(), std::ios_base::binary | std::ios_base::trunc);
+        std::vector<char> head(_offset, 0);
+        _ff.write(&head[0], head.size());
+        return _ff.good();
+    }
+
+    /// Appends a model given as the contents of a binary .ot file.
+    bool add(const char* data, size_t size)
+    {
+        if(_entries.size() == _num_models || !is_binary_octree(data, size)) return false;
+
+        OctreeFileHeader header;
+        memcpy(&header, data, sizeof(header));
+        if(sizeof(header) + header.num_levels * sizeof(OctreeFileLevel) > size) return false;
+
+        OctreePackEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = _offset;
+        entry.length = size;
+        entry.num_cells = header.num_elements;
+        entry.max_level = header.max_level;
+        entry.key_size = header.key_size;
+        const OctreeFileLevel* levels = reinterpret_cast<const OctreeFileLevel*>(data + sizeof(header));
+        for(uint32_t l=0; l<header.num_levels && l<OCTREE_PACK_LEVELS; l++) entry.level_cells[l] = levels[l].count;
+
+        static const char padding[8] = {0};
+        const size_t padded = (size + 7) & ~size_t(7);
+        _ff.write(data, size);
+        _ff.write(padding, padded - size);
+        _offset += padded;
+        _entries.push_back(entry);
+        return _ff.good();
+    }
+
+    template <class VALUE, class KEY>
+    bool add(const GeneralOctree<VALUE, KEY>& octree)
+    {
+        std::vector<char> buffer;
+        octree.to_buffer(buffer);
+        return add(&buffer[0], buffer.size());
+    }
+
+    /// Writes header and index; fails unless exactly num_models were added.
+    bool close()
+    {
+        bool complete = _entries.size() == _num_models;
+        if(complete)
+        {
+            OctreePackHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, OCTREE_PACK_MAGIC(), 4);
+            header.version = OCTREE_PACK_VERSION;
+            header.num_levels = OCTREE_PACK_LEVELS;
+            header.num_models = _num_models;
+            header.data_offset = _entries.empty() ? _offset : _entries[0].offset;
+
+            _ff.seekp(0);
+            _ff.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            if(!_entries.empty())
+                _ff.write(reinterpret_cast<const char*>(&_entries[0]), sizeof(OctreePackEntry) * _entries.size());
+        }
+        _ff.flush();
+        complete = complete && _ff.good();
+        _ff.close();
+        return complete;
+    }
+
+    /// Bytes of the pack written so far, including the reserved index.
+    uint64_t size() const { return _offset; }
+
+private:
+    std::ofstream _ff;
+    std::vector<OctreePackEntry> _entries;
+    size_t _num_models;
+    uint64_t _offset;
+};
+
+#endif //OCTREE_PACK_H_
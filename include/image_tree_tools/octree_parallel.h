@@ -0,0 +1,228 @@
+#ifndef OCTREE_PARALLEL_H_
+#define OCTREE_PARALLEL_H_
+
+// Multithreaded octree operations. This header is not part of
+// image_tree_tools.h because boost/thread.hpp must stay out of CUDA
+// translation units (see caffe/common.hpp).
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "octree.h"
+
+inline int default_num_threads()
+{
+    int num_threads = boost::thread::hardware_concurrency();
+    return num_threads > 0 ? num_threads : 1;
+}
+
+struct ParallelForState
+{
+    explicit ParallelForState(int num_tasks) : next(0), num_tasks(num_tasks) {}
+
+    int next_task()
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return next < num_tasks ? next++ : -1;
+    }
+
+    boost::mutex mutex;
+    int next;
+    int num_tasks;
+};
+
+template <class TASK>
+void parallel_for_worker(TASK* task, ParallelForState* state)
+{
+    for(int i = state->next_task(); i != -1; i = state->next_task()) (*task)(i);
+}
+
+/// Calls task(i) for every i in [0, num_tasks). Tasks are handed out one at
+/// a time, so uneven task sizes balance themselves. num_threads <= 0 uses
+/// all hardware threads.
+template <class TASK>
+void parallel_for(int num_tasks, TASK& task, int num_threads = 0)
+{
+    if(num_threads <= 0) num_threads = default_num_threads();
+    num_threads = std::min(num_threads, num_tasks);
+    if(num_threads <= 1)
+    {
+        for(int i=0; i<num_tasks; i++) task(i);
+        return;
+    }
+
+    ParallelForState state(num_tasks);
+    boost::thread_group threads;
+    for(int t=0; t<num_threads; t++)
+        threads.create_thread(boost::bind(&parallel_for_worker<TASK>, &task, &state));
+    threads.join_all();
+}
+
+/// Threads that are started once and then run the tasks of many loops, for
+/// loops too short to pay for starting threads on every call (parallel_for
+/// does). The calling thread works on the tasks as well, so num_threads - 1
+/// workers are started. Concurrent callers take turns; loops started from
+/// inside a task of any pool run serially.
+class WorkerPool
+{
+
+public:
+    explicit WorkerPool(int num_threads) : _num_threads(std::max(num_threads, 1)), _stop(false),
+        _task(0), _run_task(0), _next(0), _num_tasks(0), _finished(0)
+    {
+        for(int t=1; t<_num_threads; t++) _threads.create_thread(boost::bind(&WorkerPool::work, this));
+    }
+
+    ~WorkerPool()
+    {
+        {
+            boost::mutex::scoped_lock lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _threads.join_all();
+    }
+
+    int num_threads() const { return _num_threads; }
+
+    /// True on a worker thread, or inside a task on the calling thread.
+    static bool in_task() { return current_pool().get() != 0; }
+
+    /// Calls task(i) for every i in [0, num_tasks), handed out one at a time.
+    template <class TASK>
+    void run(int num_tasks, TASK& task)
+    {
+        if(_num_threads <= 1 || num_tasks <= 1 || in_task())
+        {
+            for(int i=0; i<num_tasks; i++) task(i);
+            return;
+        }
+
+        boost::mutex::scoped_lock caller(_caller_mutex);
+        boost::mutex::scoped_lock lock(_mutex);
+        _task = &task;
+        _run_task = &run_task<TASK>;
+        _next = 0;
+        _num_tasks = num_tasks;
+        _finished = 0;
+        _wake.notify_all();
+
+        current_pool().reset(this);
+        run_tasks(lock);
+        current_pool().reset();
+        while(_finished < _num_tasks) _done.wait(lock);
+        _task = 0;
+    }
+
+private:
+    template <class TASK>
+    static void run_task(void* task, int ind) { (*static_cast<TASK*>(task))(ind); }
+
+    static void no_cleanup(WorkerPool*) {}
+
+    static boost::thread_specific_ptr<WorkerPool>& current_pool()
+    {
+        static boost::thread_specific_ptr<WorkerPool> pool(&WorkerPool::no_cleanup);
+        return pool;
+    }
+
+    /// Runs tasks until none are left to hand out; called with _mutex held.
+    void run_tasks(boost::mutex::scoped_lock& lock)
+    {
+        while(_next < _num_tasks)
+        {
+            int ind = _next++;
+            void* task = _task;
+            void (*run_task)(void*, int) = _run_task;
+            lock.unlock();
+            run_task(task, ind);
+            lock.lock();
+            if(++_finished == _num_tasks) _done.notify_all();
+        }
+    }
+
+    void work()
+    {
+        current_pool().reset(this);
+        boost::mutex::scoped_lock lock(_mutex);
+        while(true)
+        {
+            while(!_stop && _next >= _num_tasks) _wake.wait(lock);
+            if(_stop) return;
+            run_tasks(lock);
+        }
+    }
+
+    const int _num_threads;
+    bool _stop;
+    void* _task;
+    void (*_run_task)(void*, int);
+    int _next, _num_tasks, _finished;
+
+    boost::mutex _caller_mutex, _mutex;
+    boost::condition_variable _wake, _done;
+    boost::thread_group _threads;
+};
+
+template <class BUILDER>
+struct BuildSubtreeTask
+{
+    explicit BuildSubtreeTask(BUILDER& builder) : builder(builder) {}
+    void operator()(int ind) { builder.build_subtree(ind); }
+
+    BUILDER& builder;
+};
+
+/// Runs a builder from octree_builder.h with its subtrees spread over
+/// num_threads threads. The result does not depend on the thread count.
+template <class BUILDER, class VALUE, class KEY>
+void parallel_build(GeneralOctree<VALUE, KEY>& octree, BUILDER& builder, int num_threads = 0)
+{
+    BuildSubtreeTask<BUILDER> task(builder);
+    parallel_for(builder.num_subtrees(), task, num_threads);
+    octree.from_builder(builder);
+}
+
+/// GeneralOctree::from_voxel_grid on num_threads threads.
+template <class VALUE, class KEY>
+void parallel_from_voxel_grid(GeneralOctree<VALUE, KEY>& octree, GeneralVoxelGrid<VALUE>& vg,
+                              int min_level, int num_threads = 0)
+{
+    VoxelOctreeBuilder<VALUE, KEY> builder(vg, min_level);
+    parallel_build(octree, builder, num_threads);
+}
+
+/// Converts a run-length grid without expanding it, on num_threads threads.
+template <class KEY>
+void parallel_from_run_length_grid(GeneralOctree<byte, KEY>& octree, const RunLengthVoxelGrid& grid,
+                                   int min_level, int num_threads = 0)
+{
+    RegionOctreeBuilder<RunLengthVoxelGrid, byte, KEY> builder(grid, min_level);
+    parallel_build(octree, builder, num_threads);
+}
+
+template <class VALUE, class KEY>
+struct FillVoxelSubtreeTask
+{
+    FillVoxelSubtreeTask(const GeneralOctree<VALUE, KEY>& octree, GeneralVoxelGrid<VALUE>& vg) :
+        octree(octree), vg(vg) {}
+    void operator()(int ind) { octree.to_voxel_subtree(vg, ind); }
+
+    const GeneralOctree<VALUE, KEY>& octree;
+    GeneralVoxelGrid<VALUE>& vg;
+};
+
+/// GeneralOctree::to_voxel_grid with the subtrees filled on num_threads threads.
+template <class VALUE, class KEY>
+GeneralVoxelGrid<VALUE> parallel_to_voxel_grid(const GeneralOctree<VALUE, KEY>& octree, int num_threads = 0)
+{
+    int resolution = octree.max_level() < 0 ? 0 : 1 << octree.max_level();
+    GeneralVoxelGrid<VALUE> vg(resolution, resolution, resolution);
+    FillVoxelSubtreeTask<VALUE, KEY> task(octree, vg);
+    parallel_for(octree.num_voxel_subtrees(), task, num_threads);
+    return vg;
+}
+
+#endif //OCTREE_PARALLEL_H_
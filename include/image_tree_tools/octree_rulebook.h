@@ -0,0 +1,145 @@
+#ifndef OCTREE_RULEBOOK_H_
+#define OCTREE_RULEBOOK_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "octree.h"
+
+/// Neighbour structure of a convolution on octree cells, from which im2col
+/// and col2im only copy: for every filter offset and every column of the
+/// col buffer, the feature column of the neighbour, or -1 if there is none.
+/// Entries are offset-major, so the inner loop over columns is contiguous
+/// in the rulebook and in the col buffer alike.
+///
+/// The same entries are also kept as rules: for every offset, only the
+/// columns that have a neighbour there, with the neighbour's feature
+/// column, for engines that gather and scatter instead of filling a col
+/// buffer. They are kept by feature column as well, in offset order, so
+/// that col2im gathers the entries of each cell instead of scattering into
+/// them, and ranges of cells can be summed on different threads.
+struct OctreeRulebook
+{
+    OctreeRulebook() : num_columns(0), nbh_count(0), num_features(0) {}
+
+    const int* offset(int el) const { return &columns[size_t(el) * num_columns]; }
+
+    int num_rules(int el) const { return rule_begin[el + 1] - rule_begin[el]; }
+    const int* rule_columns(int el) const { return &rule_column[0] + rule_begin[el]; }
+    const int* rule_neighbors(int el) const { return &rule_neighbor[0] + rule_begin[el]; }
+
+    int num_feature_rules(int feature) const { return feature_begin[feature + 1] - feature_begin[feature]; }
+    const int* feature_offsets(int feature) const { return &feature_offset[0] + feature_begin[feature]; }
+    const int* feature_columns(int feature) const { return &feature_column[0] + feature_begin[feature]; }
+
+    int num_columns;
+    int nbh_count;
+    std::vector<int> columns;
+
+    std::vector<int> rule_begin;
+    std::vector<int> rule_column;
+    std::vector<int> rule_neighbor;
+
+    int num_features;
+    std::vector<int> feature_begin;
+    std::vector<int> feature_offset;
+    std::vector<int> feature_column;
+};
+
+/// The convolutions that derive a rulebook from a key octree. CONV and
+/// DECONV look up the neighbours of a cell, or of its first child, among
+/// cells of the same level; DOWN looks up the children of a parent cell.
+enum OctreeRulebookKind { RULEBOOK_CONV, RULEBOOK_DECONV, RULEBOOK_DOWN };
+
+/// First step of build_octree_rulebook: sizes the rulebook for the columns
+/// of rows and the feature columns of lookup, without neighbours.
+template <class KEY>
+void init_octree_rulebook(const GeneralOctree<int, KEY>& rows, const GeneralOctree<int, KEY>& lookup,
+                          int filter_size, OctreeRulebook& rulebook)
+{
+    const std::vector<int>& cols = rows.values();
+    const std::vector<int>& lookup_cols = lookup.values();
+
+    rulebook.nbh_count = filter_size * filter_size * filter_size;
+    rulebook.num_columns = cols.empty() ? 0 : *std::max_element(cols.begin(), cols.end()) + 1;
+    rulebook.num_features = lookup_cols.empty() ? 0 : *std::max_element(lookup_cols.begin(), lookup_cols.end()) + 1;
+    rulebook.columns.assign(size_t(rulebook.nbh_count) * rulebook.num_columns, -1);
+}
+
+/// Second step: looks up the neighbours of the cells [begin, end) of rows.
+/// Every cell fills its own column, so disjoint ranges may be filled
+/// concurrently (see octree_parallel.h).
+template <class KEY>
+void fill_octree_rulebook(const GeneralOctree<int, KEY>& rows, const GeneralOctree<int, KEY>& lookup,
+                          int shift, int filter_size, int begin, int end, OctreeRulebook& rulebook)
+{
+    const std::vector<KEY>& keys = rows.keys();
+    const std::vector<int>& cols = rows.values();
+    const std::vector<int>& lookup_cols = lookup.values();
+
+    std::vector<int> neighbors(rulebook.nbh_count);
+    for(int i=begin; i<end; i++)
+    {
+        const KEY key = keys[i] << shift;
+        if(!key) continue;
+
+        lookup.get_neighbor_indices(key, filter_size, &neighbors[0]);
+        for(int el=0; el<rulebook.nbh_count; el++)
+        {
+            if(neighbors[el] != -1) rulebook.columns[size_t(el) * rulebook.num_columns + cols[i]] = lookup_cols[neighbors[el]];
+        }
+    }
+}
+
+/// Last step: collects the rules of the filled rulebook, by offset and by
+/// feature column.
+inline void finish_octree_rulebook(OctreeRulebook& rulebook)
+{
+    rulebook.rule_begin.assign(rulebook.nbh_count + 1, 0);
+    rulebook.rule_column.clear();
+    rulebook.rule_neighbor.clear();
+    for(int el=0; el<rulebook.nbh_count; el++)
+    {
+        const int* offset_cols = rulebook.offset(el);
+        for(int col=0; col<rulebook.num_columns; col++)
+        {
+            if(offset_cols[col] == -1) continue;
+            rulebook.rule_column.push_back(col);
+            rulebook.rule_neighbor.push_back(offset_cols[col]);
+        }
+        rulebook.rule_begin[el + 1] = rulebook.rule_column.size();
+    }
+
+    // a counting sort by feature column; each offset reads a feature column
+    // at most once, and the offsets come in order
+    rulebook.feature_begin.assign(rulebook.num_features + 1, 0);
+    for(size_t r=0; r<rulebook.rule_neighbor.size(); r++) rulebook.feature_begin[rulebook.rule_neighbor[r] + 1]++;
+    for(int f=0; f<rulebook.num_features; f++) rulebook.feature_begin[f + 1] += rulebook.feature_begin[f];
+    rulebook.feature_offset.resize(rulebook.rule_neighbor.size());
+    rulebook.feature_column.resize(rulebook.rule_neighbor.size());
+    std::vector<int> next(rulebook.feature_begin.begin(), rulebook.feature_begin.end() - 1);
+    for(int el=0; el<rulebook.nbh_count; el++)
+    {
+        for(int r=rulebook.rule_begin[el]; r<rulebook.rule_begin[el + 1]; r++)
+        {
+            const int pos = next[rulebook.rule_neighbor[r]]++;
+            rulebook.feature_offset[pos] = el;
+            rulebook.feature_column[pos] = rulebook.rule_column[r];
+        }
+    }
+}
+
+/// Builds the rulebook of a filter of filter_size^3 cells. Each cell of rows
+/// is a column of the col buffer (its value); the filter is placed at its
+/// key shifted left by shift bits (3 for the first child) and the neighbours
+/// are looked up in lookup, whose values are the feature columns.
+template <class KEY>
+void build_octree_rulebook(const GeneralOctree<int, KEY>& rows, const GeneralOctree<int, KEY>& lookup,
+                           int shift, int filter_size, OctreeRulebook& rulebook)
+{
+    init_octree_rulebook(rows, lookup, filter_size, rulebook);
+    fill_octree_rulebook(rows, lookup, shift, filter_size, 0, rows.num_elements(), rulebook);
+    finish_octree_rulebook(rulebook);
+}
+
+#endif //OCTREE_RULEBOOK_H_
@@ -0,0 +1,170 @@
+#ifndef OCTREE_SHM_H_
+#define OCTREE_SHM_H_
+
+#include <string>
+#include <cstring>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/// Named POSIX shared memory segment holding one read-only image, e.g. a
+/// preloaded dataset (see CompactOctreeStore::write_image). The first process
+/// claims the name, builds the image and publishes it; every other process
+/// attaches to the published image without copying it.
+///
+///   SharedImage image;
+///   if(image.attach(name) == SharedImage::MISSING && image.claim(name))
+///   {
+///       build into image.allocate(size), then image.publish()
+///   }
+///
+/// The segment outlives the processes, so later jobs attach at once; it is
+/// removed with shm_unlink or by deleting /dev/shm/<name> on Linux. The
+/// creator holds an flock on the segment until it publishes the image, so
+/// attachers can tell a slow creator from a dead one without comparing
+/// pids, which differ between containers that share /dev/shm.
+class SharedImage
+{
+
+public:
+    enum Status { ATTACHED, MISSING, STALE };
+
+    SharedImage() : _fd(-1), _map(0), _map_size(0), _claimed(false) {}
+    ~SharedImage() { close(); }
+
+    /// Maps the image published under name. If another process is still
+    /// building it, waits for it. STALE means that nobody has held the
+    /// creator's lock for stale_ms while the image was not ready, e.g. because
+    /// the creator died or the segment is empty or foreign.
+    Status attach(const std::string& name, int stale_ms = 10000)
+    {
+        close();
+        _fd = shm_open(shm_name(name).c_str(), O_RDONLY, 0);
+        if(_fd < 0) return MISSING;
+
+        // the creator locks the segment right after creating it, so allow
+        // for that gap before an unlocked segment counts as stale
+        int unlocked_polls = 0;
+        while(unlocked_polls * POLL_MS < stale_ms)
+        {
+            Header header;
+            struct stat st;
+            if(read_header(header) && header.ready && !fstat(_fd, &st) && header.size <= uint64_t(st.st_size))
+            {
+                void* ptr = mmap(0, header.size, PROT_READ, MAP_SHARED, _fd, 0);
+                if(ptr == MAP_FAILED) break;
+                _map = static_cast<char*>(ptr);
+                _map_size = header.size;
+                return ATTACHED;
+            }
+            if(flock(_fd, LOCK_SH | LOCK_NB) == 0)
+            {
+                flock(_fd, LOCK_UN);
+                unlocked_polls++;
+            }
+            else unlocked_polls = 0;
+            usleep(POLL_MS * 1000);
+        }
+        close();
+        return STALE;
+    }
+
+    /// Creates the segment for a new image; false if the name exists, e.g.
+    /// because another process claimed it in the meantime.
+    bool claim(const std::string& name)
+    {
+        close();
+        _fd = shm_open(shm_name(name).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if(_fd < 0) return false;
+        _name = name;
+        _claimed = true;
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        if(flock(_fd, LOCK_EX) || ftruncate(_fd, sizeof(Header)) ||
+           pwrite(_fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+        {
+            abandon();
+            return false;
+        }
+        return true;
+    }
+
+    /// Sizes a claimed segment and returns size writable bytes for the image.
+    char* allocate(size_t size)
+    {
+        const size_t total = DATA_OFFSET + size;
+        if(ftruncate(_fd, total)) return 0;
+        void* ptr = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if(ptr == MAP_FAILED) return 0;
+        _map = static_cast<char*>(ptr);
+        _map_size = total;
+        return _map + DATA_OFFSET;
+    }
+
+    /// Makes the allocated image visible to attach.
+    void publish()
+    {
+        Header* header = reinterpret_cast<Header*>(_map);
+        header->size = _map_size;
+        __sync_synchronize();
+        header->ready = 1;
+        msync(_map, sizeof(Header), MS_SYNC);
+        mprotect(_map, _map_size, PROT_READ);
+        flock(_fd, LOCK_UN);
+        _claimed = false;
+    }
+
+    /// Removes a claimed segment that was not published, e.g. on failure.
+    void abandon()
+    {
+        if(_claimed) shm_unlink(shm_name(_name).c_str());
+        _claimed = false;
+        close();
+    }
+
+    void close()
+    {
+        if(_map) munmap(_map, _map_size);
+        if(_fd >= 0) ::close(_fd);
+        _map = 0;
+        _map_size = 0;
+        _fd = -1;
+    }
+
+    const char* data() const { return _map ? _map + DATA_OFFSET : 0; }
+    size_t size() const { return _map ? _map_size - DATA_OFFSET : 0; }
+
+private:
+    SharedImage(const SharedImage&);
+    SharedImage& operator=(const SharedImage&);
+
+    struct Header
+    {
+        volatile uint32_t ready;
+        uint32_t reserved;
+        uint64_t size;
+    };
+
+    static const size_t DATA_OFFSET = 64;
+    static const int POLL_MS = 100;
+
+    static std::string shm_name(const std::string& name) { return name[0] == '/' ? name : "/" + name; }
+
+    bool read_header(Header& header) const
+    {
+        return pread(_fd, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+    }
+
+    int _fd;
+    char* _map;
+    size_t _map_size;
+    bool _claimed;
+    std::string _name;
+};
+
+#endif //OCTREE_SHM_H_
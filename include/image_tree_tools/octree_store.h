@@ -0,0 +1,283 @@
+#ifndef OCTREE_STORE_H_
+#define OCTREE_STORE_H_
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "octree.h"
+
+/// Read-only in-memory store of many byte-valued octrees, e.g. a preloaded
+/// training set. Each octree is kept as one compact record:
+///
+///   varint num_cells, varint max_level + 1, byte value_bits
+///   varint key_bytes      size of the key deltas
+///   varint key deltas     sorted keys, each minus its predecessor
+///   packed values         value_bits (1, 2, 4 or 8) per cell, LSB first
+///
+/// Siblings and neighbours differ in the low key bits, so most deltas fit
+/// into one byte; occupancy values need a bit or two. Records live in large
+/// arena blocks instead of one allocation per array, or in an image written
+/// by write_image, e.g. in shared memory (octree_shm.h).
+template <class KEY = OctreeKey>
+class CompactOctreeStore
+{
+
+public:
+    typedef GeneralOctree<byte, KEY> StoredOctree;
+
+    CompactOctreeStore() : _block_used(0), _large_bytes(0), _bytes(0), _num_cells(0) {}
+    ~CompactOctreeStore() { clear(); }
+
+    /// Empties the store and makes room for num_models records.
+    void resize(size_t num_models)
+    {
+        clear();
+        _records.assign(num_models, Record());
+    }
+
+    void clear()
+    {
+        for(size_t i=0; i<_blocks.size(); i++) delete[] _blocks[i];
+        for(size_t i=0; i<_large.size(); i++) delete[] _large[i];
+        _blocks.clear();
+        _large.clear();
+        _records.clear();
+        _block_used = 0;
+        _large_bytes = 0;
+        _bytes = 0;
+        _num_cells = 0;
+    }
+
+    size_t size() const { return _records.size(); }
+    bool contains(size_t ind) const { return _records[ind].data != 0; }
+
+    /// Bytes of all records, and bytes allocated for them.
+    size_t bytes() const { return _bytes; }
+    size_t allocated_bytes() const { return _blocks.size() * BLOCK_SIZE + _large_bytes; }
+    size_t num_cells() const { return _num_cells; }
+    /// Cells of record ind, without decoding it.
+    size_t num_cells(size_t ind) const
+    {
+        const unsigned char* ptr = _records[ind].data;
+        return get_varint(ptr);
+    }
+
+    /// Encodes an octree into a record. Does not touch the store, so any
+    /// number of octrees may be encoded concurrently.
+    static void encode(const StoredOctree& octree, std::vector<unsigned char>& record)
+    {
+        const std::vector<KEY>& keys = octree.keys();
+        const std::vector<byte>& values = octree.values();
+        const size_t n = keys.size();
+
+        byte max_value = 0;
+        for(size_t i=0; i<n; i++) max_value = std::max(max_value, values[i]);
+        int bits = 1;
+        while(bits < 8 && (max_value >> bits)) bits *= 2;
+
+        record.clear();
+        record.reserve(n * 2 + 16);
+        put_varint(record, n);
+        put_varint(record, octree.max_level() + 1);
+        record.push_back(bits);
+
+        std::vector<unsigned char> deltas;
+        deltas.reserve(n * 2);
+        KEY prev = 0;
+        for(size_t i=0; i<n; i++)
+        {
+            put_varint(deltas, keys[i] - prev);
+            prev = keys[i];
+        }
+        put_varint(record, deltas.size());
+        record.insert(record.end(), deltas.begin(), deltas.end());
+
+        const size_t begin = record.size();
+        record.resize(begin + (n * bits + 7) / 8, 0);
+        unsigned char* packed = &record[begin];
+        for(size_t i=0; i<n; i++)
+        {
+            const size_t bit = i * bits;
+            packed[bit >> 3] |= values[i] << (bit & 7);
+        }
+    }
+
+    /// Copies an encoded record into the arena as model ind.
+    void insert(size_t ind, const std::vector<unsigned char>& record)
+    {
+        unsigned char* data = allocate(record.size());
+        memcpy(data, &record[0], record.size());
+        _records[ind].data = data;
+        _records[ind].size = record.size();
+        _bytes += record.size();
+
+        const unsigned char* ptr = data;
+        _num_cells += get_varint(ptr);
+    }
+
+    /// Size of the image written by write_image.
+    size_t image_bytes() const
+    {
+        return sizeof(ImageHeader) + (_records.size() + 1) * sizeof(uint64_t) + _bytes;
+    }
+
+    /// Writes the index and all records into one position independent
+    /// block. tag identifies the dataset, for attach_image to check.
+    void write_image(char* image, uint64_t tag) const
+    {
+        ImageHeader header;
+        memcpy(header.magic, "OTS\n", 4);
+        header.version = 1;
+        header.tag = tag;
+        header.num_models = _records.size();
+        header.num_cells = _num_cells;
+        memcpy(image, &header, sizeof(header));
+
+        uint64_t* offsets = reinterpret_cast<uint64_t*>(image + sizeof(header));
+        char* data = image + sizeof(header) + (_records.size() + 1) * sizeof(uint64_t);
+        uint64_t offset = 0;
+        for(size_t i=0; i<_records.size(); i++)
+        {
+            offsets[i] = offset;
+            if(_records[i].size) memcpy(data + offset, _records[i].data, _records[i].size);
+            offset += _records[i].size;
+        }
+        offsets[_records.size()] = offset;
+    }
+
+    /// Uses the records of an image in place, without copying them; the
+    /// image has to outlive the store. False unless it was written with tag.
+    bool attach_image(const char* image, size_t size, uint64_t tag)
+    {
+        clear();
+        ImageHeader header;
+        if(size < sizeof(header)) return false;
+        memcpy(&header, image, sizeof(header));
+        if(memcmp(header.magic, "OTS\n", 4) || header.version != 1 || header.tag != tag) return false;
+
+        const size_t index_end = sizeof(header) + (header.num_models + 1) * sizeof(uint64_t);
+        if(index_end > size) return false;
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(image + sizeof(header));
+        if(index_end + offsets[header.num_models] > size) return false;
+
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(image + index_end);
+        _records.resize(header.num_models);
+        for(size_t i=0; i<_records.size(); i++)
+        {
+            _records[i].size = offsets[i + 1] - offsets[i];
+            _records[i].data = _records[i].size ? data + offsets[i] : 0;
+        }
+        _bytes = offsets[header.num_models];
+        _num_cells = header.num_cells;
+        return true;
+    }
+
+    /// With level >= 0, only the cells up to that level are decoded, see
+    /// GeneralOctree::take_levels.
+    void decode(size_t ind, StoredOctree& octree, int level = -1, byte internal_value = 0) const
+    {
+        const unsigned char* ptr = _records[ind].data;
+        const size_t n = get_varint(ptr);
+        const int max_level = int(get_varint(ptr)) - 1;
+        const int bits = *ptr++;
+        const size_t key_bytes = get_varint(ptr);
+        const unsigned char* packed = ptr + key_bytes;
+
+        // keys are sorted level by level, so the coarse levels come first
+        const bool truncated = level >= 0 && level < max_level;
+        const KEY end_key = truncated ? KEY(1) << 3 * (level + 1) : 0;
+
+        std::vector<KEY> keys;
+        keys.reserve(truncated ? 0 : n);
+        KEY key = 0;
+        for(size_t i=0; i<n; i++)
+        {
+            key += KEY(get_varint(ptr));
+            if(truncated && key >= end_key) break;
+            keys.push_back(key);
+        }
+
+        std::vector<byte> values(keys.size());
+        const byte mask = (1 << bits) - 1;
+        for(size_t i=0; i<keys.size(); i++)
+        {
+            const size_t bit = i * bits;
+            values[i] = (packed[bit >> 3] >> (bit & 7)) & mask;
+        }
+
+        if(truncated)
+        {
+            octree.take_levels(keys, values, level, internal_value);
+            return;
+        }
+        octree.take_sorted(keys, values);
+        octree.set_max_level(max_level);
+    }
+
+private:
+    CompactOctreeStore(const CompactOctreeStore&);
+    CompactOctreeStore& operator=(const CompactOctreeStore&);
+
+    static const size_t BLOCK_SIZE = 16 << 20;
+
+    struct ImageHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t tag;
+        uint64_t num_models;
+        uint64_t num_cells;
+    };
+
+    struct Record
+    {
+        Record() : data(0), size(0) {}
+
+        const unsigned char* data;
+        size_t size;
+    };
+
+    static void put_varint(std::vector<unsigned char>& out, uint64_t value)
+    {
+        while(value >= 0x80)
+        {
+            out.push_back((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(value);
+    }
+
+    static uint64_t get_varint(const unsigned char*& ptr)
+    {
+        uint64_t value = *ptr & 0x7f;
+        for(int shift = 7; *ptr++ & 0x80; shift += 7) value |= uint64_t(*ptr & 0x7f) << shift;
+        return value;
+    }
+
+    unsigned char* allocate(size_t size)
+    {
+        // records that would waste most of a block get their own
+        if(size > BLOCK_SIZE / 4)
+        {
+            _large.push_back(new unsigned char[size]);
+            _large_bytes += size;
+            return _large.back();
+        }
+        if(_blocks.empty() || _block_used + size > BLOCK_SIZE)
+        {
+            _blocks.push_back(new unsigned char[BLOCK_SIZE]);
+            _block_used = 0;
+        }
+        unsigned char* data = _blocks.back() + _block_used;
+        _block_used += size;
+        return data;
+    }
+
+    std::vector<Record> _records;
+    std::vector<unsigned char*> _blocks, _large;
+    size_t _block_used, _large_bytes;
+    size_t _bytes, _num_cells;
+};
+
+#endif //OCTREE_STORE_H_
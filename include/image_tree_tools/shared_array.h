@@ -0,0 +1,59 @@
+#ifndef SHARED_ARRAY_H_
+#define SHARED_ARRAY_H_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/// Copy-on-write array. Copies share one buffer until one of them asks for
+/// write access with mutate(), so copying an octree costs a reference count
+/// instead of its arrays. Reads go through the const vector interface.
+template <class T>
+class SharedArray
+{
+
+public:
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    const std::vector<T>& get() const { return _data ? *_data : empty_vector(); }
+
+    size_t size() const { return get().size(); }
+    bool empty() const { return get().empty(); }
+    const T& operator[](size_t i) const { return (*_data)[i]; }
+    const T& back() const { return _data->back(); }
+    const_iterator begin() const { return get().begin(); }
+    const_iterator end() const { return get().end(); }
+
+    /// Write access; copies the buffer first if it is shared.
+    std::vector<T>& mutate()
+    {
+        if(!_data) _data.reset(new std::vector<T>());
+        else if(!_data.unique()) _data.reset(new std::vector<T>(*_data));
+        return *_data;
+    }
+
+    /// Drops this reference; other copies keep the buffer.
+    void clear() { _data.reset(); }
+
+    void assign(const std::vector<T>& values) { _data.reset(new std::vector<T>(values)); }
+
+    /// Takes over the contents of values, leaving it empty.
+    void take(std::vector<T>& values)
+    {
+        _data.reset(new std::vector<T>());
+        _data->swap(values);
+    }
+
+    bool is_shared() const { return _data && !_data.unique(); }
+
+private:
+    static const std::vector<T>& empty_vector()
+    {
+        static const std::vector<T> empty;
+        return empty;
+    }
+
+    boost::shared_ptr<std::vector<T> > _data;
+};
+
+#endif //SHARED_ARRAY_H_
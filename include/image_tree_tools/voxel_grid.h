@@ -3,9 +3,15 @@
 
 #include <boost/shared_array.hpp>
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <sstream>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 //OCCUPANCY SIGNAL VALUES
 #define CLASS_EMPTY 0
@@ -31,7 +37,7 @@ public:
     GeneralVoxelGrid(int depth, int height, int width)
     {
         _depth = depth; _height = height; _width = width;
-        _voxels = boost::shared_array<VALUE>(new VALUE(size()));
+        _voxels = boost::shared_array<VALUE>(new VALUE[size()]());
     }
 
     int size() {return _depth * _height * _width;}
@@ -42,10 +48,59 @@ public:
 
     int height() {return _height;}
 
+    VALUE* data() {return _voxels.get();}
+
     VALUE get_element(int i, int j, int k) {return _voxels[i * _width * _height + j * _height + k];}
     void set_element(int i, int j, int k, VALUE val) {_voxels[i * _width * _height + j * _height + k] = val;}
 };
 
+/// Reads a whole file with a single read.
+inline bool read_file_buffer(const std::string& fname, std::vector<char>& buffer)
+{
+    std::ifstream input(fname.c_str(), std::ios::in | std::ios::binary);
+    if(!input.good()) return false;
+    input.seekg(0, std::ios::end);
+    std::streamoff size = input.tellg();
+    input.seekg(0, std::ios::beg);
+    buffer.resize(size);
+    if(size > 0) input.read(&buffer[0], size);
+    return input.good();
+}
+
+/// Parses the text header of a .binvox file held in memory and returns the
+/// offset of the first (value, count) pair, or 0 on error.
+inline size_t parse_binvox_header(const std::vector<char>& buffer, int& depth, int& height, int& width)
+{
+    const char data_tag[] = "\ndata\n";
+    std::vector<char>::const_iterator data_it =
+        std::search(buffer.begin(), buffer.end(), data_tag, data_tag + 6);
+    if(data_it == buffer.end())
+    {
+        std::cout << "  error reading header" << std::endl;
+        return 0;
+    }
+
+    std::istringstream input(std::string(buffer.begin(), data_it));
+    std::string line;
+    input >> line;  // #binvox
+    if (line.compare("#binvox") != 0) {
+      std::cout << "Error: first line reads [" << line << "] instead of [#binvox]" << std::endl;
+      return 0;
+    }
+
+    depth = -1;
+    while(input >> line)
+    {
+      if (line.compare("dim") == 0) input >> depth >> height >> width;
+      else input.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    if (depth == -1) {
+      std::cout << "  missing dimensions in header" << std::endl;
+      return 0;
+    }
+    return (data_it - buffer.begin()) + 6;
+}
+
 class OccupancyVoxelGrid : public GeneralVoxelGrid<byte>
 {
 
@@ -55,83 +110,178 @@ public:
     : GeneralVoxelGrid(){}
   OccupancyVoxelGrid(int depth, int height, int width)
     : GeneralVoxelGrid(depth, height, width){}
+  OccupancyVoxelGrid(const GeneralVoxelGrid<byte>& vg)
+    : GeneralVoxelGrid(vg){}
 
   int read_binvox(std::string filespec)
   {
-      std::ifstream *input = new std::ifstream(filespec.c_str(), std::ios::in | std::ios::binary);
-
-      // read header
-      std::string line;
-      std::string version;
-      *input >> line;  // #binvox
-      if (line.compare("#binvox") != 0) {
-        std::cout << "Error: first line reads [" << line << "] instead of [#binvox]" << std::endl;
-        delete input;
-        return 0;
-      }
-      *input >> version;
-
-      _depth = -1;
-      int done = 0;
-      while(input->good() && !done) {
-        *input >> line;
-        if (line.compare("data") == 0) done = 1;
-        else if (line.compare("dim") == 0) {
-          *input >> _depth >> _height >> _width;
-        }
-        else {
-          char c;
-          do {  // skip until end of line
-            c = input->get();
-          } while(input->good() && (c != '\n'));
-
-        }
+      std::vector<char> buffer;
+      if(!read_file_buffer(filespec, buffer)) return 0;
+      size_t pos = parse_binvox_header(buffer, _depth, _height, _width);
+      if(!pos) return 0;
+
+      _voxels = boost::shared_array<byte>(new byte[this->size()]());
+
+      // read voxel data
+      int index = 0;
+      for(; pos + 1 < buffer.size() && index < size(); pos += 2)
+      {
+          byte value = buffer[pos];
+          int end_index = index + byte(buffer[pos + 1]);
+          if (end_index > size()) return 0;
+          memset(&_voxels[index], value ? CLASS_FILLED : CLASS_EMPTY, end_index - index);
+          index = end_index;
       }
-      if (!done) {
-        std::cout << "  error reading header" << std::endl;
-        return 0;
+      return 1;
+  }
+
+  /// Run-length encodes the grid into a buffer and writes it at once.
+  int write_binvox(std::string filespec)
+  {
+      std::ostringstream header;
+      header << "#binvox 1\n" << "dim " << _depth << " " << _height << " " << _width << "\n"
+             << "translate 0 0 0\n" << "scale 1\n" << "data\n";
+
+      const std::string header_str = header.str();
+      std::vector<char> buffer(header_str.begin(), header_str.end());
+      const byte* voxels = _voxels.get();
+      const byte* end = voxels + size();
+      while(voxels != end)
+      {
+          byte value = *voxels;
+          const byte* run_end = voxels + std::min<ptrdiff_t>(255, end - voxels);
+          const byte* next = voxels + 1;
+          while(next != run_end && *next == value) ++next;
+          buffer.push_back(value == CLASS_FILLED ? 1 : 0);
+          buffer.push_back(byte(next - voxels));
+          voxels = next;
       }
-      if (_depth == -1) {
-        std::cout << "  missing dimensions in header" << std::endl;
-        return 0;
+
+      std::ofstream output(filespec.c_str(), std::ios::out | std::ios::binary);
+      output.write(&buffer[0], buffer.size());
+      output.close();
+      return output.fail() ? 0 : 1;
+  }
+};
+
+/// Occupancy grid stored as runs along the height axis, one run list per
+/// (depth, width) row. Memory grows with the number of value changes rather
+/// than with the volume, and aligned cubes can be tested for uniformity
+/// without visiting their voxels (see RegionOctreeBuilder).
+class RunLengthVoxelGrid
+{
+
+public:
+  RunLengthVoxelGrid() : _depth(0), _height(0), _width(0) {}
+
+  int depth() const {return _depth;}
+  int width() const {return _width;}
+  int height() const {return _height;}
+  size_t num_runs() const {return _run_start.size();}
+
+  /// Converts the binvox run-length pairs directly, one buffered file read.
+  int read_binvox(std::string filespec)
+  {
+      std::vector<char> buffer;
+      if(!read_file_buffer(filespec, buffer)) return 0;
+      size_t pos = parse_binvox_header(buffer, _depth, _height, _width);
+      if(!pos) return 0;
+
+      const int num_rows = _depth * _width;
+      _row_begin.clear();
+      _run_start.clear();
+      _run_value.clear();
+      _row_begin.reserve(num_rows + 1);
+
+      int row = 0, z = 0;
+      for(; pos + 1 < buffer.size() && row < num_rows; pos += 2)
+      {
+          byte value = buffer[pos] ? CLASS_FILLED : CLASS_EMPTY;
+          int count = byte(buffer[pos + 1]);
+          while(count > 0)
+          {
+              if(row == num_rows) return 0;
+              if(z == 0) _row_begin.push_back(_run_start.size());
+              if(z == 0 || _run_value.back() != value) add_run(z, value);
+
+              int len = std::min(count, _height - z);
+              z += len;
+              count -= len;
+              if(z == _height)
+              {
+                  z = 0;
+                  row++;
+              }
+          }
       }
 
-      _voxels = boost::shared_array<byte>(new byte[this->size()]);
-      if (!_voxels) {
-        std::cout << "  error allocating memory" << std::endl;
-        return 0;
+      // truncated data is empty
+      if(z > 0 && _run_value.back() != CLASS_EMPTY) add_run(z, CLASS_EMPTY);
+      if(z > 0) row++;
+      for(; row < num_rows; row++)
+      {
+          _row_begin.push_back(_run_start.size());
+          add_run(0, CLASS_EMPTY);
       }
-      // read voxel data
-      byte value;
-      byte count;
-      int index = 0;
-      int end_index = 0;
-      int nr_voxels = 0;
+      _row_begin.push_back(_run_start.size());
+      return 1;
+  }
 
-      input->unsetf(std::ios::skipws);  // need to read every byte now (!)
-      *input >> value;  // read the linefeed char
+  byte get_element(int i, int j, int k) const
+  {
+      byte value;
+      uniform(i, j, k, 1, value);
+      return value;
+  }
 
-      while((end_index < size()) && input->good()) {
-        *input >> value >> count;
+  /// Whether the size^3 cube at (x, y, z) holds one value only. Voxels
+  /// outside the grid count as empty.
+  bool uniform(int x, int y, int z, int size, byte& value) const
+  {
+      value = CLASS_EMPTY;
+      if(z >= _height) return true;
 
-        if (input->good()) {
-          end_index = index + count;
-          if (end_index > size()) return 0;
-          for(int i=index; i < end_index; i++)
+      bool first = true;
+      for(int i=x; i<x+size; i++)
+      {
+          for(int j=y; j<y+size; j++)
           {
-              if (value) _voxels[i] = CLASS_FILLED;
-              else _voxels[i] = CLASS_EMPTY;
-          }
+              byte v = CLASS_EMPTY;
+              if(i < _depth && j < _width)
+              {
+                  const int row = i * _width + j;
+                  const int* begin = &_run_start[0] + _row_begin[row];
+                  const int* end = &_run_start[0] + _row_begin[row + 1];
+                  int run = std::upper_bound(begin, end, z) - &_run_start[0] - 1;
+                  v = _run_value[run];
 
-          if (value) nr_voxels += count;
-          index = end_index;
-        }  // if file still ok
+                  int run_end = &_run_start[0] + run + 1 < end ? _run_start[run + 1] :
+                                v == CLASS_EMPTY ? z + size : _height;
+                  if(run_end < z + size) return false;
+              }
 
-      }  // while
-      input->close();
-      delete input;
-      return 1;
+              if(first)
+              {
+                  value = v;
+                  first = false;
+              }
+              else if(v != value) return false;
+          }
+      }
+      return true;
   }
+
+private:
+  void add_run(int z, byte value)
+  {
+      _run_start.push_back(z);
+      _run_value.push_back(value);
+  }
+
+  int _depth, _height, _width;
+  std::vector<int> _row_begin;
+  std::vector<int> _run_start;
+  std::vector<byte> _run_value;
 };
 
 #endif // VOXEL_GRID_H
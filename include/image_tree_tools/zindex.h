@@ -68,4 +68,82 @@ inline void inverse_morton_3d(uint32_t& x, uint32_t& y, uint32_t& z, uint32_t in
 }
 
 
+/*!
+ *  Computes the morton number for three 21-bit integers
+ *
+ *  \param x  Integer that uses up to 21 bit
+ *  \param y  Integer that uses up to 21 bit
+ *  \param z  Integer that uses up to 21 bit
+ *
+ *  \return   The morton number as 64-bit int with 63 bits used.
+ */
+inline uint64_t morton_3d(uint64_t x, uint64_t y, uint64_t z)
+{
+  x &= 0x1FFFFF;
+  x = (x | (x << 32)) & 0x001F00000000FFFFULL;
+  x = (x | (x << 16)) & 0x001F0000FF0000FFULL;
+  x = (x | (x <<  8)) & 0x100F00F00F00F00FULL;
+  x = (x | (x <<  4)) & 0x10C30C30C30C30C3ULL;
+  x = (x | (x <<  2)) & 0x1249249249249249ULL;
+
+  y &= 0x1FFFFF;
+  y = (y | (y << 32)) & 0x001F00000000FFFFULL;
+  y = (y | (y << 16)) & 0x001F0000FF0000FFULL;
+  y = (y | (y <<  8)) & 0x100F00F00F00F00FULL;
+  y = (y | (y <<  4)) & 0x10C30C30C30C30C3ULL;
+  y = (y | (y <<  2)) & 0x1249249249249249ULL;
+
+  z &= 0x1FFFFF;
+  z = (z | (z << 32)) & 0x001F00000000FFFFULL;
+  z = (z | (z << 16)) & 0x001F0000FF0000FFULL;
+  z = (z | (z <<  8)) & 0x100F00F00F00F00FULL;
+  z = (z | (z <<  4)) & 0x10C30C30C30C30C3ULL;
+  z = (z | (z <<  2)) & 0x1249249249249249ULL;
+
+  return x | (y << 1) | (z << 2);
+}
+
+
+/*!
+ *  Computes the non-interleaved inputs from the given 64-bit morton number
+ *
+ *  \param x      Output parameter. stores as 21-bit integer
+ *  \param y      Output parameter. stores as 21-bit integer
+ *  \param z      Output parameter. stores as 21-bit integer
+ *  \param input  Input morton number with 63 bits. The most significant
+ *                bit must be 0.
+ */
+inline void inverse_morton_3d(uint64_t& x, uint64_t& y, uint64_t& z, uint64_t input)
+{
+  x = input &        0x1249249249249249ULL;
+  y = (input >> 1) & 0x1249249249249249ULL;
+  z = (input >> 2) & 0x1249249249249249ULL;
+
+  x = ((x >> 2) | x) & 0x10C30C30C30C30C3ULL;
+  x = ((x >> 4) | x) & 0x100F00F00F00F00FULL;
+  x = ((x >> 8) | x) & 0x001F0000FF0000FFULL;
+  x = ((x >>16) | x) & 0x001F00000000FFFFULL;
+  x = ((x >>32) | x) & 0x00000000001FFFFFULL;
+
+  y = ((y >> 2) | y) & 0x10C30C30C30C30C3ULL;
+  y = ((y >> 4) | y) & 0x100F00F00F00F00FULL;
+  y = ((y >> 8) | y) & 0x001F0000FF0000FFULL;
+  y = ((y >>16) | y) & 0x001F00000000FFFFULL;
+  y = ((y >>32) | y) & 0x00000000001FFFFFULL;
+
+  z = ((z >> 2) | z) & 0x10C30C30C30C30C3ULL;
+  z = ((z >> 4) | z) & 0x100F00F00F00F00FULL;
+  z = ((z >> 8) | z) & 0x001F0000FF0000FFULL;
+  z = ((z >>16) | z) & 0x001F00000000FFFFULL;
+  z = ((z >>32) | z) & 0x00000000001FFFFFULL;
+}
+
+
+/*!
+ *  Number of leading zero bits; the argument must not be 0.
+ */
+inline int count_leading_zeros(uint32_t v) { return __builtin_clz(v); }
+inline int count_leading_zeros(uint64_t v) { return __builtin_clzll(v); }
+
+
 #endif /* ZINDEX_H_ */
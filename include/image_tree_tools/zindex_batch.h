@@ -0,0 +1,283 @@
+#ifndef ZINDEX_BATCH_H_
+#define ZINDEX_BATCH_H_
+
+#include <cstddef>
+
+#include <stdint.h>
+
+#include "zindex.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZINDEX_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/// Batched morton encoding/decoding of coordinate arrays.
+///
+/// Three implementations are available and picked at runtime:
+///   MORTON_BMI2    one PDEP/PEXT per coordinate
+///   MORTON_AVX2    the shift/mask ladder of zindex.h on 8 (32-bit keys)
+///                  or 4 (64-bit keys) lanes at once
+///   MORTON_SCALAR  morton_3d / inverse_morton_3d in a loop
+/// MORTON_AUTO selects the fastest kernel the CPU supports for the key width.
+enum MortonKernel
+{
+    MORTON_AUTO = 0,
+    MORTON_SCALAR,
+    MORTON_BMI2,
+    MORTON_AVX2
+};
+
+inline const char* morton_kernel_name(MortonKernel kernel)
+{
+    switch(kernel)
+    {
+        case MORTON_SCALAR: return "scalar";
+        case MORTON_BMI2: return "bmi2";
+        case MORTON_AVX2: return "avx2";
+        default: return "auto";
+    }
+}
+
+inline bool morton_kernel_supported(MortonKernel kernel)
+{
+    switch(kernel)
+    {
+        case MORTON_AUTO:
+        case MORTON_SCALAR: return true;
+#ifdef ZINDEX_X86_KERNELS
+        case MORTON_BMI2: return __builtin_cpu_supports("bmi2");
+        case MORTON_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+        default: return false;
+    }
+}
+
+/// Eight 32-bit lanes of AVX2 outrun one PDEP per coordinate, while four
+/// 64-bit lanes do not; the preferred kernel therefore depends on the key width.
+inline MortonKernel resolve_morton_kernel(MortonKernel kernel, size_t key_size)
+{
+    if(kernel != MORTON_AUTO) return morton_kernel_supported(kernel) ? kernel : MORTON_SCALAR;
+
+    static const bool bmi2 = morton_kernel_supported(MORTON_BMI2);
+    static const bool avx2 = morton_kernel_supported(MORTON_AVX2);
+    if(key_size <= 4) return avx2 ? MORTON_AVX2 : bmi2 ? MORTON_BMI2 : MORTON_SCALAR;
+    return bmi2 ? MORTON_BMI2 : avx2 ? MORTON_AVX2 : MORTON_SCALAR;
+}
+
+namespace zindex_detail
+{
+
+template <class KEY>
+inline void encode_scalar(const uint32_t* x, const uint32_t* y, const uint32_t* z, KEY* keys, size_t n)
+{
+    for(size_t i=0; i<n; i++) keys[i] = morton_3d(KEY(x[i]), KEY(y[i]), KEY(z[i]));
+}
+
+template <class KEY>
+inline void decode_scalar(const KEY* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+    {
+        KEY kx, ky, kz;
+        inverse_morton_3d(kx, ky, kz, keys[i]);
+        x[i] = kx; y[i] = ky; z[i] = kz;
+    }
+}
+
+#ifdef ZINDEX_X86_KERNELS
+
+__attribute__((target("bmi2")))
+inline void encode_bmi2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* keys, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+        keys[i] = _pdep_u32(x[i], 0x09249249) | _pdep_u32(y[i], 0x12492492) | _pdep_u32(z[i], 0x24924924);
+}
+
+__attribute__((target("bmi2")))
+inline void decode_bmi2(const uint32_t* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+    {
+        x[i] = _pext_u32(keys[i], 0x09249249);
+        y[i] = _pext_u32(keys[i], 0x12492492);
+        z[i] = _pext_u32(keys[i], 0x24924924);
+    }
+}
+
+#ifdef __x86_64__
+__attribute__((target("bmi2")))
+inline void encode_bmi2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* keys, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+        keys[i] = _pdep_u64(x[i], 0x1249249249249249ULL) | _pdep_u64(y[i], 0x2492492492492492ULL) |
+                  _pdep_u64(z[i], 0x4924924924924924ULL);
+}
+
+__attribute__((target("bmi2")))
+inline void decode_bmi2(const uint64_t* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    for(size_t i=0; i<n; i++)
+    {
+        x[i] = _pext_u64(keys[i], 0x1249249249249249ULL);
+        y[i] = _pext_u64(keys[i], 0x2492492492492492ULL);
+        z[i] = _pext_u64(keys[i], 0x4924924924924924ULL);
+    }
+}
+#else
+inline void encode_bmi2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* keys, size_t n)
+{
+    encode_scalar(x, y, z, keys, n);
+}
+
+inline void decode_bmi2(const uint64_t* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    decode_scalar(keys, x, y, z, n);
+}
+#endif
+
+__attribute__((target("avx2")))
+inline __m256i spread_avx2_32(__m256i v)
+{
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 16)), _mm256_set1_epi32(0x030000FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  8)), _mm256_set1_epi32(0x0300F00F));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  4)), _mm256_set1_epi32(0x030C30C3));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v,  2)), _mm256_set1_epi32(0x09249249));
+    return v;
+}
+
+__attribute__((target("avx2")))
+inline __m256i compact_avx2_32(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi32(0x09249249));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  2)), _mm256_set1_epi32(0x030C30C3));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  4)), _mm256_set1_epi32(0x0300F00F));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v,  8)), _mm256_set1_epi32(0x030000FF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi32(v, 16)), _mm256_set1_epi32(0x000003FF));
+    return v;
+}
+
+__attribute__((target("avx2")))
+inline __m256i spread_avx2_64(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(0x1FFFFF));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 32)), _mm256_set1_epi64x(0x001F00000000FFFFULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v, 16)), _mm256_set1_epi64x(0x001F0000FF0000FFULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  8)), _mm256_set1_epi64x(0x100F00F00F00F00FULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  4)), _mm256_set1_epi64x(0x10C30C30C30C30C3ULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi64(v,  2)), _mm256_set1_epi64x(0x1249249249249249ULL));
+    return v;
+}
+
+__attribute__((target("avx2")))
+inline __m128i compact_avx2_64(__m256i v)
+{
+    v = _mm256_and_si256(v, _mm256_set1_epi64x(0x1249249249249249ULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  2)), _mm256_set1_epi64x(0x10C30C30C30C30C3ULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  4)), _mm256_set1_epi64x(0x100F00F00F00F00FULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v,  8)), _mm256_set1_epi64x(0x001F0000FF0000FFULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v, 16)), _mm256_set1_epi64x(0x001F00000000FFFFULL));
+    v = _mm256_and_si256(_mm256_or_si256(v, _mm256_srli_epi64(v, 32)), _mm256_set1_epi64x(0x00000000001FFFFFULL));
+    // gather the low halves of the four 64-bit lanes
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+    return _mm256_castsi256_si128(v);
+}
+
+__attribute__((target("avx2")))
+inline void encode_avx2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint32_t* keys, size_t n)
+{
+    size_t i = 0;
+    for(; i+8<=n; i+=8)
+    {
+        __m256i vx = spread_avx2_32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)));
+        __m256i vy = spread_avx2_32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i)));
+        __m256i vz = spread_avx2_32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(z + i)));
+        __m256i k = _mm256_or_si256(vx, _mm256_or_si256(_mm256_slli_epi32(vy, 1), _mm256_slli_epi32(vz, 2)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i), k);
+    }
+    encode_scalar(x + i, y + i, z + i, keys + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void decode_avx2(const uint32_t* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    size_t i = 0;
+    for(; i+8<=n; i+=8)
+    {
+        __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(x + i), compact_avx2_32(k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(y + i), compact_avx2_32(_mm256_srli_epi32(k, 1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(z + i), compact_avx2_32(_mm256_srli_epi32(k, 2)));
+    }
+    decode_scalar(keys + i, x + i, y + i, z + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void encode_avx2(const uint32_t* x, const uint32_t* y, const uint32_t* z, uint64_t* keys, size_t n)
+{
+    size_t i = 0;
+    for(; i+4<=n; i+=4)
+    {
+        __m256i vx = spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i))));
+        __m256i vy = spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i))));
+        __m256i vz = spread_avx2_64(_mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(z + i))));
+        __m256i k = _mm256_or_si256(vx, _mm256_or_si256(_mm256_slli_epi64(vy, 1), _mm256_slli_epi64(vz, 2)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i), k);
+    }
+    encode_scalar(x + i, y + i, z + i, keys + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void decode_avx2(const uint64_t* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n)
+{
+    size_t i = 0;
+    for(; i+4<=n; i+=4)
+    {
+        __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(x + i), compact_avx2_64(k));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i), compact_avx2_64(_mm256_srli_epi64(k, 1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(z + i), compact_avx2_64(_mm256_srli_epi64(k, 2)));
+    }
+    decode_scalar(keys + i, x + i, y + i, z + i, n - i);
+}
+
+#endif // ZINDEX_X86_KERNELS
+
+} // namespace zindex_detail
+
+/*!
+ *  Computes the morton numbers of n coordinate triples. Works for 32-bit
+ *  (10 bits per coordinate) and 64-bit (21 bits per coordinate) keys.
+ */
+template <class KEY>
+inline void morton_3d_batch(const uint32_t* x, const uint32_t* y, const uint32_t* z, KEY* keys, size_t n,
+                            MortonKernel kernel = MORTON_AUTO)
+{
+    switch(resolve_morton_kernel(kernel, sizeof(KEY)))
+    {
+#ifdef ZINDEX_X86_KERNELS
+        case MORTON_BMI2: zindex_detail::encode_bmi2(x, y, z, keys, n); break;
+        case MORTON_AVX2: zindex_detail::encode_avx2(x, y, z, keys, n); break;
+#endif
+        default: zindex_detail::encode_scalar(x, y, z, keys, n);
+    }
+}
+
+/*!
+ *  Splits n morton numbers back into their coordinates.
+ */
+template <class KEY>
+inline void inverse_morton_3d_batch(const KEY* keys, uint32_t* x, uint32_t* y, uint32_t* z, size_t n,
+                                    MortonKernel kernel = MORTON_AUTO)
+{
+    switch(resolve_morton_kernel(kernel, sizeof(KEY)))
+    {
+#ifdef ZINDEX_X86_KERNELS
+        case MORTON_BMI2: zindex_detail::decode_bmi2(keys, x, y, z, n); break;
+        case MORTON_AVX2: zindex_detail::decode_avx2(keys, x, y, z, n); break;
+#endif
+        default: zindex_detail::decode_scalar(keys, x, y, z, n);
+    }
+}
+
+#endif /* ZINDEX_BATCH_H_ */
@@ -1,77 +1,93 @@
 import math
+import struct
 import numpy as np
 
 
-def morton3d(x, y, z):
-    x = (x | (x << 16)) & 0x030000FF
-    x = (x | (x << 8)) & 0x0300F00F
-    x = (x | (x << 4)) & 0x030C30C3
-    x = (x | (x << 2)) & 0x09249249
-
-    y = (y | (y << 16)) & 0x030000FF
-    y = (y | (y << 8)) & 0x0300F00F
-    y = (y | (y << 4)) & 0x030C30C3
-    y = (y | (y << 2)) & 0x09249249
-
-    z = (z | (z << 16)) & 0x030000FF
-    z = (z | (z << 8)) & 0x0300F00F
-    z = (z | (z << 4)) & 0x030C30C3
-    z = (z | (z << 2)) & 0x09249249
+# Keys are Python ints, so 32-bit keys (levels up to 10) and the 64-bit
+# keys of USE_OGN_64BIT_KEYS builds (levels up to 21) are handled alike.
 
-    return np.uint32(x | (y << 1) | (z << 2))
+def split_by_3(x):
+    x = int(x) & 0x1FFFFF
+    x = (x | (x << 32)) & 0x1F00000000FFFF
+    x = (x | (x << 16)) & 0x1F0000FF0000FF
+    x = (x | (x << 8)) & 0x100F00F00F00F00F
+    x = (x | (x << 4)) & 0x10C30C30C30C30C3
+    x = (x | (x << 2)) & 0x1249249249249249
+    return x
 
 
-def inverse_morton3d(z):
-    x = z & 0x09249249
-    y = (z >> 1) & 0x09249249
-    z = (z >> 2) & 0x09249249
+def compact_by_3(x):
+    x = int(x) & 0x1249249249249249
+    x = (x | (x >> 2)) & 0x10C30C30C30C30C3
+    x = (x | (x >> 4)) & 0x100F00F00F00F00F
+    x = (x | (x >> 8)) & 0x1F0000FF0000FF
+    x = (x | (x >> 16)) & 0x1F00000000FFFF
+    x = (x | (x >> 32)) & 0x1FFFFF
+    return x
 
-    x = ((x >> 2) | x) & 0x030C30C3
-    x = ((x >> 4) | x) & 0x0300F00F
-    x = ((x >> 8) | x) & 0x030000FF
-    x = ((x >> 16) | x) & 0x000003FF
 
-    y = ((y >> 2) | y) & 0x030C30C3
-    y = ((y >> 4) | y) & 0x0300F00F
-    y = ((y >> 8) | y) & 0x030000FF
-    y = ((y >> 16) | y) & 0x000003FF
+def morton3d(x, y, z):
+    return split_by_3(x) | (split_by_3(y) << 1) | (split_by_3(z) << 2)
 
-    z = ((z >> 2) | z) & 0x030C30C3
-    z = ((z >> 4) | z) & 0x0300F00F
-    z = ((z >> 8) | z) & 0x030000FF
-    z = ((z >> 16) | z) & 0x000003FF
 
-    return x, y, z
+def inverse_morton3d(z):
+    z = int(z)
+    return compact_by_3(z), compact_by_3(z >> 1), compact_by_3(z >> 2)
 
 
-def max_level():
-    return 4 * 8 // 3
+def max_level(key_size=4):
+    return key_size * 8 // 3
 
 
 def min_level():
     return 0
 
 
-def clz(x):
-    return (bin(x)[2:].zfill(32)+'1').index('1')
-
-
 def compute_level(key):
-    return (max_level() * 3 - clz(key) + 1) // 3
+    # the level is marked by the highest set bit, 1 << 3 * level
+    return (int(key).bit_length() - 1) // 3
 
 
 def compute_key(x, y, z, l):
-    return morton3d(np.uint32(x), np.uint32(y), np.uint32(z)) \
-        | (np.uint32(1) << 3 * l)
+    return morton3d(x, y, z) | (1 << 3 * l)
 
 
 def compute_coord(key):
     l = compute_level(key)
-    x, y, z = inverse_morton3d(key & ~(np.uint32(1) << l * 3))
+    x, y, z = inverse_morton3d(int(key) & ~(1 << l * 3))
     return x, y, z, l
 
 
+OT_BINARY_MAGIC = b'OTB\n'
+OT_HEADER_FORMAT = '<4sIIIiIQ'
+
+
+def import_binary_ot(file_name):
+    with open(file_name, 'rb') as f:
+        data = f.read()
+    header_size = struct.calcsize(OT_HEADER_FORMAT)
+    _, _, key_size, value_size, max_lev, num_levels, num_elements = \
+        struct.unpack(OT_HEADER_FORMAT, data[:header_size])
+    keys_offset = header_size + num_levels * 16
+    values_offset = keys_offset + num_elements * key_size
+    if key_size not in (4, 8):
+        raise ValueError('%s: unsupported key size %d' % (file_name, key_size))
+    keys = np.frombuffer(data, dtype='<u%d' % key_size, count=num_elements,
+                         offset=keys_offset)
+    values = np.frombuffer(data, dtype='<u%d' % value_size,
+                           count=num_elements, offset=values_offset)
+    output_model = {}
+    for key, value in zip(keys, values):
+        output_model[str(int(key))] = str(value)
+    if num_elements > 0:
+        max_lev = max(max_lev, compute_level(keys[-1]))
+    return output_model, pow(2, max(max_lev, 0))
+
+
 def import_ot(file_name):
+    with open(file_name, 'rb') as f:
+        if f.read(4) == OT_BINARY_MAGIC:
+            return import_binary_ot(file_name)
     output_model = {}
     max_level = 0
     with open(file_name) as f:
@@ -79,7 +95,7 @@ def import_ot(file_name):
     parts = content[0].split(" ")
     for i in range(9, len(parts), 2):
         output_model[parts[i]] = parts[i+1]
-        lev = compute_level(np.uint32(parts[i]))
+        lev = compute_level(parts[i])
         if lev > max_level:
             max_level = lev
     return output_model, pow(2, max_level)
@@ -87,14 +103,13 @@ def import_ot(file_name):
 
 def octree_to_voxel_grid(ot, resolution):
     output = np.zeros((resolution, resolution, resolution))
-    max_level = np.uint32(math.log(resolution, 2))
+    max_level = int(round(math.log(resolution, 2)))
 
     for key in ot:
-        l = compute_level(np.uint32(key))
-        code = (np.uint32(key) & ~(np.uint32(1) << l * 3)) \
-            << (max_level - l) * 3
+        l = compute_level(key)
+        code = (int(key) & ~(1 << l * 3)) << (max_level - l) * 3
         x, y, z = inverse_morton3d(code)
-        cube_len = np.uint32(pow(2, max_level - l))
+        cube_len = pow(2, max_level - l)
         for i in range(0, cube_len):
             for j in range(0, cube_len):
                 for k in range(0, cube_len):
@@ -105,11 +120,10 @@ def octree_to_voxel_grid(ot, resolution):
 
 
 def get_cube_params(key, resolution):
-    l = compute_level(np.uint32(key))
-    max_level = np.uint32(math.log(resolution, 2))
+    l = compute_level(key)
+    max_level = int(round(math.log(resolution, 2)))
 
-    code = (np.uint32(key) & ~(np.uint32(1) << np.uint32(l * 3))) \
-        << np.uint32((max_level - l) * 3)
+    code = (int(key) & ~(1 << l * 3)) << (max_level - l) * 3
 
     x, y, z = inverse_morton3d(code)
     side_len = pow(2, max_level - l)
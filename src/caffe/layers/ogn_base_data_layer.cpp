@@ -0,0 +1,697 @@
+#include <boost/thread.hpp>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+
+#include "caffe/layers/ogn_base_data_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
+
+#include "image_tree_tools/octree_parallel.h"
+
+namespace caffe {
+
+using namespace std;
+
+/// Reads and encodes one chunk of models for the preload store. Each model
+/// has its own slot, so the result does not depend on the thread count.
+template <typename Dtype>
+struct OGNPreloadTask
+{
+    OGNPreloadTask(const OGNBasePrefetchingDataLayer<Dtype>& layer, int begin,
+                   vector<vector<unsigned char> >& records) :
+        layer(layer), begin(begin), records(records) {}
+
+    void operator()(int ind)
+    {
+        Octree tree;
+        layer.load_model(begin + ind, tree);
+        CompactOctreeStore<KeyType>::encode(tree, records[ind]);
+    }
+
+    const OGNBasePrefetchingDataLayer<Dtype>& layer;
+    const int begin;
+    vector<vector<unsigned char> >& records;
+};
+
+template <typename Dtype>
+struct OGNCellCountTask
+{
+    OGNCellCountTask(const OGNBasePrefetchingDataLayer<Dtype>& layer, vector<int>& cells) :
+        layer(layer), cells(cells) {}
+
+    void operator()(int ind) { cells[ind] = layer.model_num_cells(ind); }
+
+    const OGNBasePrefetchingDataLayer<Dtype>& layer;
+    vector<int>& cells;
+};
+
+static uint64_t fnv_hash(uint64_t tag, uint64_t value)
+{
+    return (tag ^ value) * 1099511628211ULL;
+}
+
+static uint64_t hash_file_stat(uint64_t tag, const string& fname)
+{
+    struct stat st;
+    if(stat(fname.c_str(), &st)) return fnv_hash(tag, ~0ULL);
+    tag = fnv_hash(tag, uint64_t(st.st_size));
+    return fnv_hash(tag, uint64_t(st.st_mtime));
+}
+
+/// Identifies a preloaded dataset in shared memory: the source and the size
+/// and modification time of every file the models are read from (the pack,
+/// or the list and each listed octree), the key width the records are
+/// encoded with, and the memory budget, which decides what is preloaded.
+static uint64_t dataset_tag(const string& source, const vector<string>& file_names, int preload_memory_mb)
+{
+    uint64_t tag = 14695981039346656037ULL;
+    for(size_t i=0; i<source.size(); i++) tag = fnv_hash(tag, (unsigned char)source[i]);
+    tag = hash_file_stat(tag, source);
+    for(size_t i=0; i<file_names.size(); i++) tag = hash_file_stat(tag, file_names[i]);
+    tag = fnv_hash(tag, sizeof(KeyType));
+    tag = fnv_hash(tag, uint64_t(preload_memory_mb));
+    return tag;
+}
+
+template <typename Dtype>
+OGNBasePrefetchingDataLayer<Dtype>::OGNBasePrefetchingDataLayer(
+    const LayerParameter& param, int prefetch)
+    : OGNLayer<Dtype>(param), _batch_size(0), _use_pack(false),
+      _num_samples(0), _shuffle(false), _shard_rank(0), _num_shards(1), _epoch(-1),
+      _snapshot_state(false), _max_batch_cells(0),
+      _max_level(-1), _augment_flip(false), _augment_permute_axes(false), _padding_sum(0),
+      _batch_size_sum(0), _num_batches(0),
+      _done_initial_reshape(false), _prefetching(false),
+      prefetch_(prefetch), prefetch_free_(), prefetch_full_(),
+      prefetch_current_() {
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i].reset(new OGNBatch<Dtype>());
+    prefetch_free_.push(prefetch_[i].get());
+  }
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::LayerSetUp(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  DataLayerSetUp();
+  CHECK_GT(_num_samples, 0) << "DataLayerSetUp has to call init_sampler";
+
+  // model indices given by a bottom blob are only known in Reshape
+  _prefetching = !prefetch_.empty() && bottom.empty();
+  if (!_prefetching) return;
+
+  DLOG(INFO) << "Initializing octree prefetch";
+  StartInternalThread();
+  DLOG(INFO) << "Octree prefetch initialized.";
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
+#ifndef CPU_ONLY
+  cudaStream_t stream;
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  }
+#endif
+
+  try {
+    vector<int> models;
+    while (!must_stop()) {
+      OGNBatch<Dtype>* batch = prefetch_free_.pop();
+      sample_batch(models);
+      load_batch(models, batch);
+      batch->state_ = _state;
+#ifndef CPU_ONLY
+      if (Caffe::mode() == Caffe::GPU) {
+        batch->values_.data().get()->async_gpu_push(stream);
+        batch->labels_.data().get()->async_gpu_push(stream);
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+      }
+#endif
+      prefetch_full_.push(batch);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+#ifndef CPU_ONLY
+  if (Caffe::mode() == Caffe::GPU) {
+    CUDA_CHECK(cudaStreamDestroy(stream));
+  }
+#endif
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::Reshape(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top)
+{
+    vector<int> values_shape;
+    vector<int> labels_shape;
+    labels_shape.push_back(_batch_size);
+
+    if(!_done_initial_reshape)
+    {
+        values_shape.push_back(_batch_size); values_shape.push_back(1);
+        top[0]->Reshape(values_shape);
+        top[1]->Reshape(labels_shape);
+        _done_initial_reshape = true;
+        return;
+    }
+
+    if(_snapshot_state && read_sampler_state() != _current_state) restore_sampler_state();
+
+    if(_prefetching)
+    {
+        if(prefetch_current_) prefetch_free_.push(prefetch_current_);
+        prefetch_current_ = prefetch_full_.pop("Waiting for octree batches");
+    }
+    else
+    {
+        vector<int> models;
+        if(bottom.size() == 0) sample_batch(models);
+        else
+        {
+            for(int bt=0; bt<_batch_size; bt++) models.push_back(bottom[0]->cpu_data()[bt]);
+        }
+        load_batch(models, &sync_batch_);
+        sync_batch_.state_ = _state;
+        prefetch_current_ = &sync_batch_;
+    }
+    if(_snapshot_state) write_sampler_state(prefetch_current_->state_);
+
+    // the batch's key octrees are rebuilt when it is loaded again, so they
+    // can be handed over without a copy
+    this->_octree_keys.swap(prefetch_current_->keys_);
+    top[0]->ReshapeLike(prefetch_current_->values_);
+    top[1]->ReshapeLike(prefetch_current_->labels_);
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::Forward_cpu(
+    const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  if (!prefetch_current_) {
+    // before the first batch, as the layer did without prefetching
+    caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+    caffe_set(top[1]->count(), Dtype(0), top[1]->mutable_cpu_data());
+    return;
+  }
+  top[0]->set_cpu_data(prefetch_current_->values_.mutable_cpu_data());
+  top[1]->set_cpu_data(prefetch_current_->labels_.mutable_cpu_data());
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::Backward_cpu(
+    const vector<Blob<Dtype>*>& top, const vector<bool>& propagate_down,
+    const vector<Blob<Dtype>*>& bottom) {
+  // nothing to propagate; the net only calls this because of the sampler
+  // state blob
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::load_batch(const vector<int>& models,
+    OGNBatch<Dtype>* batch)
+{
+    const int batch_size = models.size();
+    const int level = load_level(_state.batches++);
+
+    vector<Octree> trees(batch_size);
+    int num_elements = 0;
+    size_t num_cells = 0;
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        if(_store.contains(models[bt])) _store.decode(models[bt], trees[bt], level, CLASS_MIXED);
+        else load_model(models[bt], trees[bt], level);
+        if(_augment_rng) transform_octree(trees[bt], random_transform());
+        num_elements = std::max(num_elements, trees[bt].num_elements());
+        num_cells += trees[bt].num_elements();
+    }
+
+    // share of the batch that is padding, which every OGN layer downstream
+    // computes on as well
+    const double padding = num_elements ? 1.0 - double(num_cells) / (double(batch_size) * num_elements) : 0;
+    _padding_sum += padding;
+    _batch_size_sum += batch_size;
+    _num_batches++;
+    VLOG(1) << "OGN batch of " << batch_size << " models, " << num_cells << " cells, padding ratio " << padding;
+    if(_num_batches % 100 == 1)
+    {
+        LOG(INFO) << this->layer_param_.name() << ": batch of " << batch_size << " models, padding ratio "
+                  << padding << "; mean batch size " << double(_batch_size_sum) / _num_batches
+                  << ", mean padding ratio " << _padding_sum / _num_batches << " over " << _num_batches << " batches";
+    }
+
+    vector<int> values_shape;
+    values_shape.push_back(batch_size); values_shape.push_back(num_elements);
+    vector<int> labels_shape(1, batch_size);
+    batch->values_.Reshape(values_shape);
+    batch->labels_.Reshape(labels_shape);
+
+    Dtype* values = batch->values_.mutable_cpu_data();
+    Dtype* labels = batch->labels_.mutable_cpu_data();
+    caffe_set(batch->values_.count(), Dtype(0), values);
+
+    // the key octrees share the key arrays of the loaded models; only the
+    // column of every cell is new
+    batch->keys_.resize(batch_size);
+    for(int bt=0; bt<batch_size; bt++)
+    {
+        const std::vector<SignalType>& tree_values = trees[bt].values();
+        const int n = tree_values.size();
+        vector<int> columns(n);
+        for(int i=0; i<n; i++)
+        {
+            values[bt * num_elements + i] = (Dtype)(tree_values[i]);
+            columns[i] = i;
+        }
+        batch->keys_[bt].build_from_keys(trees[bt], columns);
+        labels[bt] = model_label(models[bt]);
+    }
+}
+
+template <typename Dtype>
+int OGNBasePrefetchingDataLayer<Dtype>::num_models() const
+{
+    return _use_pack ? _pack.size() : _file_names.size();
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::load_model(int ind, Octree& tree, int max_level) const
+{
+    if(_use_pack) CHECK(_pack.load(ind, tree, max_level, SignalType(CLASS_MIXED))) << "Cannot read model " << ind << " of the dataset pack";
+    else tree.from_file(_file_names[ind], max_level, CLASS_MIXED);
+}
+
+template <typename Dtype>
+int OGNBasePrefetchingDataLayer<Dtype>::model_num_cells(int ind) const
+{
+    if(_use_pack) return _pack.entry(ind).num_cells;
+    if(_store.contains(ind)) return _store.num_cells(ind);
+
+    OctreeFileHeader header;
+    if(read_octree_file_header(_file_names[ind], header)) return header.num_elements;
+    Octree tree;
+    load_model(ind, tree);
+    return tree.num_elements();
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::open_models(const string& source, bool preload_data,
+    int preload_threads, int preload_memory_mb, const string& shared_memory_name)
+{
+    cout << "Loading training data from disk..." << endl;
+    if(is_octree_pack(source))
+    {
+        CHECK(_pack.open(source)) << "Cannot open dataset pack " << source;
+        _use_pack = true;
+    }
+    else
+    {
+        ifstream infile(source.c_str());
+        string name;
+        while(infile >> name) _file_names.push_back(name);
+    }
+
+    const int count = num_models();
+    _store.resize(count);
+    if(!preload_data)
+    {
+        std::cout << "Done, " << count << " models in " << source << std::endl;
+        return;
+    }
+
+    // attach to the store of another process, or claim the segment and fill
+    // it below; the tag tells datasets apart
+    const uint64_t tag = dataset_tag(source, _file_names, preload_memory_mb);
+    bool shared = !shared_memory_name.empty();
+    while(shared)
+    {
+        SharedImage::Status status = _shared_image.attach(shared_memory_name);
+        if(status == SharedImage::ATTACHED)
+        {
+            CHECK(_store.attach_image(_shared_image.data(), _shared_image.size(), tag))
+                << "Shared memory segment " << shared_memory_name << " holds a different dataset than " << source;
+            cout << "Attached to " << _store.num_cells() << " preloaded cells (" << fixed << setprecision(1)
+                 << _store.bytes() / (1024.0 * 1024.0) << " MB) in shared memory segment " << shared_memory_name << endl;
+            std::cout << "Done, " << count << " models in " << source << std::endl;
+            return;
+        }
+        CHECK(status != SharedImage::STALE) << "Shared memory segment " << shared_memory_name
+            << " holds no image and its creator is gone, or it is not a dataset segment; remove it";
+        if(_shared_image.claim(shared_memory_name)) break;
+    }
+
+    // chunks are loaded in parallel and stored in order, so the models that
+    // fit into the budget are the same whatever the thread count
+    const size_t budget = size_t(preload_memory_mb) << 20;
+    const int chunk_size = 1000;
+    int num_preloaded = 0;
+    bool full = false;
+    CPUTimer timer;
+    timer.Start();
+    for(int begin=0; begin<count && !full; begin+=chunk_size)
+    {
+        const int chunk = std::min(chunk_size, count - begin);
+        vector<vector<unsigned char> > records(chunk);
+        OGNPreloadTask<Dtype> task(*this, begin, records);
+        parallel_for(chunk, task, preload_threads);
+
+        for(int i=0; i<chunk && !full; i++)
+        {
+            full = budget && _store.bytes() + records[i].size() > budget;
+            if(!full) _store.insert(begin + i, records[i]);
+            else num_preloaded = begin + i;
+        }
+        if(!full) num_preloaded = begin + chunk;
+
+        double seconds = std::max(double(timer.Seconds()), 1e-3);
+        cout << "Preloaded " << num_preloaded << " / " << count << " models, " << fixed << setprecision(1)
+             << num_preloaded / seconds << " models/s, " << _store.bytes() / (1024.0 * 1024.0) << " MB" << endl;
+    }
+
+    const double mb = 1024.0 * 1024.0;
+    const size_t octree_bytes = _store.num_cells() * (sizeof(KeyType) + sizeof(SignalType));
+    cout << "Preload store: " << _store.num_cells() << " cells in " << _store.bytes() / mb << " MB ("
+         << setprecision(2) << double(_store.bytes()) / std::max(_store.num_cells(), size_t(1)) << " bytes/cell, "
+         << setprecision(1) << _store.allocated_bytes() / mb << " MB allocated), "
+         << octree_bytes / mb << " MB as octrees" << endl;
+    if(full)
+    {
+        cout << "Preload memory limit of " << preload_memory_mb << " MB reached, "
+             << count - num_preloaded << " models are read on demand" << endl;
+    }
+    if(shared)
+    {
+        // the private copy is released once the store uses the segment
+        char* image = _shared_image.allocate(_store.image_bytes());
+        if(!image) _shared_image.abandon();
+        CHECK(image) << "Cannot allocate shared memory segment " << shared_memory_name;
+        _store.write_image(image, tag);
+        _shared_image.publish();
+        CHECK(_store.attach_image(_shared_image.data(), _shared_image.size(), tag));
+        cout << "Published the preload store in shared memory segment " << shared_memory_name << endl;
+    }
+    std::cout << "Done, " << count << " models in " << source << std::endl;
+}
+
+/// Seed of the model order of one epoch, so that any epoch can be rebuilt
+/// from the sampler state alone (splitmix64 of seed and epoch).
+static uint32_t epoch_seed(uint32_t seed, uint32_t epoch)
+{
+    uint64_t z = (uint64_t(seed) << 32 | epoch) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return uint32_t(z ^ (z >> 31));
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_sampler(int num_models, bool shuffle, int64_t seed,
+    int shard_rank, int num_shards)
+{
+    CHECK_GT(num_models, 0) << "No models to sample from";
+    CHECK_GT(_batch_size, 0) << "batch_size must be set";
+    // only training nets are replicated per solver, the test nets live on
+    // the root solver and have to see the whole test set
+    if(!num_shards)
+    {
+        const bool train = this->phase_ == TRAIN;
+        shard_rank = train ? Caffe::solver_rank() : 0;
+        num_shards = train ? Caffe::solver_count() : 1;
+    }
+    CHECK_GE(shard_rank, 0);
+    CHECK_LT(shard_rank, num_shards) << "shard_rank has to be below num_shards";
+    LOG_IF(WARNING, num_shards > 1 && seed < 0) << "Every shard draws its own seed, so shuffled epochs are not "
+        << "split into disjoint shards; set sampler_seed, or snapshot_sampler to broadcast the root solver's state";
+
+    _num_samples = num_models;
+    _shuffle = shuffle;
+    _shard_rank = shard_rank;
+    _num_shards = num_shards;
+    _state = OGNSamplerState();
+    _state.seed = seed < 0 ? caffe_rng_rand() : uint32_t(seed);
+    _current_state = _state;
+    _epoch = -1;
+    LOG(INFO) << this->layer_param_.name() << ": shard " << shard_rank << " of " << num_shards << ", "
+              << (num_models + num_shards - 1) / num_shards << " of " << num_models << " models per epoch"
+              << (shuffle ? ", shuffled" : "");
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_sampler_snapshot()
+{
+    // the blob exists in every phase, so that nets with a TEST copy of the
+    // layer can share the trained blobs
+    if(this->blobs_.empty())
+    {
+        this->blobs_.resize(1);
+        this->blobs_[0].reset(new Blob<Dtype>(vector<int>(1, 8)));
+    }
+    CHECK_EQ(this->blobs_[0]->count(), 8) << "Unexpected sampler state blob";
+
+    // like the statistics of BatchNorm, the state is not learned
+    if(this->layer_param_.param_size() == 0)
+    {
+        ParamSpec* spec = this->layer_param_.add_param();
+        spec->set_lr_mult(0);
+        spec->set_decay_mult(0);
+    }
+    else CHECK_EQ(this->layer_param_.param(0).lr_mult(), 0) << "The sampler state cannot be learned";
+
+    _snapshot_state = this->phase_ == TRAIN;
+    if(_snapshot_state) write_sampler_state(_state);
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::write_sampler_state(const OGNSamplerState& state)
+{
+    // 16 bit halves, which any Dtype holds exactly
+    const uint32_t values[4] = { state.seed, state.epoch, state.pos, state.batches };
+    Dtype* data = this->blobs_[0]->mutable_cpu_data();
+    for(int i=0; i<4; i++)
+    {
+        data[2 * i] = values[i] & 0xffff;
+        data[2 * i + 1] = values[i] >> 16;
+    }
+    _current_state = state;
+}
+
+template <typename Dtype>
+OGNSamplerState OGNBasePrefetchingDataLayer<Dtype>::read_sampler_state() const
+{
+    const Dtype* data = this->blobs_[0]->cpu_data();
+    uint32_t values[4];
+    for(int i=0; i<4; i++) values[i] = uint32_t(data[2 * i]) | uint32_t(data[2 * i + 1]) << 16;
+
+    OGNSamplerState state;
+    state.seed = values[0];
+    state.epoch = values[1];
+    state.pos = values[2];
+    state.batches = values[3];
+    return state;
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::restore_sampler_state()
+{
+    const OGNSamplerState state = read_sampler_state();
+    LOG(INFO) << this->layer_param_.name() << ": resuming sampling in epoch " << state.epoch << " at model "
+              << state.pos << " of the shard, after " << state.batches << " batches";
+
+    // batches drawn from the previous state are dropped
+    if(_prefetching) StopInternalThread();
+    OGNBatch<Dtype>* batch;
+    while(prefetch_full_.try_pop(&batch)) prefetch_free_.push(batch);
+    if(prefetch_current_ && prefetch_current_ != &sync_batch_) prefetch_free_.push(prefetch_current_);
+    prefetch_current_ = NULL;
+
+    _state = state;
+    _current_state = state;
+    if(_prefetching) StartInternalThread();
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::make_epoch()
+{
+    caffe::rng_t rng(epoch_seed(_state.seed, _state.epoch));
+
+    // the epoch is sharded in units of one model, or of one batch with size
+    // buckets
+    vector<int> order;
+    int unit = 1;
+    if(_buckets.empty())
+    {
+        order.resize(_num_samples);
+        for(int m=0; m<_num_samples; m++) order[m] = m;
+        if(_shuffle) shuffle(order.begin(), order.end(), &rng);
+    }
+    else if(!_shuffle)
+    {
+        // in size order, which keeps neighbouring models in one batch
+        for(int b=0; b<_buckets.size(); b++) order.insert(order.end(), _buckets[b].begin(), _buckets[b].end());
+    }
+    else
+    {
+        // batches only straddle neighbouring buckets; the last one is filled
+        // up with models of the largest bucket
+        vector<int> models;
+        for(int b=0; b<_buckets.size(); b++)
+        {
+            const size_t begin = models.size();
+            models.insert(models.end(), _buckets[b].begin(), _buckets[b].end());
+            shuffle(models.begin() + begin, models.end(), &rng);
+        }
+        const int last_size = _buckets.back().size();
+        const size_t last_begin = models.size() - last_size;
+        for(int i=0; models.size() % _batch_size; i++) models.push_back(models[last_begin + i % last_size]);
+
+        vector<int> batches(models.size() / _batch_size);
+        for(int i=0; i<batches.size(); i++) batches[i] = i;
+        shuffle(batches.begin(), batches.end(), &rng);
+        for(int i=0; i<batches.size(); i++)
+        {
+            order.insert(order.end(), models.begin() + batches[i] * _batch_size,
+                         models.begin() + (batches[i] + 1) * _batch_size);
+        }
+        unit = _batch_size;
+    }
+
+    // every shard takes every _num_shards-th unit; the units are wrapped
+    // around until all shards have the same number
+    const int num_units = order.size() / unit;
+    const int shard_units = (num_units + _num_shards - 1) / _num_shards;
+    _epoch_models.clear();
+    for(int u=_shard_rank; u<shard_units * _num_shards; u+=_num_shards)
+    {
+        const int begin = (u % num_units) * unit;
+        _epoch_models.insert(_epoch_models.end(), order.begin() + begin, order.begin() + begin + unit);
+    }
+    _epoch = _state.epoch;
+}
+
+template <typename Dtype>
+int OGNBasePrefetchingDataLayer<Dtype>::peek_model()
+{
+    for(;;)
+    {
+        if(_epoch != int(_state.epoch)) make_epoch();
+        if(_state.pos < _epoch_models.size()) return _epoch_models[_state.pos];
+        _state.epoch++;
+        _state.pos = 0;
+    }
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::sample_batch(vector<int>& models)
+{
+    // with a cell budget, the padded cost of the batch with one more model;
+    // the model that does not fit starts the next batch
+    models.clear();
+    int max_cells = 0;
+    while(int(models.size()) < _batch_size)
+    {
+        // unshuffled size buckets end the last batch of an epoch short
+        if(!models.empty() && !_buckets.empty() && !_shuffle && _state.pos >= _epoch_models.size()) break;
+        const int model = peek_model();
+        if(_max_batch_cells)
+        {
+            const int cells = std::max(max_cells, _model_cells[model]);
+            if(!models.empty() && size_t(cells) * (models.size() + 1) > _max_batch_cells) break;
+            max_cells = cells;
+        }
+        models.push_back(model);
+        _state.pos++;
+    }
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_size_buckets(int num_buckets)
+{
+    const int num_models = _num_samples;
+    CHECK_GT(num_models, 0) << "init_sampler has to be called first";
+    num_buckets = std::min(num_buckets, num_models);
+    count_model_cells();
+
+    vector<pair<int, int> > order(num_models);
+    for(int m=0; m<num_models; m++) order[m] = make_pair(_model_cells[m], m);
+    std::sort(order.begin(), order.end());
+
+    _buckets.assign(num_buckets, vector<int>());
+    for(int b=0; b<num_buckets; b++)
+    {
+        const int begin = long(num_models) * b / num_buckets;
+        const int end = long(num_models) * (b + 1) / num_buckets;
+        for(int i=begin; i<end; i++) _buckets[b].push_back(order[i].second);
+        LOG(INFO) << "Size bucket " << b << ": " << end - begin << " models, "
+                  << order[begin].first << " - " << order[end - 1].first << " cells";
+    }
+    _epoch = -1;
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::count_model_cells()
+{
+    if(int(_model_cells.size()) == _num_samples) return;
+    _model_cells.resize(_num_samples);
+    OGNCellCountTask<Dtype> task(*this, _model_cells);
+    parallel_for(_num_samples, task);
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_cell_budget(int max_batch_cells)
+{
+    CHECK_GT(_num_samples, 0) << "init_sampler has to be called first";
+    count_model_cells();
+    _max_batch_cells = max_batch_cells;
+
+    const int max_cells = *std::max_element(_model_cells.begin(), _model_cells.end());
+    LOG_IF(WARNING, size_t(max_cells) > _max_batch_cells) << "The largest model has " << max_cells
+        << " cells, more than max_batch_cells " << _max_batch_cells << "; it is loaded as a batch of its own";
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_augmentation(bool flip, bool permute_axes)
+{
+    _augment_flip = flip;
+    _augment_permute_axes = permute_axes;
+    if(flip || permute_axes) _augment_rng.reset(new Caffe::RNG(caffe_rng_rand()));
+}
+
+template <typename Dtype>
+OctreeTransform OGNBasePrefetchingDataLayer<Dtype>::random_transform()
+{
+    caffe::rng_t* rng = static_cast<caffe::rng_t*>(_augment_rng->generator());
+    OctreeTransform t;
+    if(_augment_permute_axes) shuffle(t.perm, t.perm + 3, rng);
+    if(_augment_flip)
+    {
+        for(int a=0; a<3; a++) t.flip[a] = (*rng)() & 1;
+    }
+    return t;
+}
+
+template <typename Dtype>
+void OGNBasePrefetchingDataLayer<Dtype>::init_level_schedule(int max_level, const vector<int>& steps)
+{
+    _max_level = max_level;
+    _level_steps = steps;
+    std::sort(_level_steps.begin(), _level_steps.end());
+    if(max_level >= 0) LOG(INFO) << "Loading octree levels up to " << load_level(_state.batches);
+}
+
+template <typename Dtype>
+int OGNBasePrefetchingDataLayer<Dtype>::load_level(int batch) const
+{
+    if(_max_level < 0) return -1;
+    const int steps = std::upper_bound(_level_steps.begin(), _level_steps.end(), batch) - _level_steps.begin();
+    if(steps && batch == _level_steps[steps - 1])
+    {
+        LOG(INFO) << this->layer_param_.name() << ": loading octree levels up to " << _max_level + steps;
+    }
+    return _max_level + steps;
+}
+
+INSTANTIATE_CLASS(OGNBasePrefetchingDataLayer);
+
+}  // namespace caffe
@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+
 #include "caffe/layers/ogn_concat_layer.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
@@ -53,8 +55,6 @@ template <typename Dtype>
 void OGNConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
-	string prefix = "\t\tOGNConcatLayer:: Forward_cpu: \t";
-
 	this->_octree_keys.clear();
 	this->_octree_prop.clear();
 
@@ -69,61 +69,75 @@ void OGNConcatLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 	Dtype* output_arr = top[0]->mutable_cpu_data();
 	memset(output_arr, 0, sizeof(Dtype) * _batch_size * _num_channels * _num_pixels);
 
-	for (int n = 0; n < _batch_size; ++n) {
-		int counter = 0;
-
-		GeneralOctree<int> octree_keys;
-		GeneralOctree<int> octree_prop;
-
-		set<KeyType> l1_keys;
-		GeneralOctree<int>* l1_tree = &(l1_ptr->get_keys_octree(n));
-		for (GeneralOctree<int>::iterator it=l1_tree->begin(); it!=l1_tree->end(); ++it) {
-			KeyType key = it->first;
-			if (key != GeneralOctree<int>::INVALID_KEY()) {
-				l1_keys.insert(key);
-				octree_keys.add_element(key, counter);
-				octree_prop.add_element(key, PROP_TRUE);
-				int value_ind = l1_tree->get_value(key);
+	// the samples are independent
+	this->_octree_keys.resize(_batch_size);
+	this->_octree_prop.resize(_batch_size);
+	ogn_parallel_for(_batch_size, _batch_size * _num_pixels,
+		boost::bind(&OGNConcatLayer<Dtype>::forward_sample_cpu, this, _1,
+			input_arr1, input_arr2, output_arr, l1_ptr.get(), l2_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNConcatLayer<Dtype>::forward_sample_cpu(int n, const Dtype* input_arr1, const Dtype* input_arr2,
+      Dtype* output_arr, OGNLayer<Dtype>* l1_ptr, OGNLayer<Dtype>* l2_ptr) {
+	string prefix = "\t\tOGNConcatLayer:: Forward_cpu: \t";
+
+	int counter = 0;
+
+	GeneralOctree<int>& octree_keys = this->_octree_keys[n];
+	GeneralOctree<int>& octree_prop = this->_octree_prop[n];
+
+	// keys of the two inputs interleave in Morton order, so collect them
+	// and build the sorted octrees in one pass
+	vector<pair<KeyType, int> > key_elements;
+	vector<pair<KeyType, int> > prop_elements;
+
+	set<KeyType> l1_keys;
+	GeneralOctree<int>* l1_tree = &(l1_ptr->get_keys_octree(n));
+	for (GeneralOctree<int>::iterator it=l1_tree->begin(); it!=l1_tree->end(); ++it) {
+		KeyType key = it->first;
+		if (key != GeneralOctree<int>::INVALID_KEY()) {
+			l1_keys.insert(key);
+			key_elements.push_back(make_pair(key, counter));
+			prop_elements.push_back(make_pair(key, PROP_TRUE));
+			int value_ind = l1_tree->get_value(key);
+			for (int ch = 0; ch < _num_channels; ++ch) {
+				int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + counter;
+				int right_ind = n*_num_channels*_l1_num_pixels + ch*_l1_num_pixels + value_ind;
+				output_arr[left_ind] = input_arr1[right_ind];
+			}
+			++ counter;
+		}
+	}
+	
+	GeneralOctree<int>* l2_tree = &(l2_ptr->get_keys_octree(n));
+	for (GeneralOctree<int>::iterator it=l2_tree->begin(); it!=l2_tree->end(); ++it) {
+		KeyType key = it->first;
+		if (key != GeneralOctree<int>::INVALID_KEY()) {
+			if (l1_keys.find(key) == l1_keys.end()) {
+				key_elements.push_back(make_pair(key, counter));
+				prop_elements.push_back(make_pair(key, PROP_TRUE));
+				int value_ind = l2_tree->get_value(key);
 				for (int ch = 0; ch < _num_channels; ++ch) {
 					int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + counter;
-					int right_ind = n*_num_channels*_l1_num_pixels + ch*_l1_num_pixels + value_ind;
-					output_arr[left_ind] = input_arr1[right_ind];
+					int right_ind = n*_num_channels*_l2_num_pixels + ch*_l2_num_pixels + value_ind;
+					output_arr[left_ind] = input_arr2[right_ind];
 				}
 				++ counter;
+			} else {
+				CHECK(false) << prefix << "key " << key << " occurs in both two bottom inputs! Should be impossible!" << std::endl;
 			}
 		}
-		
-		GeneralOctree<int>* l2_tree = &(l2_ptr->get_keys_octree(n));
-		for (GeneralOctree<int>::iterator it=l2_tree->begin(); it!=l2_tree->end(); ++it) {
-			KeyType key = it->first;
-			if (key != GeneralOctree<int>::INVALID_KEY()) {
-				if (l1_keys.find(key) == l1_keys.end()) {
-					octree_keys.add_element(key, counter);
-					octree_prop.add_element(key, PROP_TRUE);
-					int value_ind = l2_tree->get_value(key);
-					for (int ch = 0; ch < _num_channels; ++ch) {
-						int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + counter;
-						int right_ind = n*_num_channels*_l2_num_pixels + ch*_l2_num_pixels + value_ind;
-						output_arr[left_ind] = input_arr2[right_ind];
-					}
-					++ counter;
-				} else {
-					CHECK(false) << prefix << "key " << key << " occurs in both two bottom inputs! Should be impossible!" << std::endl;
-				}
-			}
-		}
-
-		this->_octree_keys.push_back(octree_keys);
-		this->_octree_prop.push_back(octree_prop);
 	}
+
+	octree_keys.build_from_unsorted(key_elements);
+	octree_prop.build_from_unsorted(prop_elements);
 }
 
 template <typename Dtype>
 void OGNConcatLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
-	string prefix = "\t\tOGNConcatLayer:: Backward_cpu: \t";
-
 	const Dtype* input_arr = top[0]->cpu_diff();
 	
 	Dtype* output_arr1 = bottom[0]->mutable_cpu_diff();
@@ -136,28 +150,36 @@ void OGNConcatLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
 	boost::shared_ptr<Layer<Dtype> > base2_ptr = this->parent_net()->layer_by_name(_key2_layer_name);
 	boost::shared_ptr<OGNLayer<Dtype> > l2_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base2_ptr);
 
-	for (int n = 0; n < _batch_size; ++n) {
-		for (GeneralOctree<int>::iterator it=this->_octree_keys[n].begin(); it!=this->_octree_keys[n].end(); ++it) {
-			KeyType key = it->first;
-			int cur_value_ind = this->_octree_keys[n].get_value(key);
-			if(key != GeneralOctree<int>::INVALID_KEY()) {
-				if (l1_ptr->get_keys_octree(n).get_value(key) >= 0) {
-					int value_ind = l1_ptr->get_keys_octree(n).get_value(key);
-					for (int ch = 0; ch < _num_channels; ++ch) {
-						int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + cur_value_ind;
-						int right_ind = n*_num_channels*_l1_num_pixels + ch*_l1_num_pixels + value_ind;
-						output_arr1[right_ind] += input_arr[left_ind];
-					}
-				} else if (l2_ptr->get_keys_octree(n).get_value(key) >= 0) {
-					int value_ind = l2_ptr->get_keys_octree(n).get_value(key);
-					for (int ch = 0; ch < _num_channels; ++ch) {
-						int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + cur_value_ind;
-						int right_ind = n*_num_channels*_l2_num_pixels + ch*_l2_num_pixels + value_ind;
-						output_arr2[right_ind] += input_arr[left_ind];
-					}
-				} else {
-					CHECK(false) << prefix << "key " << key <<" is not found in either of the two input blobs." << std::endl;
+	ogn_parallel_for(_batch_size, _batch_size * _num_pixels,
+		boost::bind(&OGNConcatLayer<Dtype>::backward_sample_cpu, this, _1,
+			input_arr, output_arr1, output_arr2, l1_ptr.get(), l2_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNConcatLayer<Dtype>::backward_sample_cpu(int n, const Dtype* input_arr, Dtype* output_arr1,
+      Dtype* output_arr2, OGNLayer<Dtype>* l1_ptr, OGNLayer<Dtype>* l2_ptr) {
+	string prefix = "\t\tOGNConcatLayer:: Backward_cpu: \t";
+
+	for (GeneralOctree<int>::iterator it=this->_octree_keys[n].begin(); it!=this->_octree_keys[n].end(); ++it) {
+		KeyType key = it->first;
+		int cur_value_ind = this->_octree_keys[n].get_value(key);
+		if(key != GeneralOctree<int>::INVALID_KEY()) {
+			if (l1_ptr->get_keys_octree(n).get_value(key) >= 0) {
+				int value_ind = l1_ptr->get_keys_octree(n).get_value(key);
+				for (int ch = 0; ch < _num_channels; ++ch) {
+					int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + cur_value_ind;
+					int right_ind = n*_num_channels*_l1_num_pixels + ch*_l1_num_pixels + value_ind;
+					output_arr1[right_ind] += input_arr[left_ind];
+				}
+			} else if (l2_ptr->get_keys_octree(n).get_value(key) >= 0) {
+				int value_ind = l2_ptr->get_keys_octree(n).get_value(key);
+				for (int ch = 0; ch < _num_channels; ++ch) {
+					int left_ind = n*_num_channels*_num_pixels + ch*_num_pixels + cur_value_ind;
+					int right_ind = n*_num_channels*_l2_num_pixels + ch*_l2_num_pixels + value_ind;
+					output_arr2[right_ind] += input_arr[left_ind];
 				}
+			} else {
+				CHECK(false) << prefix << "key " << key <<" is not found in either of the two input blobs." << std::endl;
 			}
 		}
 	}
@@ -1,3 +1,7 @@
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
 #include "caffe/layers/ogn_conv_layer.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
@@ -6,6 +10,165 @@
 
 namespace caffe {
 
+/// Copies the rules of one filter offset of a run of samples from their
+/// channels x pixels features into the side by side columns of a
+/// [channels x num_rules] matrix. Each channel is a task.
+template <typename Dtype>
+struct OGNGatherRulesTask
+{
+    OGNGatherRulesTask(int pixels, int num_rules, Dtype* gathered) :
+        pixels(pixels), num_rules(num_rules), gathered(gathered) {}
+
+    void add_sample(const Dtype* sample_features, const int* sample_cols, int sample_rules)
+    {
+        features.push_back(sample_features);
+        cols.push_back(sample_cols);
+        counts.push_back(sample_rules);
+    }
+
+    void operator()(int ch)
+    {
+        Dtype* gathered_row = gathered + ch * num_rules;
+        for(size_t s=0; s<features.size(); s++)
+        {
+            const Dtype* row = features[s] + ch * pixels;
+            for(int r=0; r<counts[s]; r++) gathered_row[r] = row[cols[s][r]];
+            gathered_row += counts[s];
+        }
+    }
+
+    const int pixels;
+    const int num_rules;
+    Dtype* gathered;
+    vector<const Dtype*> features;
+    vector<const int*> cols;
+    vector<int> counts;
+};
+
+/// The reverse of OGNGatherRulesTask, adding the columns to the features.
+/// An offset reads a cell at most once, so no cell is added to twice.
+template <typename Dtype>
+struct OGNScatterRulesTask
+{
+    OGNScatterRulesTask(int pixels, int num_rules, const Dtype* gathered) :
+        pixels(pixels), num_rules(num_rules), gathered(gathered) {}
+
+    void add_sample(Dtype* sample_features, const int* sample_cols, int sample_rules)
+    {
+        features.push_back(sample_features);
+        cols.push_back(sample_cols);
+        counts.push_back(sample_rules);
+    }
+
+    void operator()(int ch)
+    {
+        const Dtype* gathered_row = gathered + ch * num_rules;
+        for(size_t s=0; s<features.size(); s++)
+        {
+            Dtype* row = features[s] + ch * pixels;
+            for(int r=0; r<counts[s]; r++) row[cols[s][r]] += gathered_row[r];
+            gathered_row += counts[s];
+        }
+    }
+
+    const int pixels;
+    const int num_rules;
+    const Dtype* gathered;
+    vector<Dtype*> features;
+    vector<const int*> cols;
+    vector<int> counts;
+};
+
+/// Copies the [C_out * 8 x parents] columns of a 2^3 deconvolution to the
+/// children of the parents, adding the bias. Row ch * 8 + el of the columns
+/// is the filter offset el of channel ch. Each channel is a task.
+template <typename Dtype>
+struct OGNWriteChildrenTask
+{
+    OGNWriteChildrenTask(const int* child_offsets, const vector<int>& column_offsets, const Dtype* col_buff,
+                         int channels, int pixels, const Dtype* bias, Dtype* children) :
+        child_offsets(child_offsets), column_offsets(column_offsets), col_buff(col_buff),
+        channels(channels), pixels(pixels), bias(bias), children(children) {}
+
+    // parent j of the sample is column parent_cols[j], its children are
+    // the cells 8 * j .. 8 * j + 7
+    void add_sample(const int* sample_parent_cols, int sample_parents)
+    {
+        parent_cols.push_back(sample_parent_cols);
+        num_parents.push_back(sample_parents);
+    }
+
+    void operator()(int ch)
+    {
+        const int num_columns = column_offsets.back();
+        for(size_t n=0; n<parent_cols.size(); n++)
+        {
+            Dtype* row = children + (n * channels + ch) * pixels;
+            for(int c=0; c<8; c++)
+            {
+                const Dtype* col_row = col_buff + (ch * 8 + child_offsets[c]) * num_columns + column_offsets[n];
+                for(int j=0; j<num_parents[n]; j++) row[8 * j + c] = col_row[parent_cols[n][j]] + bias[ch];
+            }
+            std::fill(row + 8 * num_parents[n], row + pixels, Dtype(0));
+        }
+    }
+
+    const int* child_offsets;
+    const vector<int>& column_offsets;
+    const Dtype* col_buff;
+    const int channels;
+    const int pixels;
+    const Dtype* bias;
+    Dtype* children;
+    vector<const int*> parent_cols;
+    vector<int> num_parents;
+};
+
+/// The reverse of OGNWriteChildrenTask: copies the children diff to the
+/// columns and adds it to the bias diff, if given.
+template <typename Dtype>
+struct OGNReadChildrenTask
+{
+    OGNReadChildrenTask(const int* child_offsets, const vector<int>& column_offsets, const Dtype* children,
+                        int channels, int pixels, Dtype* col_buff, Dtype* bias_diff) :
+        child_offsets(child_offsets), column_offsets(column_offsets), children(children),
+        channels(channels), pixels(pixels), col_buff(col_buff), bias_diff(bias_diff) {}
+
+    void add_sample(const int* sample_parent_cols, int sample_parents)
+    {
+        parent_cols.push_back(sample_parent_cols);
+        num_parents.push_back(sample_parents);
+    }
+
+    void operator()(int ch)
+    {
+        const int num_columns = column_offsets.back();
+        for(size_t n=0; n<parent_cols.size(); n++)
+        {
+            const Dtype* row = children + (n * channels + ch) * pixels;
+            for(int c=0; c<8; c++)
+            {
+                Dtype* col_row = col_buff + (ch * 8 + child_offsets[c]) * num_columns + column_offsets[n];
+                for(int j=0; j<num_parents[n]; j++) col_row[parent_cols[n][j]] = row[8 * j + c];
+            }
+            if(!bias_diff) continue;
+            Dtype sum = 0;
+            for(int q=0; q<8 * num_parents[n]; q++) sum += row[q];
+            bias_diff[ch] += sum;
+        }
+    }
+
+    const int* child_offsets;
+    const vector<int>& column_offsets;
+    const Dtype* children;
+    const int channels;
+    const int pixels;
+    Dtype* col_buff;
+    Dtype* bias_diff;
+    vector<const int*> parent_cols;
+    vector<int> num_parents;
+};
+
 template <typename Dtype>
 void OGNConvLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -46,6 +209,24 @@ void OGNConvLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     shared_ptr<Filler<Dtype> > bias_filler(GetFiller<Dtype>(
         this->layer_param_.ogn_conv_param().bias_filler()));
     bias_filler->Fill(this->blobs_[1].get());
+
+    _gather_engine = this->layer_param_.ogn_conv_param().engine() == OGNConvParameter_Engine_GATHER_SCATTER;
+    if(_gather_engine)
+    {
+        vector<int> offset_weights_shape;
+        offset_weights_shape.push_back(filter_size * filter_size * filter_size);
+        offset_weights_shape.push_back(_num_output_channels);
+        offset_weights_shape.push_back(_num_input_channels);
+        _offset_weights.Reshape(offset_weights_shape);
+        _offset_weight_diff.Reshape(offset_weights_shape);
+    }
+    _fuse_batch = this->layer_param_.ogn_conv_param().fuse_batch();
+
+    _children_path = is_deconv && filter_size == 2 && !_gather_engine;
+    // the offsets 0..1 of the first child of the root are the root's children
+    KeyType children[8];
+    GeneralOctree<int>::neighbor_candidates<2>(GeneralOctree<int>::child_key(1, 0), children);
+    for(int el=0; el<8; el++) _child_offsets[children[el] & 7] = el;
 }
 
 template <typename Dtype>
@@ -71,7 +252,17 @@ void OGNConvLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     if(is_deconv) _col_buffer_shape.push_back(_num_input_pixels);
     else _col_buffer_shape.push_back(_num_output_pixels);
 
-    _col_buffer.Reshape(_col_buffer_shape);
+    if(_gather_engine)
+    {
+        // one offset gathers at most a row of either side per column
+        vector<int> gather_shape;
+        gather_shape.push_back(std::max(_num_input_channels, _num_output_channels));
+        gather_shape.push_back(_col_buffer_shape[1]);
+        _gather_buffer.Reshape(gather_shape);
+        _product_buffer.Reshape(gather_shape);
+    }
+    // a fused col buffer is shaped in forward, once the cells are known
+    else if(!_fuse_batch) _col_buffer.Reshape(_col_buffer_shape);
 }
 
 template <typename Dtype>
@@ -86,34 +277,51 @@ void OGNConvLayer<Dtype>::propagate_keys_cpu()
     boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
     boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
 
-    for (int n = 0; n < _batch_size; ++n)
+    if(!is_deconv)
     {
-        GeneralOctree<int> octree_keys;
-        GeneralOctree<int> octree_prop;
-
-        if(is_deconv)
-        {
-            int output_counter = 0;
-            for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(n).begin(); it!=l_ptr->get_keys_octree(n).end(); it++)
-            {
-                KeyType key = it->first;
-                for(int i=0; i<8; i++)
-                {
-                    unsigned int new_key = (key << 3) | i;
-                    octree_keys.add_element(new_key, output_counter);
-                    octree_prop.add_element(new_key, l_ptr->get_prop_octree(n).get_value(key));
-                    output_counter++;
-                }
-            }
-            this->_octree_keys.push_back(octree_keys);
-            this->_octree_prop.push_back(octree_prop);
-        }
-        else
+        for (int n = 0; n < _batch_size; ++n)
         {
             this->_octree_keys.push_back(l_ptr->get_keys_octree(n));
             this->_octree_prop.push_back(l_ptr->get_prop_octree(n));
         }
+        return;
     }
+
+    this->_octree_keys.resize(_batch_size);
+    this->_octree_prop.resize(_batch_size);
+    int num_cells = 0;
+    for (int n = 0; n < _batch_size; ++n) num_cells += 8 * l_ptr->get_keys_octree(n).num_elements();
+    ogn_parallel_for(_batch_size, num_cells,
+        boost::bind(&OGNConvLayer<Dtype>::propagate_sample_keys_cpu, this, _1, l_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::propagate_sample_keys_cpu(int batch_ind, OGNLayer<Dtype>* key_layer)
+{
+    const GeneralOctree<int>& parents = key_layer->get_keys_octree(batch_ind);
+    const GeneralOctree<int>& parent_prop = key_layer->get_prop_octree(batch_ind);
+    const vector<KeyType>& parent_keys = parents.keys();
+    // the prop octree of a key layer has the same cells, except for layers
+    // without one, where every lookup fails
+    const bool same_cells = parent_prop.keys() == parent_keys;
+
+    // the children of parents in Morton order are in Morton order
+    const int num_parents = parent_keys.size();
+    vector<KeyType> keys(8 * num_parents);
+    vector<int> values(8 * num_parents);
+    vector<int> prop(8 * num_parents);
+    for(int j=0; j<num_parents; j++)
+    {
+        const int parent_prop_value = same_cells ? parent_prop.values()[j] : parent_prop.get_value(parent_keys[j]);
+        for(int i=0; i<8; i++)
+        {
+            keys[8 * j + i] = GeneralOctree<int>::child_key(parent_keys[j], i);
+            values[8 * j + i] = 8 * j + i;
+            prop[8 * j + i] = parent_prop_value;
+        }
+    }
+    this->_octree_prop[batch_ind].build_from_sorted(keys, prop);
+    this->_octree_keys[batch_ind].take_sorted(keys, values);
 }
 
 template <typename Dtype>
@@ -121,6 +329,29 @@ void OGNConvLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
 	propagate_keys_cpu();
+	if(_children_path)
+	{
+		forward_children_cpu(bottom, top);
+		return;
+	}
+	prepare_rulebooks_cpu();
+
+	if(_gather_engine)
+	{
+		offset_weights_cpu();
+		if(_fuse_batch)
+		{
+			fuse_columns_cpu();
+			forward_gather_cpu(0, _batch_size, bottom, top);
+		}
+		else for (int n=0; n<_batch_size; n++) forward_gather_cpu(n, n + 1, bottom, top);
+		return;
+	}
+	if(_fuse_batch)
+	{
+		forward_fused_cpu(bottom, top);
+		return;
+	}
 
 	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
 	for (int n=0; n<_batch_size; n++)
@@ -151,6 +382,32 @@ template <typename Dtype>
 void OGNConvLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
+	if(_children_path)
+	{
+		backward_children_cpu(top, propagate_down, bottom);
+		return;
+	}
+	prepare_rulebooks_cpu();
+
+	if(_gather_engine)
+	{
+		offset_weights_cpu();
+		caffe_set(_offset_weight_diff.count(), Dtype(0), _offset_weight_diff.mutable_cpu_data());
+		if(_fuse_batch)
+		{
+			fuse_columns_cpu();
+			backward_gather_cpu(0, _batch_size, top, propagate_down, bottom);
+		}
+		else for (int n = 0; n < _batch_size; ++n) backward_gather_cpu(n, n + 1, top, propagate_down, bottom);
+		if(this->param_propagate_down(0)) offset_weight_diff_cpu();
+		return;
+	}
+	if(_fuse_batch)
+	{
+		backward_fused_cpu(top, propagate_down, bottom);
+		return;
+	}
+
 	Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
     Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
     const Dtype* top_diff = top[0]->cpu_diff();
@@ -239,8 +496,7 @@ void OGNConvLayer<Dtype>::weight_cpu_gemm(const Dtype* input, const Dtype* outpu
 }
 
 template <typename Dtype>
-void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top)
+void OGNConvLayer<Dtype>::prepare_rulebooks_cpu()
 {
 	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
@@ -249,6 +505,34 @@ void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dty
     boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
     boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
 
+    // rows are the cells of the key layer; a deconvolution looks up the
+    // children of every cell
+    vector<const GeneralOctree<int>*> rows, lookup;
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        rows.push_back(&l_ptr->get_keys_octree(n));
+        lookup.push_back(is_deconv ? &this->_octree_keys[n] : rows.back());
+    }
+    l_ptr->get_rulebooks(is_deconv ? RULEBOOK_DECONV : RULEBOOK_CONV, filter_size, rows, lookup, _sample_rulebooks);
+    for (int n = 0; n < _batch_size; ++n)
+    {
+        CHECK_LE(_sample_rulebooks[n]->num_columns, _col_buffer_shape[1]) << "More cells than columns in layer " << this->layer_param_.name();
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    col2im_octree_cpu(batch_ind, bottom, top, _col_buffer.cpu_data(), _col_buffer_shape[1]);
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, const Dtype* col_buff, int num_cols)
+{
+	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+
     Dtype* output_arr;
     int output_rows, output_cols;
     if(is_deconv)
@@ -266,92 +550,428 @@ void OGNConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dty
 
     if(!batch_ind) memset(output_arr, 0, sizeof(Dtype) * _batch_size * output_rows * output_cols);
 
-    for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(batch_ind).begin(); it!=l_ptr->get_keys_octree(batch_ind).end(); it++)
+    this->col2im_rulebook_cpu(get_rulebook(batch_ind), col_buff, num_cols, output_rows, output_cols,
+        output_arr + batch_ind * output_rows * output_cols);
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    im2col_octree_cpu(batch_ind, bottom, top, _col_buffer.mutable_cpu_data(), _col_buffer_shape[1]);
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, Dtype* col_buff, int num_cols)
+{
+	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+
+    int input_rows, input_cols;
+    if(is_deconv)
+    {
+        input_rows = _num_output_channels;
+        input_cols = _num_output_pixels;
+    }
+    else
     {
-        KeyType key = it->first;
+        input_rows = _num_input_channels;
+        input_cols = _num_input_pixels;
+    }
+
+    const Dtype* input_arr = is_deconv ? top[0]->cpu_diff() : bottom[0]->cpu_data();
+    this->im2col_rulebook_cpu(get_rulebook(batch_ind), input_arr + batch_ind * input_rows * input_cols,
+        input_rows, input_cols, col_buff, num_cols);
+}
 
-        if(is_deconv) key = key << 3;
+template <typename Dtype>
+void OGNConvLayer<Dtype>::offset_weights_cpu()
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int nbh_count = _offset_weights.shape(0);
+    const Dtype* weights = this->blobs_[0]->cpu_data();
+    Dtype* offset_weights = _offset_weights.mutable_cpu_data();
 
-        std::vector<KeyType> neighbors = this->_octree_keys[batch_ind].get_neighbor_keys(key, filter_size);
-        for(int ch=0; ch<output_rows; ch++)
+    // deconvolution weights are stored [C_in x C_out x offsets]
+    for(int o=0; o<_num_output_channels; o++)
+    {
+        for(int c=0; c<_num_input_channels; c++)
         {
-            for(int el=0; el<filter_size*filter_size*filter_size; el++)
+            const Dtype* w = weights + (is_deconv ? c * _num_output_channels + o : o * _num_input_channels + c) * nbh_count;
+            for(int el=0; el<nbh_count; el++)
             {
-                int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + el * _col_buffer_shape[1] + it->second;
+                offset_weights[(el * _num_output_channels + o) * _num_input_channels + c] = w[el];
+            }
+        }
+    }
+}
 
-                if(neighbors[el] != GeneralOctree<int>::INVALID_KEY())
-                {
-                    unsigned int nbh_key = neighbors[el];
-                    int feature_ind = batch_ind * output_rows * output_cols +
-                                  ch * output_cols + this->_octree_keys[batch_ind].get_value(nbh_key);
+template <typename Dtype>
+void OGNConvLayer<Dtype>::offset_weight_diff_cpu()
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int nbh_count = _offset_weight_diff.shape(0);
+    const Dtype* offset_diff = _offset_weight_diff.cpu_data();
+    Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
 
-                    output_arr[feature_ind] += _col_buffer.mutable_cpu_data()[col_buff_ind];
-                }
+    for(int o=0; o<_num_output_channels; o++)
+    {
+        for(int c=0; c<_num_input_channels; c++)
+        {
+            Dtype* w = weight_diff + (is_deconv ? c * _num_output_channels + o : o * _num_input_channels + c) * nbh_count;
+            for(int el=0; el<nbh_count; el++)
+            {
+                w[el] += offset_diff[(el * _num_output_channels + o) * _num_input_channels + c];
             }
         }
     }
-
-    memset(_col_buffer.mutable_cpu_data(), 0, sizeof(Dtype)*_col_buffer_shape[0]*_col_buffer_shape[1]);
 }
 
 template <typename Dtype>
-void OGNConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+void OGNConvLayer<Dtype>::forward_gather_cpu(int begin, int end, const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top)
 {
-	const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
-	const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const Dtype* bias = this->blobs_[1]->cpu_data();
+
+    vector<const OctreeRulebook*> rulebooks;
+    for(int n=begin; n<end; n++)
+    {
+        rulebooks.push_back(&get_rulebook(n));
+        const int num_cells = this->_octree_keys[n].num_elements();
+        Dtype* output = top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels;
+        for(int o=0; o<_num_output_channels; o++)
+        {
+            caffe_set(num_cells, bias[o], output + o * _num_output_pixels);
+            caffe_set(_num_output_pixels - num_cells, Dtype(0), output + o * _num_output_pixels + num_cells);
+        }
+    }
+
+    Dtype* gathered = _gather_buffer.mutable_cpu_data();
+    Dtype* product = _product_buffer.mutable_cpu_data();
+    for(int el=0; el<rulebooks[0]->nbh_count; el++)
+    {
+        // the rules of all samples side by side
+        int num_rules = 0;
+        for(int n=begin; n<end; n++) num_rules += rulebooks[n - begin]->num_rules(el);
+        if(!num_rules) continue;
+
+        OGNGatherRulesTask<Dtype> gather(_num_input_pixels, num_rules, gathered);
+        OGNScatterRulesTask<Dtype> scatter(_num_output_pixels, num_rules, product);
+        for(int n=begin; n<end; n++)
+        {
+            const OctreeRulebook& rulebook = *rulebooks[n - begin];
+            // the rows of a deconvolution rulebook are its input cells
+            gather.add_sample(bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels,
+                is_deconv ? rulebook.rule_columns(el) : rulebook.rule_neighbors(el), rulebook.num_rules(el));
+            scatter.add_sample(top[0]->mutable_cpu_data() + n * _num_output_channels * _num_output_pixels,
+                is_deconv ? rulebook.rule_neighbors(el) : rulebook.rule_columns(el), rulebook.num_rules(el));
+        }
+
+        ogn_parallel_for(_num_input_channels, num_rules, gather);
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_output_channels, num_rules, _num_input_channels,
+            (Dtype)1., _offset_weights.cpu_data() + el * _num_output_channels * _num_input_channels, gathered,
+            (Dtype)0., product);
+        ogn_parallel_for(_num_output_channels, num_rules, scatter);
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::backward_gather_cpu(int begin, int end, const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+
+    vector<const OctreeRulebook*> rulebooks;
+    for(int n=begin; n<end; n++)
+    {
+        rulebooks.push_back(&get_rulebook(n));
+        const int num_cells = this->_octree_keys[n].num_elements();
+        const Dtype* top_diff = top[0]->cpu_diff() + n * _num_output_channels * _num_output_pixels;
+        if(this->param_propagate_down(1))
+        {
+            Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+            for(int o=0; o<_num_output_channels; o++)
+            {
+                const Dtype* top_row = top_diff + o * _num_output_pixels;
+                Dtype sum = 0;
+                for(int q=0; q<num_cells; q++) sum += top_row[q];
+                bias_diff[o] += sum;
+            }
+        }
+        if(propagate_down[0])
+        {
+            caffe_set(_num_input_channels * _num_input_pixels, Dtype(0),
+                bottom[0]->mutable_cpu_diff() + n * _num_input_channels * _num_input_pixels);
+        }
+    }
 
+    Dtype* gathered = _gather_buffer.mutable_cpu_data();
+    Dtype* gathered_diff = _product_buffer.mutable_cpu_data();
+    for(int el=0; el<rulebooks[0]->nbh_count; el++)
+    {
+        int num_rules = 0;
+        for(int n=begin; n<end; n++) num_rules += rulebooks[n - begin]->num_rules(el);
+        if(!num_rules) continue;
+        const int weights_offset = el * _num_output_channels * _num_input_channels;
+
+        OGNGatherRulesTask<Dtype> gather_diff(_num_output_pixels, num_rules, gathered_diff);
+        OGNGatherRulesTask<Dtype> gather(_num_input_pixels, num_rules, gathered);
+        OGNScatterRulesTask<Dtype> scatter(_num_input_pixels, num_rules, gathered);
+        for(int n=begin; n<end; n++)
+        {
+            const OctreeRulebook& rulebook = *rulebooks[n - begin];
+            const int* input_cols = is_deconv ? rulebook.rule_columns(el) : rulebook.rule_neighbors(el);
+            const int* output_cols = is_deconv ? rulebook.rule_neighbors(el) : rulebook.rule_columns(el);
+            gather_diff.add_sample(top[0]->cpu_diff() + n * _num_output_channels * _num_output_pixels,
+                output_cols, rulebook.num_rules(el));
+            gather.add_sample(bottom[0]->cpu_data() + n * _num_input_channels * _num_input_pixels,
+                input_cols, rulebook.num_rules(el));
+            if(propagate_down[0])
+            {
+                scatter.add_sample(bottom[0]->mutable_cpu_diff() + n * _num_input_channels * _num_input_pixels,
+                    input_cols, rulebook.num_rules(el));
+            }
+        }
+        ogn_parallel_for(_num_output_channels, num_rules, gather_diff);
+
+        if(this->param_propagate_down(0))
+        {
+            ogn_parallel_for(_num_input_channels, num_rules, gather);
+            caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_output_channels, _num_input_channels, num_rules,
+                (Dtype)1., gathered_diff, gathered,
+                (Dtype)1., _offset_weight_diff.mutable_cpu_data() + weights_offset);
+        }
+
+        if(propagate_down[0])
+        {
+            caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _num_input_channels, num_rules, _num_output_channels,
+                (Dtype)1., _offset_weights.cpu_data() + weights_offset, gathered_diff,
+                (Dtype)0., gathered);
+            ogn_parallel_for(_num_input_channels, num_rules, scatter);
+        }
+    }
+}
+
+template <typename Dtype>
+int OGNConvLayer<Dtype>::fuse_columns_cpu()
+{
+    // the columns of a sample are the cells of its key layer, of which a
+    // deconvolution has an eighth
+    const int cells_per_column = this->layer_param_.ogn_conv_param().is_deconv() ? 8 : 1;
+    _column_offsets.resize(_batch_size + 1);
+    _column_offsets[0] = 0;
+    for(int n=0; n<_batch_size; n++)
+    {
+        _column_offsets[n + 1] = _column_offsets[n] + this->_octree_keys[n].num_elements() / cells_per_column;
+    }
+    const int num_columns = _column_offsets[_batch_size];
+
+    // at most as many rules per offset as columns
+    vector<int> shape;
+    shape.push_back(std::max(_num_input_channels, _num_output_channels));
+    shape.push_back(std::max(num_columns, 1));
+    if(_gather_engine)
+    {
+        _gather_buffer.Reshape(shape);
+        _product_buffer.Reshape(shape);
+    }
+    else
+    {
+        _fused_features.Reshape(shape);
+        shape[0] = _col_buffer_shape[0];
+        _col_buffer.Reshape(shape);
+    }
+    return num_columns;
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::forward_fused_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int num_columns = fuse_columns_cpu();
+    const int num_rows = _col_buffer_shape[0];
     Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    Dtype* fused = _fused_features.mutable_cpu_data();
+    if(!num_columns)
+    {
+        caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+        return;
+    }
 
-    int input_rows, input_cols;
     if(is_deconv)
     {
-        input_rows = _num_output_channels;
-        input_cols = _num_output_pixels;
+        this->gather_columns_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, _column_offsets, fused);
+        caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, num_rows, num_columns, _num_input_channels,
+            (Dtype)1., this->blobs_[0]->cpu_data(), fused,
+            (Dtype)0., col_buff);
+        for(int n=0; n<_batch_size; n++) col2im_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
     }
     else
     {
-        input_rows = _num_input_channels;
-        input_cols = _num_input_pixels;
+        for(int n=0; n<_batch_size; n++) im2col_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_output_channels, num_columns, num_rows,
+            (Dtype)1., this->blobs_[0]->cpu_data(), col_buff,
+            (Dtype)0., fused);
+        this->scatter_columns_cpu(fused, _num_output_channels, _num_output_pixels, _column_offsets, top[0]->mutable_cpu_data());
     }
 
-    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
-    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    const Dtype* bias = this->blobs_[1]->cpu_data();
+    for(int n=0; n<_batch_size; n++)
+    {
+        const int num_cells = this->_octree_keys[n].num_elements();
+        for(int o=0; o<_num_output_channels; o++)
+        {
+            caffe_add_scalar(num_cells, bias[o], top[0]->mutable_cpu_data() + (n * _num_output_channels + o) * _num_output_pixels);
+        }
+    }
+}
 
-    for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(batch_ind).begin(); it!=l_ptr->get_keys_octree(batch_ind).end(); it++)
+template <typename Dtype>
+void OGNConvLayer<Dtype>::backward_fused_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom)
+{
+    const bool is_deconv = this->layer_param_.ogn_conv_param().is_deconv();
+    const int num_columns = fuse_columns_cpu();
+    const int num_rows = _col_buffer_shape[0];
+    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    Dtype* fused = _fused_features.mutable_cpu_data();
+    const Dtype* top_diff = top[0]->cpu_diff();
+    if(!num_columns)
     {
-        KeyType key = it->first;
-        if(is_deconv) key = key << 3;
+        if(propagate_down[0]) caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+        return;
+    }
 
-        if(key)
+    if(this->param_propagate_down(1))
+    {
+        Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+        for(int n=0; n<_batch_size; n++)
         {
-            std::vector<KeyType> neighbors = this->_octree_keys[batch_ind].get_neighbor_keys(key, filter_size);
-
-            for(int ch=0; ch<input_rows; ch++)
+            const int num_cells = this->_octree_keys[n].num_elements();
+            for(int o=0; o<_num_output_channels; o++)
             {
-                for(int el=0; el<neighbors.size(); el++)
-                {
-                    int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + el * _col_buffer_shape[1] + it->second;
-
-                    if(neighbors[el] != GeneralOctree<int>::INVALID_KEY())
-                    {
-                        KeyType nbh_key = neighbors[el];
-                        int feature_ind = batch_ind * input_rows * input_cols +
-                                      ch * input_cols + this->_octree_keys[batch_ind].get_value(nbh_key);
-                        if(is_deconv) col_buff[col_buff_ind] = top[0]->cpu_diff()[feature_ind];
-                        else col_buff[col_buff_ind] = bottom[0]->cpu_data()[feature_ind];
-                    }
-                    else
-                    {
-                        col_buff[col_buff_ind] = 0;
-                    }
-                }
+                const Dtype* top_row = top_diff + (n * _num_output_channels + o) * _num_output_pixels;
+                Dtype sum = 0;
+                for(int q=0; q<num_cells; q++) sum += top_row[q];
+                bias_diff[o] += sum;
             }
         }
     }
+
+    // the col buffer holds the neighbourhoods of the top diff for a
+    // deconvolution and of the input otherwise
+    for(int n=0; n<_batch_size; n++) im2col_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+
+    if(is_deconv)
+    {
+        if(this->param_propagate_down(0))
+        {
+            this->gather_columns_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, _column_offsets, fused);
+            caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_input_channels, num_rows, num_columns,
+                (Dtype)1., fused, col_buff,
+                (Dtype)1., this->blobs_[0]->mutable_cpu_diff());
+        }
+        if(propagate_down[0])
+        {
+            caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_input_channels, num_columns, num_rows,
+                (Dtype)1., this->blobs_[0]->cpu_data(), col_buff,
+                (Dtype)0., fused);
+            this->scatter_columns_cpu(fused, _num_input_channels, _num_input_pixels, _column_offsets, bottom[0]->mutable_cpu_diff());
+        }
+    }
+    else
+    {
+        this->gather_columns_cpu(top_diff, _num_output_channels, _num_output_pixels, _column_offsets, fused);
+        if(this->param_propagate_down(0))
+        {
+            caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_output_channels, num_rows, num_columns,
+                (Dtype)1., fused, col_buff,
+                (Dtype)1., this->blobs_[0]->mutable_cpu_diff());
+        }
+        if(propagate_down[0])
+        {
+            caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, num_rows, num_columns, _num_output_channels,
+                (Dtype)1., this->blobs_[0]->cpu_data(), fused,
+                (Dtype)0., col_buff);
+            for(int n=0; n<_batch_size; n++) col2im_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+        }
+    }
+}
+
+template <typename Dtype>
+void OGNConvLayer<Dtype>::forward_children_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+    const int num_columns = fuse_columns_cpu();
+    if(!num_columns)
+    {
+        caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+        return;
+    }
+    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
+    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(this->parent_net()->layer_by_name(key_layer_name));
+
+    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    Dtype* fused = _fused_features.mutable_cpu_data();
+    this->gather_columns_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, _column_offsets, fused);
+    caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _col_buffer_shape[0], num_columns, _num_input_channels,
+        (Dtype)1., this->blobs_[0]->cpu_data(), fused,
+        (Dtype)0., col_buff);
+
+    OGNWriteChildrenTask<Dtype> write(_child_offsets, _column_offsets, col_buff, _num_output_channels,
+        _num_output_pixels, this->blobs_[1]->cpu_data(), top[0]->mutable_cpu_data());
+    for(int n=0; n<_batch_size; n++)
+    {
+        const vector<int>& parent_cols = l_ptr->get_keys_octree(n).values();
+        write.add_sample(parent_cols.empty() ? NULL : &parent_cols[0], parent_cols.size());
+    }
+    ogn_parallel_for(_num_output_channels, 8 * num_columns, write);
 }
 
+template <typename Dtype>
+void OGNConvLayer<Dtype>::backward_children_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom)
+{
+    const int num_columns = fuse_columns_cpu();
+    if(!num_columns)
+    {
+        if(propagate_down[0]) caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+        return;
+    }
+    std::string key_layer_name = this->layer_param_.ogn_conv_param().key_layer();
+    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(this->parent_net()->layer_by_name(key_layer_name));
+
+    const int num_rows = _col_buffer_shape[0];
+    Dtype* col_buff = _col_buffer.mutable_cpu_data();
+    Dtype* fused = _fused_features.mutable_cpu_data();
+
+    // the parents of a sample are its first columns, so every column is set
+    OGNReadChildrenTask<Dtype> read(_child_offsets, _column_offsets, top[0]->cpu_diff(), _num_output_channels,
+        _num_output_pixels, col_buff, this->param_propagate_down(1) ? this->blobs_[1]->mutable_cpu_diff() : NULL);
+    for(int n=0; n<_batch_size; n++)
+    {
+        const vector<int>& parent_cols = l_ptr->get_keys_octree(n).values();
+        read.add_sample(parent_cols.empty() ? NULL : &parent_cols[0], parent_cols.size());
+    }
+    ogn_parallel_for(_num_output_channels, 8 * num_columns, read);
+
+    if(this->param_propagate_down(0))
+    {
+        this->gather_columns_cpu(bottom[0]->cpu_data(), _num_input_channels, _num_input_pixels, _column_offsets, fused);
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_input_channels, num_rows, num_columns,
+            (Dtype)1., fused, col_buff,
+            (Dtype)1., this->blobs_[0]->mutable_cpu_diff());
+    }
+    if(propagate_down[0])
+    {
+        caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_input_channels, num_columns, num_rows,
+            (Dtype)1., this->blobs_[0]->cpu_data(), col_buff,
+            (Dtype)0., fused);
+        this->scatter_columns_cpu(fused, _num_input_channels, _num_input_pixels, _column_offsets, bottom[0]->mutable_cpu_diff());
+    }
+}
 
 INSTANTIATE_CLASS(OGNConvLayer);
 REGISTER_LAYER_CLASS(OGNConv);
@@ -6,10 +6,18 @@ template <typename Dtype>
 void OGNConvLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
+    // the gather/scatter engine and fused batches have no GPU implementation
+    if(_gather_engine || _fuse_batch)
+    {
+        Forward_cpu(bottom, top);
+        return;
+    }
+
     bool is_deconv = this->layer_param().ogn_conv_param().is_deconv();
     const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 
     propagate_keys_cpu();
+    prepare_rulebooks_cpu();
 
     for (int n = 0; n < _batch_size; n++)
     {
@@ -46,6 +54,14 @@ template <typename Dtype>
 void OGNConvLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
+    if(_gather_engine || _fuse_batch)
+    {
+        Backward_cpu(top, propagate_down, bottom);
+        return;
+    }
+
+    prepare_rulebooks_cpu();
+
     bool is_deconv = this->layer_param().ogn_conv_param().is_deconv();
     const int filter_size = this->layer_param_.ogn_conv_param().filter_size();
 
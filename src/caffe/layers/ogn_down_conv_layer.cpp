@@ -1,3 +1,7 @@
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
 #include "caffe/layers/ogn_down_conv_layer.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
@@ -37,6 +41,8 @@ void OGNDownConvLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
     	shared_ptr<Filler<Dtype> > bias_filler(GetFiller<Dtype>(
         	this->layer_param_.ogn_down_conv_param().bias_filler()));
     	bias_filler->Fill(this->blobs_[1].get());
+
+	_fuse_batch = this->layer_param_.ogn_down_conv_param().fuse_batch();
 }
 
 template <typename Dtype>
@@ -62,19 +68,14 @@ void OGNDownConvLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 		_num_output_pixels = 1;
 
 		_next_level_keys.clear();
+		_next_level_keys.resize(_batch_size);
+		int num_cells = 0;
+		for (int n = 0; n < _batch_size; ++n) num_cells += l_ptr->get_keys_octree(n).num_elements();
+		ogn_parallel_for(_batch_size, num_cells,
+			boost::bind(&OGNDownConvLayer<Dtype>::next_level_keys_cpu, this, _1, l_ptr.get()));
 		for (int n = 0; n < _batch_size; ++n) {
-			set<KeyType> next_level_keys;
-			GeneralOctree<int> cur_key_octree = l_ptr->get_keys_octree(n);
-			for(typename GeneralOctree<int>::iterator it=cur_key_octree.begin(); it!=cur_key_octree.end(); it++) {
-				KeyType key = it->first;
-				if (key != GeneralOctree<int>::INVALID_KEY()) {
-					key >>= 3;
-					next_level_keys.insert(key);
-				}
-			}
-			_next_level_keys.push_back(next_level_keys);
-			if (next_level_keys.size() > _num_output_pixels) {
-				_num_output_pixels = next_level_keys.size();
+			if (_next_level_keys[n].size() > _num_output_pixels) {
+				_num_output_pixels = _next_level_keys[n].size();
 			}
 		}
 
@@ -88,7 +89,21 @@ void OGNDownConvLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
 		_col_buffer_shape.push_back(_num_input_channels * _filter_size * _filter_size * _filter_size);
 		_col_buffer_shape.push_back(_num_output_pixels);
 
-		_col_buffer.Reshape(_col_buffer_shape);
+		// a fused col buffer is shaped in forward
+		if (!_fuse_batch) _col_buffer.Reshape(_col_buffer_shape);
+	}
+}
+
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::next_level_keys_cpu(int batch_ind, OGNLayer<Dtype>* key_layer) {
+	set<KeyType>& next_level_keys = _next_level_keys[batch_ind];
+	const GeneralOctree<int>& cur_key_octree = key_layer->get_keys_octree(batch_ind);
+	for(typename GeneralOctree<int>::iterator it=cur_key_octree.begin(); it!=cur_key_octree.end(); it++) {
+		KeyType key = it->first;
+		if (key != GeneralOctree<int>::INVALID_KEY()) {
+			key >>= 3;
+			next_level_keys.insert(key);
+		}
 	}
 }
 
@@ -96,23 +111,28 @@ template <typename Dtype>
 void OGNDownConvLayer<Dtype>::propagate_keys_cpu() {
 	this->_octree_keys.clear();
 	this->_octree_prop.clear();
+	this->_octree_keys.resize(_batch_size);
+	this->_octree_prop.resize(_batch_size);
 
-	for (int n = 0; n < _batch_size; ++n) {
-		int output_counter = 0;
-
-		GeneralOctree<int> octree_keys;
-		GeneralOctree<int> octree_prop;
-		
-		set<KeyType>* cur_next_level_keys = &(this->_next_level_keys[n]);
-		for (set<KeyType>::iterator it = cur_next_level_keys->begin(); it != cur_next_level_keys->end(); ++it) {
-			KeyType key = *it;
-			octree_keys.add_element(key, output_counter);
-			octree_prop.add_element(key, PROP_TRUE);
-			++ output_counter;
-		}
+	int num_cells = 0;
+	for (int n = 0; n < _batch_size; ++n) num_cells += _next_level_keys[n].size();
+	ogn_parallel_for(_batch_size, num_cells,
+		boost::bind(&OGNDownConvLayer<Dtype>::propagate_sample_keys_cpu, this, _1));
+}
+
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::propagate_sample_keys_cpu(int batch_ind) {
+	int output_counter = 0;
 
-		this->_octree_keys.push_back(octree_keys);
-		this->_octree_prop.push_back(octree_prop);
+	GeneralOctree<int>& octree_keys = this->_octree_keys[batch_ind];
+	GeneralOctree<int>& octree_prop = this->_octree_prop[batch_ind];
+
+	set<KeyType>* cur_next_level_keys = &(this->_next_level_keys[batch_ind]);
+	for (set<KeyType>::iterator it = cur_next_level_keys->begin(); it != cur_next_level_keys->end(); ++it) {
+		KeyType key = *it;
+		octree_keys.add_element(key, output_counter);
+		octree_prop.add_element(key, PROP_TRUE);
+		++ output_counter;
 	}
 }
 
@@ -134,6 +154,12 @@ void OGNDownConvLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 	string prefix = "OGNDownConvLayer<Dtype>::Forward_cpu";
 
 	propagate_keys_cpu();
+	prepare_rulebooks_cpu();
+
+	if (_fuse_batch) {
+		forward_fused_cpu(bottom, top);
+		return;
+	}
 
 	for (int n=0; n<_batch_size; n++) {
 		int num_elements = this->_octree_keys[n].num_elements();
@@ -152,6 +178,13 @@ void OGNDownConvLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
 
 	string prefix = "OGNDownConvLayer<Dtype>::Backward_cpu";
 
+	prepare_rulebooks_cpu();
+
+	if (_fuse_batch) {
+		backward_fused_cpu(top, propagate_down, bottom);
+		return;
+	}
+
 	Dtype* weight_diff = this->blobs_[0]->mutable_cpu_diff();
 	Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
 	const Dtype* top_diff = top[0]->cpu_diff();
@@ -211,9 +244,33 @@ void OGNDownConvLayer<Dtype>::weight_cpu_gemm(const Dtype* input, const Dtype* o
                           (Dtype)1., output, col_buff, (Dtype)1., weights);
 }
 
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::prepare_rulebooks_cpu()
+{
+	std::string key_layer_name = this->layer_param_.ogn_down_conv_param().key_layer();
+	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
+	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+
+	// rows are the parents of the key layer's cells, which look up their
+	// children
+	vector<const GeneralOctree<int>*> rows, lookup;
+	for (int n = 0; n < _batch_size; ++n) {
+		rows.push_back(&this->_octree_keys[n]);
+		lookup.push_back(&l_ptr->get_keys_octree(n));
+	}
+	l_ptr->get_rulebooks(RULEBOOK_DOWN, _filter_size, rows, lookup, _sample_rulebooks);
+}
+
 template <typename Dtype>
 void OGNDownConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top)
+{
+	col2im_octree_cpu(batch_ind, bottom, top, _col_buffer.cpu_data(), _col_buffer_shape[1]);
+}
+
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, const Dtype* col_buff, int num_cols)
 {
 	Dtype* output_arr = bottom[0]->mutable_cpu_diff();
 	int output_rows = _num_input_channels;
@@ -221,71 +278,115 @@ void OGNDownConvLayer<Dtype>::col2im_octree_cpu(int batch_ind, const vector<Blob
 
 	if(!batch_ind) memset(output_arr, 0, sizeof(Dtype) * _batch_size * output_rows * output_cols);
 
-	std::string key_layer_name = this->layer_param_.ogn_down_conv_param().key_layer();
-	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
-
-	set<KeyType>* cur_next_level_keys = &(this->_next_level_keys[batch_ind]);
-	for(set<KeyType>::iterator it = cur_next_level_keys->begin(); it != cur_next_level_keys->end(); ++it) {
-		KeyType key = *it;
-		key <<= 3;
-		
-		GeneralOctree<int>* parent_keys_octree = &(l_ptr->get_keys_octree(batch_ind));
-		std::vector<KeyType> neighbors = parent_keys_octree->get_neighbor_keys(key, _filter_size);
-
-		for(int ch = 0; ch < _num_input_channels; ++ch) {
-			for(int el = 0; el < neighbors.size(); ++el) {
-				int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + 
-					el * _col_buffer_shape[1] + this->_octree_keys[batch_ind].get_value(*it);
-
-				if (neighbors[el] != GeneralOctree<int>::INVALID_KEY()) {
-					KeyType nbh_key = neighbors[el];
-					int feature_ind = batch_ind * _num_input_channels * _num_input_pixels + 
-						ch * _num_input_pixels + parent_keys_octree->get_value(nbh_key);
-					output_arr[feature_ind] += _col_buffer.mutable_cpu_data()[col_buff_ind];
-				}
-			}
-		}
-	}
+	this->col2im_rulebook_cpu(get_rulebook(batch_ind), col_buff, num_cols, output_rows, output_cols,
+		output_arr + batch_ind * output_rows * output_cols);
+}
 
-    memset(_col_buffer.mutable_cpu_data(), 0, sizeof(Dtype)*_col_buffer_shape[0]*_col_buffer_shape[1]);
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top)
+{
+	im2col_octree_cpu(batch_ind, bottom, top, _col_buffer.mutable_cpu_data(), _col_buffer_shape[1]);
 }
 
 template <typename Dtype>
 void OGNDownConvLayer<Dtype>::im2col_octree_cpu(int batch_ind, const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top, Dtype* col_buff, int num_cols)
+{
+	this->im2col_rulebook_cpu(get_rulebook(batch_ind),
+		bottom[0]->cpu_data() + batch_ind * _num_input_channels * _num_input_pixels,
+		_num_input_channels, _num_input_pixels, col_buff, num_cols);
+}
+
+template <typename Dtype>
+int OGNDownConvLayer<Dtype>::fuse_columns_cpu()
+{
+	_column_offsets.resize(_batch_size + 1);
+	_column_offsets[0] = 0;
+	for (int n = 0; n < _batch_size; ++n) {
+		_column_offsets[n + 1] = _column_offsets[n] + this->_octree_keys[n].num_elements();
+	}
+	const int num_columns = _column_offsets[_batch_size];
+
+	vector<int> shape;
+	shape.push_back(_num_output_channels);
+	shape.push_back(std::max(num_columns, 1));
+	_fused_features.Reshape(shape);
+	shape[0] = _col_buffer_shape[0];
+	_col_buffer.Reshape(shape);
+	return num_columns;
+}
+
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::forward_fused_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top)
 {
+	const int num_columns = fuse_columns_cpu();
 	Dtype* col_buff = _col_buffer.mutable_cpu_data();
+	Dtype* fused = _fused_features.mutable_cpu_data();
+	if (!num_columns) {
+		caffe_set(top[0]->count(), Dtype(0), top[0]->mutable_cpu_data());
+		return;
+	}
 
-	std::string key_layer_name = this->layer_param_.ogn_down_conv_param().key_layer();
-	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+	for (int n = 0; n < _batch_size; ++n) {
+		im2col_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+	}
+	caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, _num_output_channels, num_columns, _col_buffer_shape[0],
+		(Dtype)1., this->blobs_[0]->cpu_data(), col_buff,
+		(Dtype)0., fused);
+	this->scatter_columns_cpu(fused, _num_output_channels, _num_output_pixels, _column_offsets, top[0]->mutable_cpu_data());
 
-	set<KeyType>* cur_next_level_keys = &(this->_next_level_keys[batch_ind]);
-	GeneralOctree<int>* parent_keys_octree = &(l_ptr->get_keys_octree(batch_ind));
-	for(set<KeyType>::iterator it = cur_next_level_keys->begin(); it != cur_next_level_keys->end(); ++it) {
-		KeyType key = *it;
-		key <<= 3;
-		
-		std::vector<KeyType> neighbors = parent_keys_octree->get_neighbor_keys(key, _filter_size);
-		for(int ch = 0; ch < _num_input_channels; ++ch) {
-			for(int el = 0; el < neighbors.size(); ++el) {
-				int col_buff_ind = ch * neighbors.size() * _col_buffer_shape[1] + 
-					el * _col_buffer_shape[1] + this->_octree_keys[batch_ind].get_value(*it);
-
-				if (neighbors[el] != GeneralOctree<int>::INVALID_KEY()) {
-					KeyType nbh_key = neighbors[el];
-					int feature_ind = batch_ind * _num_input_channels * _num_input_pixels + 
-						ch * _num_input_pixels + parent_keys_octree->get_value(nbh_key);
-					col_buff[col_buff_ind] = bottom[0]->cpu_data()[feature_ind];
-				} else {
-					col_buff[col_buff_ind] = 0;
-				}
-			}
+	const Dtype* bias = this->blobs_[1]->cpu_data();
+	for (int n = 0; n < _batch_size; ++n) {
+		for (int o = 0; o < _num_output_channels; ++o) {
+			caffe_add_scalar(_column_offsets[n + 1] - _column_offsets[n], bias[o],
+				top[0]->mutable_cpu_data() + (n * _num_output_channels + o) * _num_output_pixels);
 		}
 	}
 }
 
+template <typename Dtype>
+void OGNDownConvLayer<Dtype>::backward_fused_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom)
+{
+	const int num_columns = fuse_columns_cpu();
+	Dtype* col_buff = _col_buffer.mutable_cpu_data();
+	Dtype* fused = _fused_features.mutable_cpu_data();
+	if (!num_columns) {
+		if (propagate_down[0]) caffe_set(bottom[0]->count(), Dtype(0), bottom[0]->mutable_cpu_diff());
+		return;
+	}
+
+	this->gather_columns_cpu(top[0]->cpu_diff(), _num_output_channels, _num_output_pixels, _column_offsets, fused);
+	if (this->param_propagate_down(1)) {
+		Dtype* bias_diff = this->blobs_[1]->mutable_cpu_diff();
+		for (int o = 0; o < _num_output_channels; ++o) {
+			const Dtype* row = fused + o * num_columns;
+			Dtype sum = 0;
+			for (int q = 0; q < num_columns; ++q) sum += row[q];
+			bias_diff[o] += sum;
+		}
+	}
+
+	if (this->param_propagate_down(0)) {
+		for (int n = 0; n < _batch_size; ++n) {
+			im2col_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+		}
+		caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, _num_output_channels, _col_buffer_shape[0], num_columns,
+			(Dtype)1., fused, col_buff,
+			(Dtype)1., this->blobs_[0]->mutable_cpu_diff());
+	}
+
+	if (propagate_down[0]) {
+		caffe_cpu_gemm<Dtype>(CblasTrans, CblasNoTrans, _col_buffer_shape[0], num_columns, _num_output_channels,
+			(Dtype)1., this->blobs_[0]->cpu_data(), fused,
+			(Dtype)0., col_buff);
+		for (int n = 0; n < _batch_size; ++n) {
+			col2im_octree_cpu(n, bottom, top, col_buff + _column_offsets[n], num_columns);
+		}
+	}
+}
 
 INSTANTIATE_CLASS(OGNDownConvLayer);
 REGISTER_LAYER_CLASS(OGNDownConv);
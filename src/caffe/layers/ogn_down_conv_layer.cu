@@ -8,7 +8,14 @@ void OGNDownConvLayer<Dtype>::Forward_gpu(const vector<Blob<Dtype>*>& bottom,
 
 	string prefix = "OGNDownConvLayer<Dtype>::Forward_gpu";
 
+	// fused batches have no GPU implementation
+	if (_fuse_batch) {
+		Forward_cpu(bottom, top);
+		return;
+	}
+
     propagate_keys_cpu();
+    prepare_rulebooks_cpu();
 
     for (int n = 0; n < _batch_size; n++)
     {
@@ -32,6 +39,13 @@ void OGNDownConvLayer<Dtype>::Backward_gpu(const vector<Blob<Dtype>*>& top,
 
 	string prefix = "OGNDownConvLayer<Dtype>::Backward_gpu";
 
+	if (_fuse_batch) {
+		Backward_cpu(top, propagate_down, bottom);
+		return;
+	}
+
+    prepare_rulebooks_cpu();
+
     for (int n = 0; n < _batch_size; ++n)
     {
 	    int num_elements = this->_octree_keys[n].num_elements();
@@ -20,6 +20,9 @@ void OGNGenerateKeysLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
         int level = ceil(log(dim) / log(2));
         if(level > this->_level) this->_level = level;
     }
+    CHECK_LE(this->_level, GeneralOctree<int>::MAX_LEVEL()) << "The dense input needs octree level "
+        << this->_level << ", beyond the " << 8 * sizeof(KeyType) << "-bit keys of this build; "
+        << "build with USE_OGN_64BIT_KEYS";
 
     this->_octree_keys.clear();
     this->_octree_prop.clear();
@@ -29,25 +32,38 @@ void OGNGenerateKeysLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     int ysize = bottom[0]->shape(3);
     int zsize = bottom[0]->shape(4);
 
+    int num_cells = xsize*ysize*zsize;
+    std::vector<uint32_t> xs(num_cells), ys(num_cells), zs(num_cells);
+    for(int x=0; x<xsize; x++)
+    {
+        for(int y=0; y<ysize; y++)
+        {
+            for(int z=0; z<zsize; z++)
+            {
+                int ind = x*ysize*zsize + y*zsize + z;
+                xs[ind] = x; ys[ind] = y; zs[ind] = z;
+            }
+        }
+    }
+    std::vector<KeyType> keys(num_cells);
+    if(num_cells) morton_3d_batch(&xs[0], &ys[0], &zs[0], &keys[0], num_cells);
+    const KeyType level_bit = KeyType(1) << 3 * this->_level;
+
     for(int bt=0; bt<batch_size; bt++)
     {
         GeneralOctree<int> octree_keys;
         GeneralOctree<int> octree_prop;
-        for(int x=0; x<xsize; x++)
+        std::vector<std::pair<KeyType, int> > key_elements;
+        std::vector<std::pair<KeyType, int> > prop_elements;
+        key_elements.reserve(num_cells);
+        prop_elements.reserve(num_cells);
+        for(int i=0; i<num_cells; i++)
         {
-            for(int y=0; y<ysize; y++)
-            {
-                for(int z=0; z<zsize; z++)
-                {
-                    OctreeCoord c;
-                    c.x = x; c.y = y; c.z = z; c.l = this->_level;
-                    KeyType key = Octree::compute_key(c);
-
-                    octree_keys.add_element(key, x*ysize*zsize + y*zsize + z);
-                    octree_prop.add_element(key, 1);
-                }
-            }
+            key_elements.push_back(std::make_pair(keys[i] | level_bit, i));
+            prop_elements.push_back(std::make_pair(keys[i] | level_bit, 1));
         }
+        octree_keys.build_from_unsorted(key_elements);
+        octree_prop.build_from_unsorted(prop_elements);
         this->_octree_keys.push_back(octree_keys);
         this->_octree_prop.push_back(octree_prop);
     }
@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <vector>
+
+#include "caffe/layers/ogn_layer.hpp"
+
+#include "image_tree_tools/octree_parallel.h"
+
+namespace caffe {
+
+static int ogn_threads = 0;
+static int ogn_task_cells = 4096;
+
+// one pool per solver thread, started on its first loop
+static boost::thread_specific_ptr<WorkerPool> ogn_pools;
+
+void set_ogn_threads(int num_threads, int cells_per_task)
+{
+    CHECK_GT(cells_per_task, 0) << "OGN tasks need at least one cell";
+    ogn_threads = num_threads;
+    ogn_task_cells = cells_per_task;
+}
+
+int ogn_num_threads()
+{
+    if(ogn_threads > 0) return ogn_threads;
+    return std::max(default_num_threads() / std::max(Caffe::solver_count(), 1), 1);
+}
+
+int ogn_cells_per_task() { return ogn_task_cells; }
+
+/// The pool of the calling thread, restarted when the thread count changed.
+static WorkerPool& ogn_pool()
+{
+    const int num_threads = ogn_num_threads();
+    if(!ogn_pools.get() || ogn_pools->num_threads() != num_threads) ogn_pools.reset(new WorkerPool(num_threads));
+    return *ogn_pools;
+}
+
+struct OGNTask
+{
+    explicit OGNTask(const boost::function<void(int)>& task) : task(task) {}
+    void operator()(int ind) { task(ind); }
+
+    const boost::function<void(int)>& task;
+};
+
+void ogn_parallel_for(int num_tasks, int num_cells,
+    const boost::function<void(int)>& task)
+{
+    OGNTask parallel_task(task);
+    if(num_cells <= ogn_task_cells || WorkerPool::in_task())
+    {
+        for(int i=0; i<num_tasks; i++) parallel_task(i);
+        return;
+    }
+    ogn_pool().run(num_tasks, parallel_task);
+}
+
+struct OGNCellRange
+{
+    int sample;
+    int begin;
+    int end;
+};
+
+struct OGNCellRangeTask
+{
+    OGNCellRangeTask(const std::vector<OGNCellRange>& ranges,
+                     const boost::function<void(int, int, int)>& task) :
+        ranges(ranges), task(task) {}
+    void operator()(int ind) { task(ranges[ind].sample, ranges[ind].begin, ranges[ind].end); }
+
+    const std::vector<OGNCellRange>& ranges;
+    const boost::function<void(int, int, int)>& task;
+};
+
+void ogn_parallel_for_cells(const std::vector<int>& num_cells,
+    const boost::function<void(int, int, int)>& task)
+{
+    std::vector<OGNCellRange> ranges;
+    for(int n=0; n<num_cells.size(); n++)
+    {
+        for(int begin=0; begin<num_cells[n]; begin+=ogn_task_cells)
+        {
+            OGNCellRange range = {n, begin, std::min(begin + ogn_task_cells, num_cells[n])};
+            ranges.push_back(range);
+        }
+    }
+    OGNCellRangeTask range_task(ranges, task);
+    if(ranges.size() <= 1 || WorkerPool::in_task())
+    {
+        for(int i=0; i<ranges.size(); i++) range_task(i);
+        return;
+    }
+    ogn_pool().run(ranges.size(), range_task);
+}
+
+/// Looks up the neighbours of a range of rows of one rulebook.
+struct OGNFillRulebookTask
+{
+    OGNFillRulebookTask(const std::vector<const GeneralOctree<int>*>& rows,
+                        const std::vector<const GeneralOctree<int>*>& lookup,
+                        int shift, int filter_size, std::vector<OctreeRulebook*>& rulebooks) :
+        rows(rows), lookup(lookup), shift(shift), filter_size(filter_size), rulebooks(rulebooks) {}
+
+    void operator()(int n, int begin, int end)
+    {
+        fill_octree_rulebook(*rows[n], *lookup[n], shift, filter_size, begin, end, *rulebooks[n]);
+    }
+
+    const std::vector<const GeneralOctree<int>*>& rows;
+    const std::vector<const GeneralOctree<int>*>& lookup;
+    const int shift;
+    const int filter_size;
+    std::vector<OctreeRulebook*>& rulebooks;
+};
+
+struct OGNFinishRulebookTask
+{
+    explicit OGNFinishRulebookTask(std::vector<OctreeRulebook*>& rulebooks) : rulebooks(rulebooks) {}
+    void operator()(int n) { if(rulebooks[n]) finish_octree_rulebook(*rulebooks[n]); }
+
+    std::vector<OctreeRulebook*>& rulebooks;
+};
+
+template <typename Dtype>
+void OGNLayer<Dtype>::get_rulebooks(OctreeRulebookKind kind, int filter_size,
+    const std::vector<const GeneralOctree<int>*>& rows,
+    const std::vector<const GeneralOctree<int>*>& lookup,
+    std::vector<const OctreeRulebook*>& rulebooks)
+{
+    const int batch_size = rows.size();
+    CHECK_LE(batch_size, _octree_keys.size()) << "Rulebooks of more samples than key octrees";
+    std::vector<CachedRulebook>& cache = _rulebooks[std::make_pair(int(kind), filter_size)];
+    if(cache.size() < _octree_keys.size()) cache.resize(_octree_keys.size());
+
+    CPUTimer timer;
+    timer.Start();
+    // rulebooks to build, with their rows; the others are reused
+    std::vector<OctreeRulebook*> builds(batch_size, (OctreeRulebook*)NULL);
+    std::vector<int> build_rows(batch_size, 0);
+    int num_builds = 0, num_cells = 0;
+    rulebooks.resize(batch_size);
+    for(int n=0; n<batch_size; n++)
+    {
+        CachedRulebook& entry = cache[n];
+        rulebooks[n] = &entry.rulebook;
+        if(entry.valid && entry.keys.shares_arrays(_octree_keys[n]))
+        {
+            _rulebook_reuses++;
+            continue;
+        }
+        init_octree_rulebook(*rows[n], *lookup[n], filter_size, entry.rulebook);
+        builds[n] = &entry.rulebook;
+        build_rows[n] = rows[n]->num_elements();
+        num_cells += build_rows[n];
+        num_builds++;
+    }
+    if(!num_builds) return;
+
+    OGNFillRulebookTask fill(rows, lookup, kind == RULEBOOK_CONV ? 0 : 3, filter_size, builds);
+    ogn_parallel_for_cells(build_rows, fill);
+    OGNFinishRulebookTask finish(builds);
+    ogn_parallel_for(batch_size, num_cells, finish);
+
+    for(int n=0; n<batch_size; n++)
+    {
+        if(!builds[n]) continue;
+        // the copy keeps the arrays, and so the cells, from changing
+        cache[n].keys = _octree_keys[n];
+        cache[n].valid = true;
+    }
+    _rulebook_ms += timer.MilliSeconds();
+    _rulebook_builds += num_builds;
+}
+
+template <typename Dtype>
+struct OGNIm2ColTask
+{
+    OGNIm2ColTask(const OctreeRulebook& rulebook, const Dtype* features, int channels, int pixels,
+                  Dtype* col_buff, int num_cols) :
+        rulebook(rulebook), features(features), channels(channels), pixels(pixels),
+        col_buff(col_buff), num_cols(num_cols) {}
+
+    void operator()(int n, int begin, int end)
+    {
+        const int nbh_count = rulebook.nbh_count;
+        for(int ch=0; ch<channels; ch++)
+        {
+            const Dtype* input = features + ch * pixels;
+            for(int el=0; el<nbh_count; el++)
+            {
+                const int* cols = rulebook.offset(el);
+                Dtype* col_row = col_buff + (ch * nbh_count + el) * num_cols;
+                for(int col=begin; col<end; col++)
+                {
+                    col_row[col] = cols[col] == -1 ? Dtype(0) : input[cols[col]];
+                }
+            }
+        }
+    }
+
+    const OctreeRulebook& rulebook;
+    const Dtype* features;
+    const int channels;
+    const int pixels;
+    Dtype* col_buff;
+    const int num_cols;
+};
+
+template <typename Dtype>
+void OGNLayer<Dtype>::im2col_rulebook_cpu(const OctreeRulebook& rulebook, const Dtype* features,
+    int channels, int pixels, Dtype* col_buff, int num_cols)
+{
+    OGNIm2ColTask<Dtype> task(rulebook, features, channels, pixels, col_buff, num_cols);
+    ogn_parallel_for_cells(std::vector<int>(1, rulebook.num_columns), task);
+}
+
+template <typename Dtype>
+struct OGNCol2ImTask
+{
+    OGNCol2ImTask(const OctreeRulebook& rulebook, const Dtype* col_buff, int num_cols,
+                  int channels, int pixels, Dtype* features) :
+        rulebook(rulebook), col_buff(col_buff), num_cols(num_cols), channels(channels),
+        pixels(pixels), features(features) {}
+
+    void operator()(int n, int begin, int end)
+    {
+        const int nbh_count = rulebook.nbh_count;
+        for(int ch=0; ch<channels; ch++)
+        {
+            Dtype* output = features + ch * pixels;
+            const Dtype* col_rows = col_buff + ch * nbh_count * num_cols;
+            for(int f=begin; f<end; f++)
+            {
+                const int* offsets = rulebook.feature_offsets(f);
+                const int* cols = rulebook.feature_columns(f);
+                Dtype sum = 0;
+                for(int r=0; r<rulebook.num_feature_rules(f); r++) sum += col_rows[offsets[r] * num_cols + cols[r]];
+                output[f] = sum;
+            }
+        }
+    }
+
+    const OctreeRulebook& rulebook;
+    const Dtype* col_buff;
+    const int num_cols;
+    const int channels;
+    const int pixels;
+    Dtype* features;
+};
+
+template <typename Dtype>
+void OGNLayer<Dtype>::col2im_rulebook_cpu(const OctreeRulebook& rulebook, const Dtype* col_buff,
+    int num_cols, int channels, int pixels, Dtype* features)
+{
+    CHECK_LE(rulebook.num_features, pixels) << "More feature cells than pixels";
+    OGNCol2ImTask<Dtype> task(rulebook, col_buff, num_cols, channels, pixels, features);
+    ogn_parallel_for_cells(std::vector<int>(1, rulebook.num_features), task);
+}
+
+INSTANTIATE_CLASS(OGNLayer);
+
+}  // namespace caffe
@@ -8,6 +8,48 @@ namespace caffe {
 
 using namespace std;
 
+/// Sets the classification targets of a range of predicted cells.
+template <typename Dtype>
+struct OGNLossPrepTask
+{
+    OGNLossPrepTask(OGNLayer<Dtype>* gt_key_layer, OGNLayer<Dtype>* pr_key_layer, bool use_voxel_grid,
+                    const Dtype* gt_values, int gt_num_pixels, Dtype* output_classification, int num_pixels) :
+        gt_key_layer(gt_key_layer), pr_key_layer(pr_key_layer), use_voxel_grid(use_voxel_grid),
+        gt_values(gt_values), gt_num_pixels(gt_num_pixels),
+        output_classification(output_classification), num_pixels(num_pixels) {}
+
+    void operator()(int bt, int begin, int end)
+    {
+        GeneralOctree<int> &pr_keys_octree = pr_key_layer->get_keys_octree(bt);
+        GeneralOctree<int> &pr_prop_octree = pr_key_layer->get_prop_octree(bt);
+        GeneralOctree<int> &gt_keys_octree = gt_key_layer->get_keys_octree(bt);
+
+        for(GeneralOctree<int>::iterator it=pr_keys_octree.begin()+begin; it!=pr_keys_octree.begin()+end; it++)
+        {
+            if(pr_prop_octree.get_value(it->first) == PROP_TRUE)
+            {
+                SignalType gt_value;
+                int gt_ind = gt_keys_octree.get_value(it->first, use_voxel_grid);
+                if(gt_ind != -1) gt_value = gt_values[bt * gt_num_pixels + gt_ind];
+                else gt_value = CLASS_MIXED;
+                output_classification[bt * num_pixels + it->second] = gt_value;
+            }
+            else
+            {
+                output_classification[bt * num_pixels + it->second] = CLASS_IGNORE;
+            }
+        }
+    }
+
+    OGNLayer<Dtype>* gt_key_layer;
+    OGNLayer<Dtype>* pr_key_layer;
+    const bool use_voxel_grid;
+    const Dtype* gt_values;
+    const int gt_num_pixels;
+    Dtype* output_classification;
+    const int num_pixels;
+};
+
 template <typename Dtype>
 void OGNLossPrepLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
@@ -58,35 +100,18 @@ void OGNLossPrepLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     const int dim = batch_size * top[0]->shape(1) * top[0]->shape(2);
     caffe_set(dim, (Dtype)CLASS_IGNORE, output_classification);
 
-    for(int bt = 0; bt<batch_size; bt++)
+    //multi-class classification
+    if(top.size() == 1)
+    {
+        vector<int> num_cells(batch_size);
+        for(int bt = 0; bt<batch_size; bt++) num_cells[bt] = pr_key_layer->get_keys_octree(bt).num_elements();
+        OGNLossPrepTask<Dtype> task(gt_key_layer.get(), pr_key_layer.get(), use_voxel_grid,
+                                    gt_values, gt_num_pixels, output_classification, num_pixels);
+        ogn_parallel_for_cells(num_cells, task);
+    }
+    //regression
+    else if(top.size() == 2)
     {
-        //multi-class classification
-        if(top.size() == 1)
-        {
-            GeneralOctree<int> &pr_keys_octree = pr_key_layer->get_keys_octree(bt);
-            GeneralOctree<int> &pr_prop_octree = pr_key_layer->get_prop_octree(bt);
-            GeneralOctree<int> &gt_keys_octree = gt_key_layer->get_keys_octree(bt);
-
-            for(GeneralOctree<int>::iterator it=pr_keys_octree.begin(); it!=pr_keys_octree.end(); it++)
-            {
-                if(pr_prop_octree.get_value(it->first) == PROP_TRUE)
-                {
-                    SignalType gt_value;
-                    int gt_ind = gt_keys_octree.get_value(it->first, use_voxel_grid);
-                    if(gt_ind != -1) gt_value = gt_values[bt * gt_num_pixels + gt_ind];
-                    else gt_value = CLASS_MIXED;
-                    output_classification[bt * num_pixels + it->second] = gt_value;
-                }
-                else
-                {
-                    output_classification[bt * num_pixels + it->second] = CLASS_IGNORE;   
-                }
-            }
-        }
-        //regression
-        else if(top.size() == 2)
-        {
-        }
     }
 }
 
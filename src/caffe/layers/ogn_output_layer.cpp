@@ -34,6 +34,7 @@ void OGNOutputLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
     for(int bt=0; bt<batch_size; bt++)
     {
         Octree octr;
+        vector<pair<KeyType, SignalType> > elements;
 
         for(int i=0; i<key_layer_size; i++)
         {   
@@ -66,9 +67,10 @@ void OGNOutputLayer<Dtype>::Reshape(const vector<Blob<Dtype>*>& bottom,
                         }
                     }
                 }
-                if(value != CLASS_MIXED) octr.add_element(it->first, value);
+                if(value != CLASS_MIXED) elements.push_back(make_pair(it->first, value));
             }
         }
+        octr.build_from_unsorted(elements);
 
         if(output_path.length() > 0)
         {
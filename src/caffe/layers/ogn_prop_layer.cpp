@@ -1,3 +1,7 @@
+#include <algorithm>
+
+#include <boost/bind.hpp>
+
 #include "caffe/net.hpp"
 #include "caffe/layers/ogn_prop_layer.hpp"
 #include "caffe/layers/ogn_conv_layer.hpp"
@@ -78,19 +82,41 @@ void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>&
 	this->_octree_prop.clear();
 
 	_num_output_pixels = 0;
-    const Dtype* input_values = bottom[1]->cpu_data();
     const int num = bottom[0]->shape(0);
-    const int pixels = bottom[0]->shape(2);
+
+    std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
+    boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
+    boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+
+    // the samples are independent
+    this->_octree_keys.resize(num);
+    this->_octree_prop.resize(num);
+    int num_cells = 0;
+    for(int bt=0; bt<num; bt++) num_cells += l_ptr->get_keys_octree(bt).num_elements();
+    ogn_parallel_for(num, num_cells,
+        boost::bind(&OGNPropLayer<Dtype>::propagate_sample_cpu, this, _1,
+            bottom[1]->cpu_data(), bottom[0]->shape(2), l_ptr.get()));
 
     for(int bt=0; bt<num; bt++)
     {
-    	int counter_top = 0;
-    	GeneralOctree<int> octree_keys;
-    	GeneralOctree<int> octree_prop;
+    	int counter_top = this->_octree_keys[bt].num_elements();
+    	if(counter_top > _num_output_pixels) _num_output_pixels = counter_top;
+    }
+}
+
+template <typename Dtype>
+void OGNPropLayer<Dtype>::propagate_sample_cpu(int bt, const Dtype* input_values, int pixels,
+      OGNLayer<Dtype>* l_ptr)
+{
+    {
+    	GeneralOctree<int>& octree_keys = this->_octree_keys[bt];
+    	GeneralOctree<int>& octree_prop = this->_octree_prop[bt];
 
-    	std::string key_layer_name = this->layer_param_.ogn_prop_param().key_layer();
-    	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
-    	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
+    	// Mixed cells (propagated) and their neighbors (context only) are collected
+    	// first and numbered afterwards in Morton order.
+    	vector<KeyType> mixed_keys;
+    	vector<KeyType> output_keys;
+    	vector<int> neighbors(_nbh_prop_size * _nbh_prop_size * _nbh_prop_size);
 
     	for(typename GeneralOctree<int>::iterator it=l_ptr->get_keys_octree(bt).begin(); it!=l_ptr->get_keys_octree(bt).end(); it++)
     	{
@@ -119,44 +145,32 @@ void OGNPropLayer<Dtype>::compute_pixel_propagation(const vector<Blob<Dtype>*>&
 
 			if(v == CLASS_MIXED)
 			{
-				Dtype empty_rate = input_values[bt * OGN_NUM_CLASSES * pixels + 0 * pixels + it->second];
-				Dtype filled_rate = input_values[bt * OGN_NUM_CLASSES * pixels + 1 * pixels + it->second];
-				Dtype mixed_rate = input_values[bt * OGN_NUM_CLASSES * pixels + 2 * pixels + it->second];
-
 				if(_nbh_prop_size > 1)
 				{
-					std::vector<KeyType> neighbors = l_ptr->get_keys_octree(bt).get_neighbor_keys(it->first, _nbh_prop_size);
+					const GeneralOctree<int>& keys_octree = l_ptr->get_keys_octree(bt);
+					keys_octree.get_neighbor_indices(it->first, _nbh_prop_size, &neighbors[0]);
 					for(int i=0; i<neighbors.size(); i++)
                     {
-                    	if(neighbors[i] != GeneralOctree<int>::INVALID_KEY())
-                        {
-                            KeyType nbh_key = neighbors[i];
-                            if(octree_keys.get_value(nbh_key) == -1)
-							{
-								octree_keys.add_element(nbh_key, counter_top);
-								octree_prop.add_element(nbh_key, PROP_FALSE);
-								counter_top++;
-							}
-                        }
+                    	if(neighbors[i] != -1) output_keys.push_back(keys_octree.keys()[neighbors[i]]);
                     }
 				}
 
-				if(octree_keys.get_value(it->first) == -1)
-				{
-					octree_keys.add_element(it->first, counter_top);
-					octree_prop.add_element(it->first, PROP_TRUE);
-					counter_top++;
-				}
-				else
-				{
-					octree_prop.add_element(it->first, PROP_TRUE);
-				}
+				mixed_keys.push_back(it->first);
+				output_keys.push_back(it->first);
 			}
     	}
 
-    	if(counter_top > _num_output_pixels) _num_output_pixels = counter_top;
-    	this->_octree_keys.push_back(octree_keys);
-    	this->_octree_prop.push_back(octree_prop);
+    	std::sort(output_keys.begin(), output_keys.end());
+    	output_keys.erase(std::unique(output_keys.begin(), output_keys.end()), output_keys.end());
+
+    	octree_keys.reserve(output_keys.size());
+    	octree_prop.reserve(output_keys.size());
+    	for(int i=0; i<output_keys.size(); i++)
+    	{
+    		bool is_mixed = std::binary_search(mixed_keys.begin(), mixed_keys.end(), output_keys[i]);
+    		octree_keys.add_element(output_keys[i], i);
+    		octree_prop.add_element(output_keys[i], is_mixed ? PROP_TRUE : PROP_FALSE);
+    	}
     }
 }
 
@@ -177,18 +191,25 @@ void OGNPropLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
     boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
     boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
 
-    for(int bt=0; bt<num; bt++)
+    vector<int> num_cells(num);
+    for(int bt=0; bt<num; bt++) num_cells[bt] = this->_octree_keys[bt].num_elements();
+    ogn_parallel_for_cells(num_cells, boost::bind(&OGNPropLayer<Dtype>::forward_cells_cpu, this,
+        _1, _2, _3, input_features, channels, input_pixels, output_features, l_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNPropLayer<Dtype>::forward_cells_cpu(int bt, int begin, int end, const Dtype* input_features,
+      int channels, int input_pixels, Dtype* output_features, OGNLayer<Dtype>* l_ptr) {
+
+    typename GeneralOctree<int>::iterator first = this->_octree_keys[bt].begin();
+    for(typename GeneralOctree<int>::iterator it=first+begin; it!=first+end; it++)
     {
-        for(typename GeneralOctree<int>::iterator it=this->_octree_keys[bt].begin(); it!=this->_octree_keys[bt].end(); it++)
+        for(int ch=0; ch<channels; ch++)
         {
-            for(int ch=0; ch<channels; ch++)
-            {
-                output_features[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second] =
-                    input_features[bt * channels * input_pixels + ch * input_pixels + l_ptr->get_keys_octree(bt).get_value(it->first)];
-            }
+            output_features[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second] =
+                input_features[bt * channels * input_pixels + ch * input_pixels + l_ptr->get_keys_octree(bt).get_value(it->first)];
         }
     }
-
 }
 
 template <typename Dtype>
@@ -208,18 +229,27 @@ void OGNPropLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
     boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(key_layer_name);
     boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
 
-    for(int bt=0; bt<num; bt++)
+    // every propagated cell has its own cell in the key layer, so the
+    // ranges write to different cells
+    vector<int> num_cells(num);
+    for(int bt=0; bt<num; bt++) num_cells[bt] = this->_octree_keys[bt].num_elements();
+    ogn_parallel_for_cells(num_cells, boost::bind(&OGNPropLayer<Dtype>::backward_cells_cpu, this,
+        _1, _2, _3, top_diff, bottom_diff, channels, pixels, l_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNPropLayer<Dtype>::backward_cells_cpu(int bt, int begin, int end, const Dtype* top_diff,
+      Dtype* bottom_diff, int channels, int pixels, OGNLayer<Dtype>* l_ptr) {
+
+    typename GeneralOctree<int>::iterator first = this->_octree_keys[bt].begin();
+    for(typename GeneralOctree<int>::iterator it=first+begin; it!=first+end; it++)
     {
-        for(typename GeneralOctree<int>::iterator it=this->_octree_keys[bt].begin(); it!=this->_octree_keys[bt].end(); it++)
+        for(int ch=0; ch<channels; ch++)
         {
-            for(int ch=0; ch<channels; ch++)
-            {
-                bottom_diff[bt * channels * pixels + ch * pixels + l_ptr->get_keys_octree(bt).get_value(it->first)] +=
-                    top_diff[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second];
-            }
+            bottom_diff[bt * channels * pixels + ch * pixels + l_ptr->get_keys_octree(bt).get_value(it->first)] +=
+                top_diff[bt * channels * _num_output_pixels + ch * _num_output_pixels + it->second];
         }
     }
-
 }
 
 INSTANTIATE_CLASS(OGNPropLayer);
@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+
 #include "caffe/layers/ogn_s2d_layer.hpp"
 #include "caffe/filler.hpp"
 #include "caffe/net.hpp"
@@ -39,8 +41,6 @@ template <typename Dtype>
 void OGNS2DLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
 
-	string prefix = "\t\tOGNS2DLayer:: Forward_cpu: \t";
-
 	this->_octree_keys.clear();
 	this->_octree_prop.clear();
 
@@ -52,26 +52,50 @@ void OGNS2DLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
 
 	memset(output_arr, 0, sizeof(Dtype) * _batch_size * _num_channels * _current_res * _current_res * _current_res);
 
-	for (int n = 0; n < _batch_size; ++n) {
-		GeneralOctree<int>* l_tree = &(l_ptr->get_keys_octree(n));
-		for (GeneralOctree<int>::iterator it=l_tree->begin(); it!=l_tree->end(); ++it) {
-			KeyType key = it->first;
-			int level = l_tree->compute_level(key);
-			if (key != GeneralOctree<int>::INVALID_KEY()) {
-				if (level == _current_level) {
-					int value_ind = l_tree->get_value(key);
-					OctreeCoord coord = l_tree->compute_coord(key);
-					for (int ch = 0; ch < _num_channels; ++ch) {
-						int left_ind = n*_num_channels*_current_res*_current_res*_current_res + 
-							ch*_current_res*_current_res*_current_res + 
-							coord.x*_current_res*_current_res + coord.y*_current_res + coord.z;
-						int right_ind = n*_num_channels*_num_pixels + ch*_num_pixels + value_ind;
-						output_arr[left_ind] = input_arr[right_ind];
-					}
-				} else {
-					CHECK(false) << prefix << " level (" << level << ") does not equal to input level (" << _current_level << ")!" << std::endl;
-				}
-			}
+	// every cell has its own voxel
+	vector<int> num_cells(_batch_size);
+	for (int n = 0; n < _batch_size; ++n) num_cells[n] = l_ptr->get_keys_octree(n).num_elements();
+	ogn_parallel_for_cells(num_cells, boost::bind(&OGNS2DLayer<Dtype>::forward_cells_cpu, this,
+		_1, _2, _3, input_arr, output_arr, l_ptr.get()));
+}
+
+/// Coordinates of the cells [begin, end) of a tree whose cells all lie on
+/// one level, decoded with the batched morton kernels.
+static void decode_cells(const GeneralOctree<int>& tree, int begin, int end, int level,
+	vector<uint32_t>& xs, vector<uint32_t>& ys, vector<uint32_t>& zs) {
+	const KeyType level_bit = KeyType(1) << 3 * level;
+	vector<KeyType> codes(end - begin);
+	for (int i = begin; i < end; ++i) codes[i - begin] = tree.keys()[i] ^ level_bit;
+	xs.resize(codes.size());
+	ys.resize(codes.size());
+	zs.resize(codes.size());
+	if (!codes.empty()) inverse_morton_3d_batch(&codes[0], &xs[0], &ys[0], &zs[0], codes.size());
+}
+
+template <typename Dtype>
+void OGNS2DLayer<Dtype>::forward_cells_cpu(int n, int begin, int end, const Dtype* input_arr,
+      Dtype* output_arr, OGNLayer<Dtype>* l_ptr) {
+	string prefix = "\t\tOGNS2DLayer:: Forward_cpu: \t";
+
+	GeneralOctree<int>* l_tree = &(l_ptr->get_keys_octree(n));
+	for (int i = begin; i < end; ++i) {
+		int level = l_tree->compute_level(l_tree->keys()[i]);
+		if (level != _current_level) {
+			CHECK(false) << prefix << " level (" << level << ") does not equal to input level (" << _current_level << ")!" << std::endl;
+		}
+	}
+
+	vector<uint32_t> xs, ys, zs;
+	decode_cells(*l_tree, begin, end, _current_level, xs, ys, zs);
+	for (int i = begin; i < end; ++i) {
+		int value_ind = l_tree->values()[i];
+		int c = i - begin;
+		for (int ch = 0; ch < _num_channels; ++ch) {
+			int left_ind = n*_num_channels*_current_res*_current_res*_current_res + 
+				ch*_current_res*_current_res*_current_res + 
+				xs[c]*_current_res*_current_res + ys[c]*_current_res + zs[c];
+			int right_ind = n*_num_channels*_num_pixels + ch*_num_pixels + value_ind;
+			output_arr[left_ind] = input_arr[right_ind];
 		}
 	}
 }
@@ -80,8 +104,6 @@ template <typename Dtype>
 void OGNS2DLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
       const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
 
-	string prefix = "OGNS2DLayer<Dtype>::Backward_cpu";
-
 	boost::shared_ptr<Layer<Dtype> > base_ptr = this->parent_net()->layer_by_name(_key_layer_name);
 	boost::shared_ptr<OGNLayer<Dtype> > l_ptr = boost::dynamic_pointer_cast<OGNLayer<Dtype> >(base_ptr);
 
@@ -90,21 +112,27 @@ void OGNS2DLayer<Dtype>::Backward_cpu(const vector<Blob<Dtype>*>& top,
 
 	memset(output_arr, 0, sizeof(Dtype) * _batch_size * _num_channels * _num_pixels);
 
-	for (int n = 0; n < _batch_size; ++n) {
-		GeneralOctree<int>* l_tree = &(l_ptr->get_keys_octree(n));
-		for (GeneralOctree<int>::iterator it=l_tree->begin(); it!=l_tree->end(); ++it) {
-			KeyType key = it->first;
-			if (key != GeneralOctree<int>::INVALID_KEY()) {
-				OctreeCoord coord = l_tree->compute_coord(key);
-				int value_ind = l_tree->get_value(key);
-				for (int ch = 0; ch < _num_channels; ++ch) {
-					int left_ind = n*_num_channels*_current_res*_current_res*_current_res + 
-						ch*_current_res*_current_res*_current_res + 
-						coord.x*_current_res*_current_res + coord.y*_current_res + coord.z;
-					int right_ind = n*_num_channels*_num_pixels + ch*_num_pixels + value_ind;
-					output_arr[right_ind] += input_arr[left_ind];
-				}
-			}
+	vector<int> num_cells(_batch_size);
+	for (int n = 0; n < _batch_size; ++n) num_cells[n] = l_ptr->get_keys_octree(n).num_elements();
+	ogn_parallel_for_cells(num_cells, boost::bind(&OGNS2DLayer<Dtype>::backward_cells_cpu, this,
+		_1, _2, _3, input_arr, output_arr, l_ptr.get()));
+}
+
+template <typename Dtype>
+void OGNS2DLayer<Dtype>::backward_cells_cpu(int n, int begin, int end, const Dtype* input_arr,
+      Dtype* output_arr, OGNLayer<Dtype>* l_ptr) {
+	GeneralOctree<int>* l_tree = &(l_ptr->get_keys_octree(n));
+	vector<uint32_t> xs, ys, zs;
+	decode_cells(*l_tree, begin, end, _current_level, xs, ys, zs);
+	for (int i = begin; i < end; ++i) {
+		int value_ind = l_tree->values()[i];
+		int c = i - begin;
+		for (int ch = 0; ch < _num_channels; ++ch) {
+			int left_ind = n*_num_channels*_current_res*_current_res*_current_res + 
+				ch*_current_res*_current_res*_current_res + 
+				xs[c]*_current_res*_current_res + ys[c]*_current_res + zs[c];
+			int right_ind = n*_num_channels*_num_pixels + ch*_num_pixels + value_ind;
+			output_arr[right_ind] += input_arr[left_ind];
 		}
 	}
 }
@@ -0,0 +1,794 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+#include "caffe/util/io.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+#include "image_tree_tools/octree_parallel.h"
+
+namespace caffe {
+
+class OctreeTest : public ::testing::Test {
+ protected:
+  static KeyType key_at(int x, int y, int z, int l) {
+    OctreeCoord c;
+    c.x = x; c.y = y; c.z = z; c.l = l;
+    return Octree::compute_key(c);
+  }
+};
+
+TEST_F(OctreeTest, TestIterationIsSorted) {
+  GeneralOctree<int> octree;
+  srand(1701);
+  for (int i = 0; i < 200; ++i) {
+    KeyType key = key_at(rand() % 8, rand() % 8, rand() % 8, 3);
+    octree.add_element(key, i);
+  }
+  KeyType prev = GeneralOctree<int>::INVALID_KEY();
+  int count = 0;
+  for (GeneralOctree<int>::iterator it = octree.begin(); it != octree.end();
+       ++it) {
+    EXPECT_GT(it->first, prev);
+    prev = it->first;
+    ++count;
+  }
+  EXPECT_EQ(octree.num_elements(), count);
+}
+
+TEST_F(OctreeTest, TestAddElementOverwrites) {
+  GeneralOctree<int> octree;
+  octree.add_element(key_at(1, 2, 3, 2), 5);
+  octree.add_element(key_at(0, 0, 0, 2), 6);
+  octree.add_element(key_at(1, 2, 3, 2), 7);
+  EXPECT_EQ(2, octree.num_elements());
+  EXPECT_EQ(7, octree.get_value(key_at(1, 2, 3, 2)));
+  EXPECT_EQ(6, octree.get_value(key_at(0, 0, 0, 2)));
+  EXPECT_EQ(-1, octree.get_value(key_at(3, 3, 3, 2)));
+}
+
+TEST_F(OctreeTest, TestGetValueFromAncestor) {
+  GeneralOctree<int> octree;
+  octree.add_element(key_at(1, 0, 1, 1), 4);
+  EXPECT_EQ(-1, octree.get_value(key_at(2, 1, 3, 2)));
+  EXPECT_EQ(4, octree.get_value(key_at(2, 1, 3, 2), true));
+}
+
+TEST_F(OctreeTest, TestBuildFromUnsorted) {
+  std::vector<std::pair<KeyType, int> > elements;
+  GeneralOctree<int> reference;
+  for (int x = 3; x >= 0; --x) {
+    for (int y = 0; y < 4; ++y) {
+      for (int z = 0; z < 4; ++z) {
+        elements.push_back(std::make_pair(key_at(x, y, z, 2), x + y + z));
+        reference.add_element(key_at(x, y, z, 2), x + y + z);
+      }
+    }
+  }
+  elements.push_back(std::make_pair(key_at(0, 0, 0, 2), 42));
+  reference.add_element(key_at(0, 0, 0, 2), 42);
+
+  GeneralOctree<int> octree;
+  octree.build_from_unsorted(elements);
+  ASSERT_EQ(reference.num_elements(), octree.num_elements());
+  EXPECT_TRUE(reference.keys() == octree.keys());
+  EXPECT_TRUE(reference.values() == octree.values());
+  EXPECT_EQ(42, octree.get_value(key_at(0, 0, 0, 2)));
+
+  GeneralOctree<int> sorted;
+  sorted.build_from_sorted(octree.keys(), octree.values());
+  EXPECT_TRUE(sorted.keys() == octree.keys());
+}
+
+TEST_F(OctreeTest, TestNeighborKeys) {
+  GeneralOctree<int> octree;
+  for (int x = 0; x < 4; ++x) {
+    for (int y = 0; y < 4; ++y) {
+      for (int z = 0; z < 4; ++z) {
+        if ((x + y + z) % 2 == 0) {
+          octree.add_element(key_at(x, y, z, 2), 0);
+        }
+      }
+    }
+  }
+  std::vector<KeyType> neighbors = octree.get_neighbor_keys(key_at(1, 1, 1, 2), 3);
+  ASSERT_EQ(27, neighbors.size());
+  int ind = 0;
+  for (int i = -1; i <= 1; ++i) {
+    for (int j = -1; j <= 1; ++j) {
+      for (int k = -1; k <= 1; ++k) {
+        KeyType expected = ((3 + i + j + k) % 2 == 0) ?
+            key_at(1 + i, 1 + j, 1 + k, 2) : GeneralOctree<int>::INVALID_KEY();
+        EXPECT_EQ(expected, neighbors[ind++]);
+      }
+    }
+  }
+}
+
+TEST_F(OctreeTest, TestNeighborKeysInMortonSpace) {
+  // dense level 2 and a sparse boundary layer at the deepest level
+  GeneralOctree<int> octree;
+  for (int x = 0; x < 4; ++x) {
+    for (int y = 0; y < 4; ++y) {
+      for (int z = 0; z < 4; ++z) {
+        if ((x * 7 + y * 3 + z) % 3) {
+          octree.add_element(key_at(x, y, z, 2), x + y + z);
+        }
+      }
+    }
+  }
+  const int top = GeneralOctree<int>::MAX_LEVEL();
+  const int res = 1 << top;
+  for (int i = 0; i < 27; ++i) {
+    octree.add_element(key_at(res - 1 - i % 3, res - 1 - (i / 3) % 3,
+        (i / 9) % 2 ? res - 1 : 0, top), i);
+  }
+
+  std::vector<KeyType> probes(octree.keys());
+  probes.push_back(key_at(0, 0, 0, 0));
+  for (int i = 0; i < probes.size(); ++i) {
+    for (int nbh_size = 2; nbh_size <= 3; ++nbh_size) {
+      std::vector<KeyType> expected =
+          octree.get_neighbor_keys(probes[i], nbh_size);
+      KeyType keys[27];
+      int indices[27];
+      int count = nbh_size == 2 ?
+          octree.get_neighbor_keys<2>(probes[i], keys) :
+          octree.get_neighbor_keys<3>(probes[i], keys);
+      octree.get_neighbor_indices(probes[i], nbh_size, indices);
+      int expected_count = 0;
+      for (int el = 0; el < expected.size(); ++el) {
+        EXPECT_EQ(expected[el], keys[el]);
+        if (expected[el] == GeneralOctree<int>::INVALID_KEY()) {
+          EXPECT_EQ(-1, indices[el]);
+        } else {
+          EXPECT_EQ(octree.get_value(expected[el]),
+              octree.values()[indices[el]]);
+          ++expected_count;
+        }
+      }
+      EXPECT_EQ(expected_count, count);
+    }
+  }
+}
+
+TEST_F(OctreeTest, TestFromVoxelGrid) {
+  // a filled box with holes; depth 12, width 10, height 16, padded to 16^3
+  VoxelGrid vg(12, 16, 10);
+  srand(1701);
+  for (int i = 0; i < 12; ++i) {
+    for (int j = 0; j < 10; ++j) {
+      for (int k = 0; k < 16; ++k) {
+        bool filled = i >= 2 && j >= 2 && k < 12 && rand() % 16;
+        vg.set_element(i, j, k, filled ? CLASS_FILLED : CLASS_EMPTY);
+      }
+    }
+  }
+  const int min_level = 2;
+  Octree octree, parallel;
+  octree.from_voxel_grid(vg, min_level);
+  parallel_from_voxel_grid(parallel, vg, min_level, 4);
+  EXPECT_EQ(4, octree.max_level());
+  EXPECT_TRUE(octree.keys() == parallel.keys());
+  EXPECT_TRUE(octree.values() == parallel.values());
+
+  // leaves cover every voxel exactly once
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 16; ++j) {
+      for (int k = 0; k < 16; ++k) {
+        SignalType expected = (i < 12 && j < 10) ?
+            vg.get_element(i, j, k) : SignalType(CLASS_EMPTY);
+        EXPECT_EQ(expected, octree.get_value(key_at(i, j, k, 4), true));
+      }
+    }
+  }
+  // no leaf above min_level, and no eight uniform siblings left unmerged
+  for (int i = 0; i < octree.num_elements(); ++i) {
+    KeyType key = octree.get_element(i).first;
+    int level = Octree::compute_level(key);
+    EXPECT_GE(level, min_level);
+    if (level > min_level && (key & 7) == 0) {
+      bool uniform = true;
+      for (int c = 0; c < 8; ++c) {
+        KeyType sibling = Octree::child_key(Octree::parent_key(key), c);
+        uniform = uniform && octree.get_value(sibling) ==
+            octree.get_element(i).second;
+      }
+      EXPECT_FALSE(uniform);
+    }
+  }
+}
+
+TEST_F(OctreeTest, TestFromBinvoxRuns) {
+  // depth 6, width 5, height 7 with runs crossing rows and the 255 limit
+  const int depth = 6, width = 5, height = 7;
+  std::vector<char> data;
+  srand(1701);
+  int total = 0;
+  while (total < depth * width * height) {
+    int count = std::min(rand() % 3 ? rand() % 12 + 1 : 255,
+        depth * width * height - total);
+    data.push_back(rand() % 2);
+    data.push_back(count);
+    total += count;
+  }
+  string file_name;
+  MakeTempFilename(&file_name);
+  std::ofstream out(file_name.c_str(), std::ios::binary);
+  out << "#binvox 1\ndim " << depth << " " << height << " " << width
+      << "\ntranslate 0 0 0\nscale 1\ndata\n";
+  out.write(&data[0], data.size());
+  out.close();
+
+  VoxelGrid vg;
+  RunLengthVoxelGrid runs;
+  ASSERT_TRUE(vg.read_binvox(file_name));
+  ASSERT_TRUE(runs.read_binvox(file_name));
+  EXPECT_EQ(height, vg.height());
+  EXPECT_EQ(width, runs.width());
+  for (int i = 0; i < depth; ++i) {
+    for (int j = 0; j < width; ++j) {
+      for (int k = 0; k < height; ++k) {
+        EXPECT_EQ(vg.get_element(i, j, k), runs.get_element(i, j, k));
+      }
+    }
+  }
+
+  for (int min_level = 0; min_level <= 3; ++min_level) {
+    Octree dense, streamed;
+    dense.from_voxel_grid(vg, min_level);
+    parallel_from_run_length_grid(streamed, runs, min_level, 2);
+    EXPECT_EQ(dense.max_level(), streamed.max_level());
+    EXPECT_TRUE(dense.keys() == streamed.keys());
+    EXPECT_TRUE(dense.values() == streamed.values());
+  }
+}
+
+TEST_F(OctreeTest, TestToVoxelGrid) {
+  VoxelGrid vg(16, 16, 16);
+  srand(1701);
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 16; ++j) {
+      for (int k = 0; k < 16; ++k) {
+        bool filled = (i < 8 && j >= 8) || (k > 4 && rand() % 8 == 0);
+        vg.set_element(i, j, k, filled ? CLASS_FILLED : CLASS_EMPTY);
+      }
+    }
+  }
+  Octree octree;
+  octree.from_voxel_grid(vg, 1);
+
+  GeneralVoxelGrid<SignalType> serial = octree.to_voxel_grid();
+  VoxelGrid parallel = parallel_to_voxel_grid(octree, 3);
+  ASSERT_EQ(16, serial.depth());
+  ASSERT_EQ(16, parallel.height());
+  for (int i = 0; i < 16; ++i) {
+    for (int j = 0; j < 16; ++j) {
+      for (int k = 0; k < 16; ++k) {
+        EXPECT_EQ(vg.get_element(i, j, k), serial.get_element(i, j, k));
+        EXPECT_EQ(vg.get_element(i, j, k), parallel.get_element(i, j, k));
+      }
+    }
+  }
+
+  string file_name;
+  MakeTempFilename(&file_name);
+  ASSERT_TRUE(parallel.write_binvox(file_name));
+  VoxelGrid from_file;
+  ASSERT_TRUE(from_file.read_binvox(file_name));
+  ASSERT_EQ(16, from_file.width());
+  EXPECT_EQ(0, memcmp(vg.data(), from_file.data(), vg.size()));
+}
+
+TEST_F(OctreeTest, TestFileRoundTrip) {
+  Octree octree;
+  octree.add_element(key_at(0, 0, 0, 1), CLASS_EMPTY);
+  octree.add_element(key_at(1, 1, 1, 1), CLASS_FILLED);
+  for (int i = 0; i < 8; ++i) {
+    octree.add_element(key_at(i & 1, (i >> 1) & 1, i >> 2, 2), i % 2);
+  }
+  for (int i = 0; i < 8; ++i) {
+    octree.add_element(key_at(2 + (i & 1), (i >> 1) & 1, 2 + (i >> 2), 3),
+        CLASS_FILLED);
+  }
+
+  string binary_file, text_file;
+  MakeTempFilename(&binary_file);
+  MakeTempFilename(&text_file);
+  octree.to_file(binary_file);
+  octree.to_text_file(text_file);
+
+  Octree from_binary, from_text;
+  from_binary.from_file(binary_file);
+  from_text.from_file(text_file);
+  EXPECT_TRUE(octree.keys() == from_binary.keys());
+  EXPECT_TRUE(octree.values() == from_binary.values());
+  EXPECT_TRUE(octree.keys() == from_text.keys());
+  EXPECT_TRUE(octree.values() == from_text.values());
+  EXPECT_EQ(3, from_binary.max_level());
+  EXPECT_EQ(3, from_text.max_level());
+}
+
+TEST_F(OctreeTest, TestMorton64RoundTrip) {
+  typedef GeneralOctree<int, uint64_t> Octree64;
+  EXPECT_EQ(21, Octree64::MAX_LEVEL());
+  srand(1701);
+  for (int i = 0; i < 1000; ++i) {
+    OctreeCoord c;
+    c.l = rand() % (Octree64::MAX_LEVEL() + 1);
+    c.x = (int64_t(rand()) * rand()) & ((1 << c.l) - 1);
+    c.y = (int64_t(rand()) * rand()) & ((1 << c.l) - 1);
+    c.z = (int64_t(rand()) * rand()) & ((1 << c.l) - 1);
+    uint64_t key = Octree64::compute_key(c);
+    EXPECT_TRUE(Octree64::IS_VALID_KEY(key));
+    EXPECT_EQ(c.l, Octree64::compute_level(key));
+    OctreeCoord d = Octree64::compute_coord(key);
+    EXPECT_EQ(c.x, d.x);
+    EXPECT_EQ(c.y, d.y);
+    EXPECT_EQ(c.z, d.z);
+    if (c.l < 10) {
+      // 32-bit and 64-bit keys agree numerically on shallow levels
+      EXPECT_EQ(uint64_t(GeneralOctree<int, uint32_t>::compute_key(c)), key);
+    }
+    if (c.l > 0) {
+      EXPECT_EQ(c.l - 1, Octree64::compute_level(Octree64::parent_key(key)));
+    }
+    if (c.l < Octree64::MAX_LEVEL()) {
+      EXPECT_EQ(key, Octree64::parent_key(Octree64::child_key(key, 5)));
+    }
+  }
+}
+
+TEST_F(OctreeTest, TestLoadAcrossKeyWidths) {
+  GeneralOctree<int, uint32_t> octree32;
+  for (int i = 0; i < 64; ++i) {
+    OctreeCoord c;
+    c.x = i & 3; c.y = (i >> 2) & 3; c.z = i >> 4; c.l = 2;
+    octree32.add_element(GeneralOctree<int, uint32_t>::compute_key(c), i);
+  }
+  string file_name;
+  MakeTempFilename(&file_name);
+  octree32.to_file(file_name);
+
+  GeneralOctree<int, uint64_t> octree64;
+  octree64.from_file(file_name);
+  ASSERT_EQ(octree32.num_elements(), octree64.num_elements());
+  for (int i = 0; i < octree32.num_elements(); ++i) {
+    EXPECT_EQ(uint64_t(octree32.get_element(i).first),
+        octree64.get_element(i).first);
+    EXPECT_EQ(octree32.get_element(i).second, octree64.get_element(i).second);
+  }
+
+  // keys below level 10 do not fit into 32 bits and are rejected
+  OctreeCoord deep;
+  deep.x = 1; deep.y = 2; deep.z = 3; deep.l = 15;
+  octree64.add_element(GeneralOctree<int, uint64_t>::compute_key(deep), 1);
+  octree64.to_file(file_name);
+  GeneralOctree<int, uint32_t> narrowed;
+  narrowed.from_file(file_name);
+  EXPECT_EQ(0, narrowed.num_elements());
+}
+
+TEST_F(OctreeTest, TestDatasetPack) {
+  // models of different depths; the second one is added as raw .ot bytes
+  vector<Octree> models(3);
+  for (int m = 0; m < 3; ++m) {
+    const int dim = 4 << m;
+    VoxelGrid vg(dim, dim, dim);
+    for (int i = 0; i < dim; ++i) {
+      for (int j = 0; j < dim; ++j) {
+        for (int k = 0; k < dim; ++k) {
+          vg.set_element(i, j, k, (i + j * (m + 1)) % 3 == 0 || k < 2 ?
+              CLASS_FILLED : CLASS_EMPTY);
+        }
+      }
+    }
+    models[m].from_voxel_grid(vg, 0);
+  }
+
+  string pack_file;
+  MakeTempFilename(&pack_file);
+  OctreePackWriter writer;
+  ASSERT_TRUE(writer.open(pack_file, models.size()));
+  EXPECT_TRUE(writer.add(models[0]));
+  vector<char> buffer;
+  models[1].to_buffer(buffer);
+  EXPECT_TRUE(writer.add(&buffer[0], buffer.size()));
+  EXPECT_TRUE(writer.add(models[2]));
+  EXPECT_FALSE(writer.add(models[2]));
+  ASSERT_TRUE(writer.close());
+  EXPECT_TRUE(is_octree_pack(pack_file));
+
+  OctreePack pack;
+  ASSERT_TRUE(pack.open(pack_file));
+  ASSERT_EQ(models.size(), pack.size());
+  // random access, last model first
+  for (int m = 2; m >= 0; --m) {
+    const OctreePackEntry& entry = pack.entry(m);
+    EXPECT_EQ(0, entry.offset % 8);
+    EXPECT_EQ(models[m].num_elements(), entry.num_cells);
+    EXPECT_EQ(models[m].max_level(), entry.max_level);
+    vector<uint64_t> level_cells(OCTREE_PACK_LEVELS, 0);
+    for (int i = 0; i < models[m].num_elements(); ++i) {
+      level_cells[Octree::compute_level(models[m].get_element(i).first)]++;
+    }
+    uint64_t cells = 0;
+    for (int l = 0; l < OCTREE_PACK_LEVELS; ++l) {
+      EXPECT_EQ(level_cells[l], entry.level_cells[l]);
+      cells += entry.level_cells[l];
+    }
+    EXPECT_EQ(entry.num_cells, cells);
+
+    Octree loaded;
+    ASSERT_TRUE(pack.load(m, loaded));
+    EXPECT_TRUE(models[m].keys() == loaded.keys());
+    EXPECT_TRUE(models[m].values() == loaded.values());
+    EXPECT_EQ(models[m].max_level(), loaded.max_level());
+  }
+  Octree missing;
+  EXPECT_FALSE(pack.load(3, missing));
+
+  // counts and offsets that would wrap around the bounds checks
+  std::ifstream in(pack_file.c_str(), std::ios::binary);
+  const string bytes((std::istreambuf_iterator<char>(in)),
+      std::istreambuf_iterator<char>());
+  in.close();
+  for (int c = 0; c < 2; ++c) {
+    string corrupt = bytes;
+    OctreePackHeader header;
+    memcpy(&header, corrupt.data(), sizeof(header));
+    OctreePackEntry entry;
+    memcpy(&entry, corrupt.data() + sizeof(header), sizeof(entry));
+    if (c == 0) {
+      header.num_models = (uint64_t(1) << 63) / sizeof(OctreePackEntry) * 2 + 1;
+    } else {
+      entry.offset = ~uint64_t(0) - 7;
+      entry.length = 16;
+    }
+    memcpy(&corrupt[0], &header, sizeof(header));
+    memcpy(&corrupt[sizeof(header)], &entry, sizeof(entry));
+    string corrupt_file;
+    MakeTempFilename(&corrupt_file);
+    std::ofstream(corrupt_file.c_str(), std::ios::binary) << corrupt;
+    OctreePack corrupt_pack;
+    EXPECT_FALSE(corrupt_pack.open(corrupt_file));
+    EXPECT_EQ(0, corrupt_pack.size());
+  }
+
+  // a pack with fewer models than announced is not finished
+  OctreePackWriter incomplete;
+  ASSERT_TRUE(incomplete.open(pack_file, 2));
+  EXPECT_TRUE(incomplete.add(models[0]));
+  EXPECT_FALSE(incomplete.close());
+  EXPECT_FALSE(pack.open(pack_file));
+}
+
+TEST_F(OctreeTest, TestCompactStore) {
+  // an occupancy octree, one with three classes and one with wide values
+  vector<Octree> models(4);
+  VoxelGrid vg(32, 32, 32);
+  for (int i = 0; i < 32; ++i) {
+    for (int j = 0; j < 32; ++j) {
+      for (int k = 0; k < 32; ++k) {
+        vg.set_element(i, j, k, (i - 16) * (i - 16) + (j - 16) * (j - 16) +
+            (k - 16) * (k - 16) < 150 ? CLASS_FILLED : CLASS_EMPTY);
+      }
+    }
+  }
+  models[0].from_voxel_grid(vg, 0);
+  srand(1701);
+  for (int i = 0; i < 300; ++i) {
+    KeyType key = key_at(rand() % 16, rand() % 16, rand() % 16, 4);
+    models[1].add_element(key, rand() % 3);
+    models[2].add_element(key, rand() % 256);
+  }
+  models[2].set_max_level(6);
+
+  CompactOctreeStore<KeyType> store;
+  store.resize(models.size());
+  for (int m = 0; m < 3; ++m) {
+    vector<unsigned char> record;
+    CompactOctreeStore<KeyType>::encode(models[m], record);
+    store.insert(m, record);
+  }
+  EXPECT_FALSE(store.contains(3));
+  // sorted occupancy keys take well under the 5 bytes of a raw cell
+  EXPECT_LT(store.bytes(), 2 * (models[0].num_elements() +
+      models[1].num_elements()) + models[2].num_elements() * 3);
+
+  size_t cells = 0;
+  for (int m = 0; m < 3; ++m) {
+    Octree decoded;
+    store.decode(m, decoded);
+    EXPECT_TRUE(models[m].keys() == decoded.keys());
+    EXPECT_TRUE(models[m].values() == decoded.values());
+    EXPECT_EQ(models[m].max_level(), decoded.max_level());
+    cells += models[m].num_elements();
+  }
+  EXPECT_EQ(cells, store.num_cells());
+}
+
+// Fills a claimed segment after a while, holding the creator's lock.
+struct PublishLater {
+  explicit PublishLater(SharedImage& image) : image(image) {}
+  void operator()() {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+    memcpy(image.allocate(4), "data", 4);
+    image.publish();
+  }
+
+  SharedImage& image;
+};
+
+TEST_F(OctreeTest, TestSharedImage) {
+  std::ostringstream name;
+  name << "/octree_test_" << getpid();
+  shm_unlink(name.str().c_str());
+
+  // an empty segment, as left by a creator that died before locking it
+  int fd = shm_open(name.str().c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  SharedImage image;
+  EXPECT_EQ(SharedImage::STALE, image.attach(name.str(), 300));
+  EXPECT_FALSE(image.claim(name.str()));
+  EXPECT_EQ(0, shm_unlink(name.str().c_str()));
+
+  // a locked segment is waited for, however long it takes
+  SharedImage creator;
+  ASSERT_TRUE(creator.claim(name.str()));
+  PublishLater publish(creator);
+  boost::thread publisher(publish);
+  EXPECT_EQ(SharedImage::ATTACHED, image.attach(name.str(), 200));
+  publisher.join();
+  ASSERT_EQ(4, image.size());
+  EXPECT_EQ(0, memcmp(image.data(), "data", 4));
+  EXPECT_EQ(0, shm_unlink(name.str().c_str()));
+}
+
+TEST_F(OctreeTest, TestSharedArrays) {
+  Octree tree;
+  for (int i = 0; i < 8; ++i) {
+    tree.add_element(key_at(i & 1, (i >> 1) & 1, i >> 2, 1), i % 2);
+  }
+
+  // copies share the arrays until one of them is changed
+  Octree copy = tree;
+  EXPECT_EQ(&tree.keys(), &copy.keys());
+  EXPECT_EQ(&tree.values(), &copy.values());
+  copy.add_element(tree.keys()[3], CLASS_MIXED);
+  EXPECT_NE(&tree.values(), &copy.values());
+  EXPECT_EQ(3 % 2, tree.get_element(3).second);
+  EXPECT_EQ(CLASS_MIXED, copy.get_element(3).second);
+
+  // a column octree reuses the key array of its model
+  vector<int> columns(tree.num_elements());
+  for (int i = 0; i < columns.size(); ++i) columns[i] = i;
+  GeneralOctree<int> column_octree;
+  column_octree.build_from_keys(tree, columns);
+  EXPECT_TRUE(columns.empty());
+  EXPECT_EQ(&tree.keys(), &column_octree.keys());
+  EXPECT_EQ(tree.max_level(), column_octree.max_level());
+  for (int i = 0; i < tree.num_elements(); ++i) {
+    EXPECT_EQ(i, column_octree.get_value(tree.keys()[i]));
+  }
+
+  tree.clear();
+  EXPECT_EQ(0, tree.num_elements());
+  EXPECT_EQ(8, column_octree.num_elements());
+}
+
+TEST_F(OctreeTest, TestRulebook) {
+  // a sparse level 3 feature map with shuffled columns, and its parents
+  GeneralOctree<int> cells, parents;
+  std::vector<KeyType> parent_keys;
+  srand(1701);
+  for (int i = 0; i < 512; ++i) {
+    if (rand() % 3) continue;
+    const KeyType key = key_at(i & 7, (i >> 3) & 7, i >> 6, 3);
+    cells.add_element(key, 0);
+    parent_keys.push_back(GeneralOctree<int>::parent_key(key));
+  }
+  std::vector<int> columns(cells.num_elements());
+  for (int i = 0; i < columns.size(); ++i) columns[i] = i;
+  std::random_shuffle(columns.begin(), columns.end());
+  GeneralOctree<int> column_octree;
+  column_octree.build_from_keys(cells, columns);
+  std::sort(parent_keys.begin(), parent_keys.end());
+  parent_keys.erase(std::unique(parent_keys.begin(), parent_keys.end()),
+      parent_keys.end());
+  for (int i = 0; i < parent_keys.size(); ++i) {
+    parents.add_element(parent_keys[i], parent_keys.size() - 1 - i);
+  }
+
+  for (int filter_size = 2; filter_size <= 3; ++filter_size) {
+    OctreeRulebook conv, down;
+    build_octree_rulebook(column_octree, column_octree, 0, filter_size, conv);
+    build_octree_rulebook(parents, column_octree, 3, filter_size, down);
+    EXPECT_EQ(column_octree.num_elements(), conv.num_columns);
+    EXPECT_EQ(parents.num_elements(), down.num_columns);
+
+    int indices[27];
+    for (GeneralOctree<int>::iterator it = column_octree.begin();
+         it != column_octree.end(); ++it) {
+      column_octree.get_neighbor_indices(it->first, filter_size, indices);
+      for (int el = 0; el < conv.nbh_count; ++el) {
+        EXPECT_EQ(indices[el] == -1 ? -1 : column_octree.values()[indices[el]],
+            conv.offset(el)[it->second]);
+      }
+    }
+    for (GeneralOctree<int>::iterator it = parents.begin();
+         it != parents.end(); ++it) {
+      column_octree.get_neighbor_indices(it->first << 3, filter_size, indices);
+      for (int el = 0; el < down.nbh_count; ++el) {
+        EXPECT_EQ(indices[el] == -1 ? -1 : column_octree.values()[indices[el]],
+            down.offset(el)[it->second]);
+      }
+    }
+
+    // the rules are the valid entries of each offset, in column order
+    for (int el = 0; el < conv.nbh_count; ++el) {
+      std::vector<int> rule_columns, rule_neighbors;
+      for (int col = 0; col < conv.num_columns; ++col) {
+        if (conv.offset(el)[col] == -1) continue;
+        rule_columns.push_back(col);
+        rule_neighbors.push_back(conv.offset(el)[col]);
+      }
+      ASSERT_EQ(rule_columns.size(), conv.num_rules(el));
+      for (int r = 0; r < conv.num_rules(el); ++r) {
+        EXPECT_EQ(rule_columns[r], conv.rule_columns(el)[r]);
+        EXPECT_EQ(rule_neighbors[r], conv.rule_neighbors(el)[r]);
+      }
+    }
+
+    // and by feature column, the same rules in offset order
+    ASSERT_EQ(column_octree.num_elements(), conv.num_features);
+    for (int f = 0; f < conv.num_features; ++f) {
+      std::vector<int> feature_offsets, feature_columns;
+      for (int el = 0; el < conv.nbh_count; ++el) {
+        for (int col = 0; col < conv.num_columns; ++col) {
+          if (conv.offset(el)[col] != f) continue;
+          feature_offsets.push_back(el);
+          feature_columns.push_back(col);
+        }
+      }
+      ASSERT_EQ(feature_offsets.size(), conv.num_feature_rules(f));
+      for (int r = 0; r < conv.num_feature_rules(f); ++r) {
+        EXPECT_EQ(feature_offsets[r], conv.feature_offsets(f)[r]);
+        EXPECT_EQ(feature_columns[r], conv.feature_columns(f)[r]);
+      }
+    }
+
+    // rows filled in ranges give the same rulebook
+    OctreeRulebook ranges;
+    const int half = parents.num_elements() / 2;
+    init_octree_rulebook(parents, column_octree, filter_size, ranges);
+    fill_octree_rulebook(parents, column_octree, 3, filter_size, half,
+        parents.num_elements(), ranges);
+    fill_octree_rulebook(parents, column_octree, 3, filter_size, 0, half,
+        ranges);
+    finish_octree_rulebook(ranges);
+    EXPECT_TRUE(ranges.columns == down.columns);
+    EXPECT_TRUE(ranges.rule_column == down.rule_column);
+    EXPECT_TRUE(ranges.feature_begin == down.feature_begin);
+    EXPECT_TRUE(ranges.feature_column == down.feature_column);
+  }
+
+  // a copy pins the arrays, so equal arrays mean equal cells
+  GeneralOctree<int> pinned = column_octree;
+  EXPECT_TRUE(pinned.shares_arrays(column_octree));
+  column_octree.add_element(cells.keys()[0], -1);
+  EXPECT_FALSE(pinned.shares_arrays(column_octree));
+}
+
+TEST_F(OctreeTest, TestMortonTransform) {
+  // an off-centre ellipsoid, so no symmetry maps it onto itself
+  VoxelGrid vg(32, 32, 32);
+  for (int i = 0; i < 32; ++i) {
+    for (int j = 0; j < 32; ++j) {
+      for (int k = 0; k < 32; ++k) {
+        vg.set_element(i, j, k, (i - 10) * (i - 10) + 4 * (j - 14) * (j - 14) +
+            9 * (k - 19) * (k - 19) < 120 ? CLASS_FILLED : CLASS_EMPTY);
+      }
+    }
+  }
+  Octree tree;
+  tree.from_voxel_grid(vg, 0);
+
+  const int perms[6][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0},
+      {2, 0, 1}, {2, 1, 0}};
+  for (int p = 0; p < 6; ++p) {
+    for (int flips = 0; flips < 8; ++flips) {
+      OctreeTransform t;
+      for (int a = 0; a < 3; ++a) {
+        t.perm[a] = perms[p][a];
+        t.flip[a] = (flips >> a) & 1;
+      }
+      Octree transformed = tree;
+      transform_octree(transformed, t);
+      ASSERT_EQ(tree.num_elements(), transformed.num_elements());
+      EXPECT_EQ(tree.max_level(), transformed.max_level());
+      for (int i = 1; i < transformed.num_elements(); ++i) {
+        ASSERT_LT(transformed.keys()[i - 1], transformed.keys()[i]);
+      }
+
+      for (int i = 0; i < tree.num_elements(); ++i) {
+        OctreeCoord c = Octree::compute_coord(tree.keys()[i]);
+        const int coords[3] = {c.x, c.y, c.z};
+        const int res = 1 << c.l;
+        int out[3];
+        for (int a = 0; a < 3; ++a) {
+          out[a] = t.flip[a] ? res - 1 - coords[t.perm[a]] : coords[t.perm[a]];
+        }
+        EXPECT_EQ(tree.values()[i], transformed.get_value(
+            key_at(out[0], out[1], out[2], c.l)));
+      }
+    }
+  }
+}
+
+TEST_F(OctreeTest, TestTruncateLevels) {
+  VoxelGrid vg(32, 32, 32);
+  for (int i = 0; i < 32; ++i) {
+    for (int j = 0; j < 32; ++j) {
+      for (int k = 0; k < 32; ++k) {
+        vg.set_element(i, j, k, (i - 12) * (i - 12) + (j - 17) * (j - 17) +
+            (k - 15) * (k - 15) < 90 ? CLASS_FILLED : CLASS_EMPTY);
+      }
+    }
+  }
+  Octree tree;
+  tree.from_voxel_grid(vg, 0);
+  ASSERT_EQ(5, tree.max_level());
+
+  vector<char> buffer;
+  tree.to_buffer(buffer);
+  CompactOctreeStore<KeyType> store;
+  store.resize(1);
+  vector<unsigned char> record;
+  CompactOctreeStore<KeyType>::encode(tree, record);
+  store.insert(0, record);
+
+  for (int level = 0; level <= 5; ++level) {
+    // every finer cell collapses into its ancestor on the level, which is
+    // mixed, as the octree merges uniform blocks
+    std::map<KeyType, SignalType> expected;
+    for (int i = 0; i < tree.num_elements(); ++i) {
+      const KeyType key = tree.keys()[i];
+      const int l = Octree::compute_level(key);
+      if (l <= level) {
+        expected[key] = tree.values()[i];
+      } else {
+        expected[key >> 3 * (l - level)] = CLASS_MIXED;
+      }
+    }
+
+    vector<Octree> truncated(3);
+    truncated[0] = tree;
+    truncated[0].truncate(level, CLASS_MIXED);
+    ASSERT_TRUE(truncated[1].from_buffer(&buffer[0], buffer.size(), level,
+        CLASS_MIXED));
+    store.decode(0, truncated[2], level, CLASS_MIXED);
+    for (int t = 0; t < truncated.size(); ++t) {
+      EXPECT_EQ(level, truncated[t].max_level());
+      ASSERT_EQ(expected.size(), truncated[t].num_elements());
+      int i = 0;
+      for (std::map<KeyType, SignalType>::iterator it = expected.begin();
+           it != expected.end(); ++it, ++i) {
+        EXPECT_EQ(it->first, truncated[t].keys()[i]);
+        EXPECT_EQ(it->second, truncated[t].values()[i]);
+      }
+    }
+  }
+}
+
+}  // namespace caffe
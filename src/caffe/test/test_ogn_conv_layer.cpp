@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class OGNConvLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  // Dense keys at level 2, upsampled twice; the propagation in between
+  // keeps a sparse set of cells so that many rulebook entries are empty.
+  shared_ptr<Net<Dtype> > MakeNet(const string& engine, bool fuse_batch) {
+    const string fuse = fuse_batch ? "fuse_batch: true " : "";
+    const string conv_param =
+        "engine: " + engine + " " + fuse +
+        "weight_filler { type: 'gaussian' std: 0.3 } "
+        "bias_filler { type: 'gaussian' std: 0.3 } ";
+    const string proto =
+        "layer { name: 'dense' type: 'DummyData' top: 'dense' top: 'labels' "
+        "  dummy_data_param { shape { dim: 2 dim: 3 dim: 4 dim: 4 dim: 4 } "
+        "                     shape { dim: 2 dim: 512 } } } "
+        "layer { name: 'keys' type: 'OGNGenerateKeys' bottom: 'dense' } "
+        "layer { name: 'r' type: 'Reshape' bottom: 'dense' top: 'x' "
+        "  reshape_param { shape { dim: 0 dim: 0 dim: -1 } } } "
+        "layer { name: 'deconv1' type: 'OGNConv' bottom: 'x' top: 'u' "
+        "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: 4 "
+        "                   key_layer: 'keys' " + conv_param + "} } "
+        "layer { name: 'prop' type: 'OGNProp' bottom: 'u' bottom: 'labels' "
+        "  top: 'p' ogn_prop_param { key_layer: 'deconv1' prop_mode: PROP_KNOWN } } "
+        "layer { name: 'deconv2' type: 'OGNConv' bottom: 'p' top: 'v' "
+        "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: 3 "
+        "                   key_layer: 'prop' " + conv_param + "} } "
+        "layer { name: 'conv' type: 'OGNConv' bottom: 'v' top: 'w' "
+        "  ogn_conv_param { filter_size: 3 output_channels: 2 "
+        "                   key_layer: 'deconv2' " + conv_param + "} } "
+        "layer { name: 'down' type: 'OGNDownConv' bottom: 'w' top: 'd' "
+        "  ogn_down_conv_param { output_channels: 2 key_layer: 'deconv2' " + fuse +
+        "    weight_filler { type: 'gaussian' std: 0.3 } "
+        "    bias_filler { type: 'gaussian' std: 0.3 } } } "
+        "layer { name: 'loss' type: 'Reduction' bottom: 'd' top: 'loss' "
+        "  reduction_param { operation: SUMSQ } loss_weight: 1 } ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    param.mutable_state()->set_phase(TRAIN);
+
+    Caffe::set_random_seed(1701);
+    shared_ptr<Net<Dtype> > net(new Net<Dtype>(param));
+    Blob<Dtype>* dense = net->blob_by_name("dense").get();
+    for (int i = 0; i < dense->count(); ++i) {
+      dense->mutable_cpu_data()[i] = std::sin(Dtype(i));
+    }
+    Blob<Dtype>* labels = net->blob_by_name("labels").get();
+    for (int i = 0; i < labels->count(); ++i) {
+      labels->mutable_cpu_data()[i] = i % 37 == 5 ?
+          CLASS_MIXED : CLASS_EMPTY;
+    }
+    return net;
+  }
+
+  // Predictions at levels 2 and 3 that are cut to their filled cells and
+  // concatenated, next to a dense copy and the loss targets of level 3.
+  shared_ptr<Net<Dtype> > MakeLevelNet() {
+    const string fillers =
+        "weight_filler { type: 'gaussian' std: 0.3 } "
+        "bias_filler { type: 'gaussian' std: 0.3 } ";
+    const string proto =
+        "layer { name: 'dense' type: 'DummyData' top: 'dense' top: 'labels' "
+        "  dummy_data_param { shape { dim: 2 dim: 3 dim: 4 dim: 4 dim: 4 } "
+        "                     shape { dim: 2 dim: 512 } } } "
+        "layer { name: 'keys' type: 'OGNGenerateKeys' bottom: 'dense' } "
+        "layer { name: 'r' type: 'Reshape' bottom: 'dense' top: 'x' "
+        "  reshape_param { shape { dim: 0 dim: 0 dim: -1 } } } "
+        "layer { name: 'conv' type: 'OGNConv' bottom: 'x' top: 'y' "
+        "  ogn_conv_param { filter_size: 3 output_channels: 3 "
+        "                   key_layer: 'keys' " + fillers + "} } "
+        "layer { name: 'deconv' type: 'OGNConv' bottom: 'x' top: 'u' "
+        "  ogn_conv_param { is_deconv: true filter_size: 2 output_channels: 3 "
+        "                   key_layer: 'keys' " + fillers + "} } "
+        "layer { name: 'pred2' type: 'OGNLevelPred' bottom: 'y' top: 'f2' "
+        "  ogn_level_pred_param { key_layer: 'conv' } } "
+        "layer { name: 'pred3' type: 'OGNLevelPred' bottom: 'u' top: 'f3' "
+        "  ogn_level_pred_param { key_layer: 'deconv' } } "
+        "layer { name: 'concat' type: 'OGNConcat' bottom: 'f2' bottom: 'f3' "
+        "  top: 'f' ogn_concat_param { key1_layer: 'pred2' key2_layer: 'pred3' } } "
+        "layer { name: 's2d' type: 'OGNS2D' bottom: 'u' top: 's' "
+        "  ogn_s2d_param { key_layer: 'deconv' level: 3 } } "
+        "layer { name: 'prep' type: 'OGNLossPrep' bottom: 'u' bottom: 'labels' "
+        "  top: 'targets' ogn_loss_prep_param { gt_key_layer: 'deconv' "
+        "                                       pr_key_layer: 'deconv' } } "
+        "layer { name: 'loss_f' type: 'Reduction' bottom: 'f' top: 'loss_f' "
+        "  reduction_param { operation: SUMSQ } loss_weight: 1 } "
+        "layer { name: 'loss_s' type: 'Reduction' bottom: 's' top: 'loss_s' "
+        "  reduction_param { operation: SUMSQ } loss_weight: 1 } ";
+    NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    param.mutable_state()->set_phase(TRAIN);
+
+    Caffe::set_random_seed(1701);
+    shared_ptr<Net<Dtype> > net(new Net<Dtype>(param));
+    Blob<Dtype>* dense = net->blob_by_name("dense").get();
+    for (int i = 0; i < dense->count(); ++i) {
+      dense->mutable_cpu_data()[i] = std::sin(Dtype(i));
+    }
+    Blob<Dtype>* labels = net->blob_by_name("labels").get();
+    for (int i = 0; i < labels->count(); ++i) {
+      labels->mutable_cpu_data()[i] = i % 3;
+    }
+    return net;
+  }
+
+  void ExpectNear(const Blob<Dtype>& expected, const Blob<Dtype>& actual,
+      bool diff, Dtype tolerance) {
+    ASSERT_EQ(expected.count(), actual.count());
+    const Dtype* e = diff ? expected.cpu_diff() : expected.cpu_data();
+    const Dtype* a = diff ? actual.cpu_diff() : actual.cpu_data();
+    for (int i = 0; i < expected.count(); ++i) {
+      if (tolerance == 0) {
+        EXPECT_EQ(e[i], a[i]);
+      } else {
+        EXPECT_NEAR(e[i], a[i], tolerance * std::max(Dtype(1), std::fabs(e[i])));
+      }
+    }
+  }
+
+  // Same weights and cells, so the nets differ only in summation order.
+  void ExpectSameNets(Net<Dtype>& expected, Net<Dtype>& actual) {
+    expected.Forward();
+    actual.Forward();
+    expected.Backward();
+    actual.Backward();
+    ExpectSameBlobs(expected, actual, 1e-4);
+  }
+
+  void ExpectSameBlobs(const Net<Dtype>& expected, const Net<Dtype>& actual,
+      Dtype tolerance) {
+    // the propagation leaves out most cells
+    const int cells = expected.blob_by_name("p")->shape(2);
+    EXPECT_GT(cells, 0);
+    EXPECT_LT(cells, 512);
+
+    const char* blobs[] = {"u", "p", "v", "w", "d"};
+    for (int i = 0; i < 5; ++i) {
+      ExpectNear(*expected.blob_by_name(blobs[i]),
+          *actual.blob_by_name(blobs[i]), false, tolerance);
+    }
+    const char* diffs[] = {"u", "p", "v", "w"};
+    for (int i = 0; i < 4; ++i) {
+      ExpectNear(*expected.blob_by_name(diffs[i]),
+          *actual.blob_by_name(diffs[i]), true, tolerance);
+    }
+    const char* layers[] = {"deconv1", "deconv2", "conv", "down"};
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 2; ++j) {
+        ExpectNear(*expected.layer_by_name(layers[i])->blobs()[j],
+            *actual.layer_by_name(layers[i])->blobs()[j], true, tolerance);
+      }
+    }
+  }
+};
+
+TYPED_TEST_CASE(OGNConvLayerTest, TestDtypes);
+
+TYPED_TEST(OGNConvLayerTest, TestGatherScatterEngine) {
+  shared_ptr<Net<TypeParam> > im2col = this->MakeNet("IM2COL", false);
+  shared_ptr<Net<TypeParam> > gather = this->MakeNet("GATHER_SCATTER", false);
+  this->ExpectSameNets(*im2col, *gather);
+}
+
+TYPED_TEST(OGNConvLayerTest, TestFuseBatch) {
+  shared_ptr<Net<TypeParam> > im2col = this->MakeNet("IM2COL", false);
+  shared_ptr<Net<TypeParam> > fused = this->MakeNet("IM2COL", true);
+  this->ExpectSameNets(*im2col, *fused);
+
+  shared_ptr<Net<TypeParam> > reference = this->MakeNet("IM2COL", false);
+  shared_ptr<Net<TypeParam> > fused_gather =
+      this->MakeNet("GATHER_SCATTER", true);
+  this->ExpectSameNets(*reference, *fused_gather);
+}
+
+// A 2^3 deconvolution writes the children of every parent directly; check
+// them against the filter applied to each parent.
+TYPED_TEST(OGNConvLayerTest, TestDeconvChildren) {
+  typedef TypeParam Dtype;
+  shared_ptr<Net<Dtype> > net = this->MakeNet("IM2COL", false);
+  net->Forward();
+  OGNLayer<Dtype>* parents =
+      dynamic_cast<OGNLayer<Dtype>*>(net->layer_by_name("keys").get());
+  OGNLayer<Dtype>* deconv =
+      dynamic_cast<OGNLayer<Dtype>*>(net->layer_by_name("deconv1").get());
+  const Blob<Dtype>& x = *net->blob_by_name("x");
+  const Blob<Dtype>& u = *net->blob_by_name("u");
+  const Dtype* weights = deconv->blobs()[0]->cpu_data();
+  const Dtype* bias = deconv->blobs()[1]->cpu_data();
+  const int in_channels = x.shape(1);
+  const int out_channels = u.shape(1);
+
+  for (int n = 0; n < x.shape(0); ++n) {
+    const GeneralOctree<int>& parent_keys = parents->get_keys_octree(n);
+    const GeneralOctree<int>& child_keys = deconv->get_keys_octree(n);
+    ASSERT_EQ(8 * parent_keys.num_elements(), child_keys.num_elements());
+    for (int j = 0; j < parent_keys.num_elements(); ++j) {
+      const KeyType parent = parent_keys.keys()[j];
+      const OctreeCoord p = GeneralOctree<int>::compute_coord(parent);
+      for (int c = 0; c < 8; ++c) {
+        const int cell = 8 * j + c;
+        const KeyType child = GeneralOctree<int>::child_key(parent, c);
+        EXPECT_EQ(child, child_keys.keys()[cell]);
+        EXPECT_EQ(cell, child_keys.values()[cell]);
+        const OctreeCoord q = GeneralOctree<int>::compute_coord(child);
+        const int el =
+            (q.x - 2 * p.x) * 4 + (q.y - 2 * p.y) * 2 + (q.z - 2 * p.z);
+        for (int o = 0; o < out_channels; ++o) {
+          Dtype expected = bias[o];
+          for (int i = 0; i < in_channels; ++i) {
+            expected += weights[(i * out_channels + o) * 8 + el] *
+                x.cpu_data()[x.offset(n, i, parent_keys.values()[j])];
+          }
+          EXPECT_NEAR(expected, u.cpu_data()[u.offset(n, o, cell)], 1e-4);
+        }
+      }
+    }
+  }
+}
+
+// Small tasks, so that every loop is split across the threads; the tasks
+// write disjoint outputs, so the results are the same bit for bit.
+TYPED_TEST(OGNConvLayerTest, TestThreadCount) {
+  const char* engines[] = {"IM2COL", "GATHER_SCATTER", "IM2COL"};
+  const bool fuse_batch[] = {false, false, true};
+  for (int i = 0; i < 3; ++i) {
+    set_ogn_threads(1);
+    shared_ptr<Net<TypeParam> > serial =
+        this->MakeNet(engines[i], fuse_batch[i]);
+    serial->Forward();
+    serial->Backward();
+    set_ogn_threads(4, 16);
+    shared_ptr<Net<TypeParam> > parallel =
+        this->MakeNet(engines[i], fuse_batch[i]);
+    parallel->Forward();
+    parallel->Backward();
+    this->ExpectSameBlobs(*serial, *parallel, 0);
+  }
+  set_ogn_threads(0);
+}
+
+TYPED_TEST(OGNConvLayerTest, TestThreadCountLevels) {
+  set_ogn_threads(1);
+  shared_ptr<Net<TypeParam> > serial = this->MakeLevelNet();
+  serial->Forward();
+  serial->Backward();
+  set_ogn_threads(4, 16);
+  shared_ptr<Net<TypeParam> > parallel = this->MakeLevelNet();
+  parallel->Forward();
+  parallel->Backward();
+  set_ogn_threads(0);
+
+  // both levels keep some of their cells
+  OGNLayer<TypeParam>* pred2 = dynamic_cast<OGNLayer<TypeParam>*>(
+      serial->layer_by_name("pred2").get());
+  OGNLayer<TypeParam>* pred3 = dynamic_cast<OGNLayer<TypeParam>*>(
+      serial->layer_by_name("pred3").get());
+  EXPECT_GT(pred2->get_keys_octree(0).num_elements(), 0);
+  EXPECT_GT(pred3->get_keys_octree(0).num_elements(), 0);
+
+  const char* blobs[] = {"y", "u", "f2", "f3", "f", "s", "targets"};
+  for (int i = 0; i < 7; ++i) {
+    this->ExpectNear(*serial->blob_by_name(blobs[i]),
+        *parallel->blob_by_name(blobs[i]), false, 0);
+  }
+  const char* diffs[] = {"y", "u", "f2", "f3"};
+  for (int i = 0; i < 4; ++i) {
+    this->ExpectNear(*serial->blob_by_name(diffs[i]),
+        *parallel->blob_by_name(diffs[i]), true, 0);
+  }
+  const char* layers[] = {"conv", "deconv", "concat"};
+  for (int i = 0; i < 3; ++i) {
+    OGNLayer<TypeParam>* expected = dynamic_cast<OGNLayer<TypeParam>*>(
+        serial->layer_by_name(layers[i]).get());
+    OGNLayer<TypeParam>* actual = dynamic_cast<OGNLayer<TypeParam>*>(
+        parallel->layer_by_name(layers[i]).get());
+    for (int n = 0; n < 2; ++n) {
+      EXPECT_TRUE(expected->get_keys_octree(n).keys() ==
+          actual->get_keys_octree(n).keys());
+    }
+  }
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 2; ++j) {
+      this->ExpectNear(*serial->layer_by_name(layers[i])->blobs()[j],
+          *parallel->layer_by_name(layers[i])->blobs()[j], true, 0);
+    }
+  }
+}
+
+}  // namespace caffe
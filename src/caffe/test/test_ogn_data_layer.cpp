@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/ogn_data_layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class OGNDataLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  OGNDataLayerTest()
+      : blob_top_values_(new Blob<Dtype>()),
+        blob_top_labels_(new Blob<Dtype>()) {}
+
+  virtual void SetUp() {
+    blob_top_vec_.push_back(blob_top_values_);
+    blob_top_vec_.push_back(blob_top_labels_);
+
+    // models of different sizes, so batches need padding
+    MakeTempFilename(&list_file_);
+    MakeTempFilename(&pack_file_);
+    std::ofstream list(list_file_.c_str());
+    OctreePackWriter writer;
+    ASSERT_TRUE(writer.open(pack_file_, 5));
+    models_.resize(5);
+    for (int m = 0; m < 5; ++m) {
+      for (int i = 0; i <= 8 * m; ++i) {
+        OctreeCoord c;
+        c.x = i & 3; c.y = (i >> 2) & 3; c.z = i >> 4; c.l = 2;
+        models_[m].add_element(Octree::compute_key(c),
+            (i + m) % 2 ? CLASS_FILLED : CLASS_EMPTY);
+      }
+      string file_name;
+      MakeTempFilename(&file_name);
+      models_[m].to_file(file_name);
+      model_files_.push_back(file_name);
+      list << file_name << std::endl;
+      ASSERT_TRUE(writer.add(models_[m]));
+    }
+    ASSERT_TRUE(writer.close());
+  }
+
+  virtual ~OGNDataLayerTest() {
+    delete blob_top_values_;
+    delete blob_top_labels_;
+    for (int m = 0; m < model_files_.size(); ++m) {
+      remove(model_files_[m].c_str());
+    }
+  }
+
+  // Checks the tops against the given models, one per batch element.
+  void CheckBatch(OGNDataLayer<Dtype>& layer, const vector<int>& batch) {
+    ASSERT_EQ(batch.size(), blob_top_values_->shape(0));
+    ASSERT_EQ(batch.size(), blob_top_labels_->shape(0));
+    const int num_elements = blob_top_values_->shape(1);
+    int max_elements = 0;
+    for (int bt = 0; bt < batch.size(); ++bt) {
+      const Octree& expected = models_[batch[bt]];
+      max_elements = std::max(max_elements, expected.num_elements());
+      EXPECT_EQ(batch[bt], blob_top_labels_->cpu_data()[bt]);
+
+      const Dtype* values = blob_top_values_->cpu_data() + bt * num_elements;
+      GeneralOctree<int>& keys = layer.get_keys_octree(bt);
+      ASSERT_EQ(expected.num_elements(), keys.num_elements());
+      for (int i = 0; i < num_elements; ++i) {
+        if (i < expected.num_elements()) {
+          EXPECT_EQ(expected.get_element(i).second, values[i]);
+          EXPECT_EQ(expected.get_element(i).first, keys.get_element(i).first);
+          EXPECT_EQ(i, keys.get_element(i).second);
+        } else {
+          EXPECT_EQ(0, values[i]);
+        }
+      }
+    }
+    EXPECT_EQ(max_elements, num_elements);
+  }
+
+  void SetParam(LayerParameter* param, const string& source, bool preload,
+      int prefetch, int preload_threads, int preload_memory_mb) {
+    param->set_name("data");
+    OGNDataParameter* data_param = param->mutable_ogn_data_param();
+    data_param->set_batch_size(2);
+    data_param->set_source(source);
+    data_param->set_preload_data(preload);
+    data_param->set_prefetch(prefetch);
+    data_param->set_preload_threads(preload_threads);
+    data_param->set_preload_memory_mb(preload_memory_mb);
+  }
+
+  void TestRead(const string& source, bool preload, int prefetch,
+      int preload_threads = 1, int preload_memory_mb = 0) {
+    const int batch_size = 2;
+    LayerParameter param;
+    SetParam(&param, source, preload, prefetch, preload_threads,
+        preload_memory_mb);
+
+    OGNDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(batch_size, blob_top_values_->shape(0));
+    EXPECT_EQ(batch_size, blob_top_labels_->shape(0));
+
+    int model = 0;
+    for (int iter = 0; iter < 7; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      vector<int> batch;
+      for (int bt = 0; bt < batch_size; ++bt, model = (model + 1) % 5) {
+        batch.push_back(model);
+      }
+      CheckBatch(layer, batch);
+    }
+  }
+
+  // Models grow with their index, so with one model per bucket a batch
+  // holds neighbours; every epoch covers all models. Unshuffled epochs read
+  // each model once in size order, ending with a short batch.
+  void TestSizeBuckets(const string& source, bool preload, int prefetch,
+      bool shuffle) {
+    LayerParameter param;
+    SetParam(&param, source, preload, prefetch, 1, 0);
+    param.mutable_ogn_data_param()->set_size_buckets(5);
+    param.mutable_ogn_data_param()->set_shuffle(shuffle);
+
+    OGNDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    for (int epoch = 0; epoch < 3; ++epoch) {
+      vector<int> seen(5, 0);
+      for (int iter = 0; iter < 3; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        vector<int> batch;
+        for (int bt = 0; bt < blob_top_labels_->shape(0); ++bt) {
+          batch.push_back(blob_top_labels_->cpu_data()[bt]);
+          ASSERT_GE(batch[bt], 0);
+          ASSERT_LT(batch[bt], 5);
+          seen[batch[bt]]++;
+        }
+        if (shuffle) {
+          ASSERT_EQ(2, batch.size());
+          EXPECT_LE(std::abs(batch[0] - batch[1]), 1);
+        } else {
+          ASSERT_EQ(iter < 2 ? 2 : 1, batch.size());
+          for (int bt = 0; bt < batch.size(); ++bt) {
+            EXPECT_EQ(2 * iter + bt, batch[bt]);
+          }
+        }
+        CheckBatch(layer, batch);
+      }
+      for (int m = 0; m < 5; ++m) {
+        EXPECT_GE(seen[m], 1);
+        if (!shuffle) EXPECT_EQ(1, seen[m]);
+      }
+    }
+  }
+
+  // Models have 1, 9, 17, 25 and 33 cells.
+  void TestCellBudget(const string& source, int prefetch, int batch_size,
+      int max_batch_cells, const vector<vector<int> >& batches) {
+    LayerParameter param;
+    SetParam(&param, source, true, prefetch, 1, 0);
+    param.mutable_ogn_data_param()->set_batch_size(batch_size);
+    param.mutable_ogn_data_param()->set_max_batch_cells(max_batch_cells);
+
+    OGNDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    for (int iter = 0; iter < 2 * batches.size(); ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      CheckBatch(layer, batches[iter % batches.size()]);
+    }
+  }
+
+  // The first layer fills the segment, the second one attaches to it.
+  void TestSharedMemory(const string& source) {
+    std::ostringstream name;
+    name << "/ogn_data_layer_test_" << getpid();
+    shm_unlink(name.str().c_str());
+
+    LayerParameter param;
+    SetParam(&param, source, true, 0, 2, 0);
+    param.mutable_ogn_data_param()->set_shared_memory_name(name.str());
+    OGNDataLayer<Dtype> creator(param);
+    creator.SetUp(blob_bottom_vec_, blob_top_vec_);
+    OGNDataLayer<Dtype> attached(param);
+    attached.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(0, shm_unlink(name.str().c_str()));
+
+    vector<int> batch;
+    batch.push_back(0); batch.push_back(1);
+    for (int iter = 0; iter < 3; ++iter) {
+      creator.Forward(blob_bottom_vec_, blob_top_vec_);
+      CheckBatch(creator, batch);
+      attached.Forward(blob_bottom_vec_, blob_top_vec_);
+      CheckBatch(attached, batch);
+      for (int bt = 0; bt < 2; ++bt) batch[bt] = (batch[bt] + 2) % 5;
+    }
+  }
+
+  // Labels of the next num_batches batches, model after model.
+  vector<int> ReadModels(OGNDataLayer<Dtype>& layer, int num_batches) {
+    vector<int> models;
+    for (int iter = 0; iter < num_batches; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      vector<int> batch;
+      for (int bt = 0; bt < blob_top_labels_->count(); ++bt) {
+        batch.push_back(blob_top_labels_->cpu_data()[bt]);
+      }
+      CheckBatch(layer, batch);
+      models.insert(models.end(), batch.begin(), batch.end());
+    }
+    return models;
+  }
+
+  // Two shards of one model per batch take three models each per epoch;
+  // together they cover the epoch, with one model of it read twice.
+  void TestShards(const string& source, int prefetch) {
+    LayerParameter param;
+    SetParam(&param, source, true, prefetch, 1, 0);
+    param.mutable_ogn_data_param()->set_batch_size(1);
+    param.mutable_ogn_data_param()->set_shuffle(true);
+    param.mutable_ogn_data_param()->set_sampler_seed(1701);
+    param.mutable_ogn_data_param()->set_num_shards(2);
+    vector<vector<int> > shards;
+    for (int rank = 0; rank < 2; ++rank) {
+      param.mutable_ogn_data_param()->set_shard_rank(rank);
+      OGNDataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      shards.push_back(ReadModels(layer, 9));
+    }
+    for (int epoch = 0; epoch < 3; ++epoch) {
+      vector<int> seen(5, 0);
+      for (int rank = 0; rank < 2; ++rank) {
+        for (int i = 0; i < 3; ++i) seen[shards[rank][epoch * 3 + i]]++;
+      }
+      EXPECT_EQ(4, std::count(seen.begin(), seen.end(), 1));
+      EXPECT_EQ(1, std::count(seen.begin(), seen.end(), 2));
+    }
+
+    // the order only depends on the seed
+    param.mutable_ogn_data_param()->set_shard_rank(1);
+    OGNDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_TRUE(ReadModels(layer, 9) == shards[1]);
+
+    // without num_shards, training nets are sharded by solver while test
+    // nets, which only the root solver runs, read the whole epoch
+    param.mutable_ogn_data_param()->clear_shard_rank();
+    param.mutable_ogn_data_param()->clear_num_shards();
+    Caffe::set_solver_count(2);
+    Caffe::set_solver_rank(1);
+    OGNDataLayer<Dtype> train_layer(param);
+    train_layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_TRUE(ReadModels(train_layer, 9) == shards[1]);
+    param.set_phase(TEST);
+    OGNDataLayer<Dtype> test_layer(param);
+    test_layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    vector<int> epoch = ReadModels(test_layer, 5);
+    std::sort(epoch.begin(), epoch.end());
+    for (int m = 0; m < 5; ++m) EXPECT_EQ(m, epoch[m]);
+    Caffe::set_solver_count(1);
+    Caffe::set_solver_rank(0);
+  }
+
+  // A second layer with another seed continues where the first one was
+  // when its state was saved.
+  void TestSamplerSnapshot(const string& source, int prefetch) {
+    LayerParameter param;
+    SetParam(&param, source, true, prefetch, 1, 0);
+    param.mutable_ogn_data_param()->set_shuffle(true);
+    param.mutable_ogn_data_param()->set_sampler_seed(42);
+    param.mutable_ogn_data_param()->set_snapshot_sampler(true);
+
+    OGNDataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    ASSERT_EQ(1, layer.blobs().size());
+    EXPECT_EQ(0, layer.layer_param().param(0).lr_mult());
+    ReadModels(layer, 3);
+    Blob<Dtype> state;
+    state.CopyFrom(*layer.blobs()[0], false, true);
+    const vector<int> expected = ReadModels(layer, 4);
+
+    param.mutable_ogn_data_param()->set_sampler_seed(7);
+    OGNDataLayer<Dtype> resumed(param);
+    resumed.SetUp(blob_bottom_vec_, blob_top_vec_);
+    ReadModels(resumed, 1);
+    resumed.blobs()[0]->CopyFrom(state);
+    EXPECT_TRUE(ReadModels(resumed, 4) == expected);
+  }
+
+  string list_file_, pack_file_;
+  vector<string> model_files_;
+  vector<Octree> models_;
+  Blob<Dtype>* const blob_top_values_;
+  Blob<Dtype>* const blob_top_labels_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(OGNDataLayerTest, TestDtypes);
+
+TYPED_TEST(OGNDataLayerTest, TestReadSynchronous) {
+  this->TestRead(this->list_file_, true, 0);
+  this->TestRead(this->list_file_, false, 0);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestReadPrefetch) {
+  this->TestRead(this->list_file_, true, 3);
+  this->TestRead(this->list_file_, false, 1);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestReadPack) {
+  this->TestRead(this->pack_file_, false, 0);
+  this->TestRead(this->pack_file_, true, 2);
+  this->TestRead(this->pack_file_, false, 2);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestParallelPreload) {
+  this->TestRead(this->list_file_, true, 0, 3);
+  this->TestRead(this->pack_file_, true, 2, 4, 1);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestSizeBuckets) {
+  this->TestSizeBuckets(this->list_file_, false, 0, true);
+  this->TestSizeBuckets(this->pack_file_, true, 2, true);
+  this->TestSizeBuckets(this->list_file_, false, 0, false);
+  this->TestSizeBuckets(this->pack_file_, true, 2, false);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestCellBudget) {
+  // [0 1] pads to 18 cells, [0 1 2] would pad to 51
+  vector<vector<int> > batches(3);
+  batches[0].push_back(0); batches[0].push_back(1);
+  batches[1].push_back(2); batches[1].push_back(3);
+  batches[2].push_back(4);
+  this->TestCellBudget(this->list_file_, 0, 4, 50, batches);
+  this->TestCellBudget(this->pack_file_, 2, 4, 50, batches);
+
+  // limited by the batch size, and by a budget below most model sizes
+  batches.assign(5, vector<int>(1));
+  for (int m = 0; m < 5; ++m) batches[m][0] = m;
+  this->TestCellBudget(this->list_file_, 1, 1, 1000, batches);
+  this->TestCellBudget(this->list_file_, 0, 3, 10, batches);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestShards) {
+  this->TestShards(this->list_file_, 0);
+  this->TestShards(this->pack_file_, 2);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestSamplerSnapshot) {
+  this->TestSamplerSnapshot(this->list_file_, 0);
+  this->TestSamplerSnapshot(this->pack_file_, 3);
+}
+
+TYPED_TEST(OGNDataLayerTest, TestSharedMemory) {
+  this->TestSharedMemory(this->list_file_);
+  this->TestSharedMemory(this->pack_file_);
+}
+
+}  // namespace caffe
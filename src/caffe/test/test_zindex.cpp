@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+namespace caffe {
+
+template <typename KeyT>
+class ZIndexBatchTest : public ::testing::Test {
+ protected:
+  ZIndexBatchTest() : xs_(kNumKeys), ys_(kNumKeys), zs_(kNumKeys) {
+    // odd count exercises the scalar tail of the vector kernels
+    const uint32_t mask = sizeof(KeyT) == 4 ? 1023 : (1 << 21) - 1;
+    srand(1701);
+    for (int i = 0; i < kNumKeys; ++i) {
+      xs_[i] = (uint32_t(rand()) * 7) & mask;
+      ys_[i] = (uint32_t(rand()) * 13) & mask;
+      zs_[i] = (uint32_t(rand()) * 17) & mask;
+    }
+    xs_[0] = ys_[0] = zs_[0] = mask;
+  }
+
+  static const int kNumKeys = 1001;
+  std::vector<uint32_t> xs_, ys_, zs_;
+};
+
+typedef ::testing::Types<uint32_t, uint64_t> KeyTypes;
+TYPED_TEST_CASE(ZIndexBatchTest, KeyTypes);
+
+TYPED_TEST(ZIndexBatchTest, TestKernelsMatchScalar) {
+  const int n = this->kNumKeys;
+  std::vector<TypeParam> expected(n);
+  for (int i = 0; i < n; ++i) {
+    expected[i] = morton_3d(TypeParam(this->xs_[i]), TypeParam(this->ys_[i]),
+        TypeParam(this->zs_[i]));
+  }
+  const MortonKernel kernels[] =
+      {MORTON_AUTO, MORTON_SCALAR, MORTON_BMI2, MORTON_AVX2};
+  for (int k = 0; k < 4; ++k) {
+    if (!morton_kernel_supported(kernels[k])) {
+      continue;
+    }
+    std::vector<TypeParam> keys(n);
+    std::vector<uint32_t> x(n), y(n), z(n);
+    morton_3d_batch(&this->xs_[0], &this->ys_[0], &this->zs_[0], &keys[0], n,
+        kernels[k]);
+    inverse_morton_3d_batch(&keys[0], &x[0], &y[0], &z[0], n, kernels[k]);
+    for (int i = 0; i < n; ++i) {
+      EXPECT_EQ(expected[i], keys[i]) << morton_kernel_name(kernels[k]);
+      EXPECT_EQ(this->xs_[i], x[i]) << morton_kernel_name(kernels[k]);
+      EXPECT_EQ(this->ys_[i], y[i]) << morton_kernel_name(kernels[k]);
+      EXPECT_EQ(this->zs_[i], z[i]) << morton_kernel_name(kernels[k]);
+    }
+  }
+}
+
+}  // namespace caffe
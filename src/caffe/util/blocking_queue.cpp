@@ -2,6 +2,7 @@
 #include <string>
 
 #include "caffe/layers/base_data_layer.hpp"
+#include "caffe/layers/ogn_base_data_layer.hpp"
 #include "caffe/parallel.hpp"
 #include "caffe/util/blocking_queue.hpp"
 
@@ -87,5 +88,7 @@ size_t BlockingQueue<T>::size() const {
 
 template class BlockingQueue<Batch<float>*>;
 template class BlockingQueue<Batch<double>*>;
+template class BlockingQueue<OGNBatch<float>*>;
+template class BlockingQueue<OGNBatch<double>*>;
 
 }  // namespace caffe
@@ -13,6 +13,7 @@ namespace bp = boost::python;
 
 #include "boost/algorithm/string.hpp"
 #include "caffe/caffe.hpp"
+#include "caffe/layers/ogn_layer.hpp"
 #include "caffe/util/signal_handler.h"
 
 using caffe::Blob;
@@ -54,6 +55,9 @@ DEFINE_string(sigint_effect, "stop",
 DEFINE_string(sighup_effect, "snapshot",
              "Optional; action to take when a SIGHUP signal is received: "
              "snapshot, stop or none.");
+DEFINE_int32(ogn_threads, 0,
+    "Optional; number of threads for the CPU loops of the OGN layers "
+    "per solver (0: hardware threads divided by the number of GPUs).");
 
 // A simple registry for caffe commands.
 typedef int (*BrewFunction)();
@@ -371,6 +375,12 @@ int time() {
   const vector<vector<Blob<float>*> >& top_vecs = caffe_net.top_vecs();
   const vector<vector<bool> >& bottom_need_backward =
       caffe_net.bottom_need_backward();
+  // rulebooks of OGN convolutions are counted from here on
+  for (int i = 0; i < layers.size(); ++i) {
+    caffe::OGNLayer<float>* ogn_layer =
+        dynamic_cast<caffe::OGNLayer<float>*>(layers[i].get());
+    if (ogn_layer) ogn_layer->reset_rulebook_stats();
+  }
   LOG(INFO) << "*** Benchmark begins ***";
   LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations.";
   Timer total_timer;
@@ -413,6 +423,18 @@ int time() {
       "\tbackward: " << backward_time_per_layer[i] / 1000 /
       FLAGS_iterations << " ms.";
   }
+  // built in the layers that use them, whose times include the builds
+  for (int i = 0; i < layers.size(); ++i) {
+    const caffe::OGNLayer<float>* ogn_layer =
+        dynamic_cast<const caffe::OGNLayer<float>*>(layers[i].get());
+    if (!ogn_layer || !ogn_layer->rulebook_builds()) continue;
+    LOG(INFO) << std::setfill(' ') << std::setw(10)
+      << layers[i]->layer_param().name() << "\trulebooks: "
+      << ogn_layer->rulebook_ms() / FLAGS_iterations << " ms, "
+      << double(ogn_layer->rulebook_builds()) / FLAGS_iterations
+      << " built, " << double(ogn_layer->rulebook_reuses()) / FLAGS_iterations
+      << " reused per iteration.";
+  }
   total_timer.Stop();
   LOG(INFO) << "Average Forward pass: " << forward_time / 1000 /
     FLAGS_iterations << " ms.";
@@ -441,6 +463,7 @@ int main(int argc, char** argv) {
       "  time            benchmark model execution time");
   // Run tool or show usage.
   caffe::GlobalInit(&argc, &argv);
+  caffe::set_ogn_threads(FLAGS_ogn_threads);
   if (argc == 2) {
 #ifdef WITH_PYTHON_LAYER
     try {
@@ -0,0 +1,579 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <google/protobuf/text_format.h>
+
+#include "caffe/net.hpp"
+#include "caffe/layers/ogn_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+#include "image_tree_tools/octree_parallel.h"
+
+using namespace boost::program_options;
+using namespace std;
+
+string benchmark = "morton";
+int num_keys = 1 << 22;
+int iterations = 10;
+int grid_dim = 0;
+int num_channels = 16;
+int batch_size = 4;
+int num_threads = 0;
+
+int register_cmd_options(int argc, char* argv[])
+{
+    try
+    {
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "Show help")
+            ("benchmark,b", value<string>(&benchmark)->default_value("morton"), "Benchmark to run: morton, voxelize, rasterize, conv, threads")
+            ("num_keys,n", value<int>(&num_keys)->default_value(1 << 22), "Number of keys per batch")
+            ("iterations,t", value<int>(&iterations)->default_value(10), "Number of timed repetitions")
+            ("dim,d", value<int>(&grid_dim)->default_value(0), "Voxel grid resolution, 0 for 256 (64 for conv and threads)")
+            ("channels,c", value<int>(&num_channels)->default_value(16), "Feature channels of the conv benchmark")
+            ("batch", value<int>(&batch_size)->default_value(4), "Shapes per batch of the conv and threads benchmarks")
+            ("threads,j", value<int>(&num_threads)->default_value(0), "Worker threads, 0 for all hardware threads")
+        ;
+
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help"))
+        {
+            cout << desc << endl;
+            return 1;
+        }
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static void report(const string& what, double keys, double seconds)
+{
+    cout << "  " << setw(16) << left << what << right << fixed << setprecision(1)
+         << setw(10) << keys / seconds / 1e6 << " Mkeys/s" << endl;
+}
+
+template <class KEY>
+void benchmark_morton_keys(const vector<uint32_t>& xs, const vector<uint32_t>& ys, const vector<uint32_t>& zs)
+{
+    const size_t n = xs.size();
+    const MortonKernel kernels[] = {MORTON_SCALAR, MORTON_BMI2, MORTON_AVX2};
+
+    vector<KEY> reference(n), keys(n);
+    vector<uint32_t> dx(n), dy(n), dz(n);
+    morton_3d_batch(&xs[0], &ys[0], &zs[0], &reference[0], n, MORTON_SCALAR);
+
+    cout << sizeof(KEY) * 8 << "-bit keys, auto selects "
+         << morton_kernel_name(resolve_morton_kernel(MORTON_AUTO, sizeof(KEY))) << ":" << endl;
+
+    for(int k=0; k<3; k++)
+    {
+        MortonKernel kernel = kernels[k];
+        if(!morton_kernel_supported(kernel))
+        {
+            cout << "  " << morton_kernel_name(kernel) << " not supported by this CPU" << endl;
+            continue;
+        }
+
+        caffe::CPUTimer timer;
+        timer.Start();
+        for(int it=0; it<iterations; it++) morton_3d_batch(&xs[0], &ys[0], &zs[0], &keys[0], n, kernel);
+        timer.Stop();
+        report(string(morton_kernel_name(kernel)) + " encode", double(n) * iterations, timer.Seconds());
+
+        timer.Start();
+        for(int it=0; it<iterations; it++) inverse_morton_3d_batch(&keys[0], &dx[0], &dy[0], &dz[0], n, kernel);
+        timer.Stop();
+        report(string(morton_kernel_name(kernel)) + " decode", double(n) * iterations, timer.Seconds());
+
+        if(keys != reference || dx != xs || dy != ys || dz != zs)
+            cout << "  ERROR: " << morton_kernel_name(kernel) << " results differ from scalar" << endl;
+    }
+}
+
+void benchmark_morton()
+{
+    // coordinates of the deepest level that fits into 32-bit keys
+    vector<uint32_t> xs(num_keys), ys(num_keys), zs(num_keys);
+    srand(1701);
+    for(int i=0; i<num_keys; i++)
+    {
+        xs[i] = rand() & 1023;
+        ys[i] = rand() & 1023;
+        zs[i] = rand() & 1023;
+    }
+    benchmark_morton_keys<uint32_t>(xs, ys, zs);
+    benchmark_morton_keys<uint64_t>(xs, ys, zs);
+}
+
+// from_voxel_grid before the streaming builder: two dense dim^3 scratch
+// arrays swept once per level, kept here as the baseline
+void legacy_from_voxel_grid(Octree& octree, VoxelGrid& vg, int min_level)
+{
+    int level = log2((float)vg.depth());
+    int dim = vg.depth();
+    int max_level = level;
+
+    KeyType* keys_arr = new KeyType[dim*dim*dim];
+    SignalType* values_arr = new SignalType[dim*dim*dim];
+    for(int i=0; i<dim; i++)
+    {
+        for(int j=0; j<dim; j++)
+        {
+            for(int k=0; k<dim; k++)
+            {
+                OctreeCoord crd;
+                crd.x = i; crd.y = j; crd.z = k; crd.l = level;
+                keys_arr[i*dim*dim + j*dim + k] = Octree::compute_key(crd);
+                values_arr[i*dim*dim + j*dim + k] = vg.get_element(i, j, k);
+            }
+        }
+    }
+
+    while(level > min_level)
+    {
+        int step = 1 << (max_level - level + 1);
+        for(int i=0; i<dim; i+=step)
+        {
+            for(int j=0; j<dim; j+=step)
+            {
+                for(int k=0; k<dim; k+=step)
+                {
+                    KeyType key = keys_arr[i*dim*dim + j*dim + k];
+                    if(Octree::compute_level(key) != level) continue;
+
+                    int comp_val = 0, el_count = 0;
+                    for(int c=0; c<8; c++)
+                    {
+                        int ind = (i + (c & 1)*step/2)*dim*dim + (j + ((c >> 1) & 1)*step/2)*dim + k + (c >> 2)*step/2;
+                        if(Octree::compute_level(keys_arr[ind]) != level) continue;
+                        if(values_arr[ind] == CLASS_FILLED) comp_val++;
+                        el_count++;
+                    }
+                    if((comp_val == 0 || comp_val == 8) && el_count == 8)
+                    {
+                        for(int ii=0; ii<step; ii++)
+                            for(int jj=0; jj<step; jj++)
+                                for(int kk=0; kk<step; kk++)
+                                    keys_arr[(i+ii)*dim*dim + (j+jj)*dim + k+kk] = key >> 3;
+                    }
+                }
+            }
+        }
+        level--;
+    }
+
+    std::vector<std::pair<KeyType, SignalType> > elements;
+    elements.reserve(dim*dim*dim);
+    for(int i=0; i<dim*dim*dim; i++) elements.push_back(std::make_pair(keys_arr[i], values_arr[i]));
+    delete[] keys_arr;
+    delete[] values_arr;
+    octree.build_from_unsorted(elements);
+}
+
+static void report_build(const string& what, double ms, long rss_kb = -1)
+{
+    cout << "  " << setw(22) << left << what << right << fixed << setprecision(1) << setw(10) << ms << " ms";
+    if(rss_kb >= 0) cout << setw(8) << rss_kb / 1024 << " MB peak growth";
+    cout << endl;
+}
+
+static long peak_rss_kb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// a solid sphere with a sparse shell of noise: large uniform regions plus
+// fine detail near the surface
+static VoxelGrid make_test_shape(int dim, float radius = 0.4f)
+{
+    VoxelGrid vg(dim, dim, dim);
+    const float r = dim * radius, c = dim * 0.5f;
+    srand(1701);
+    for(int i=0; i<dim; i++)
+    {
+        for(int j=0; j<dim; j++)
+        {
+            for(int k=0; k<dim; k++)
+            {
+                float d = sqrt((i-c)*(i-c) + (j-c)*(j-c) + (k-c)*(k-c));
+                bool filled = d < r || (d < r + 2 && rand() % 4 == 0);
+                vg.set_element(i, j, k, filled ? CLASS_FILLED : CLASS_EMPTY);
+            }
+        }
+    }
+    return vg;
+}
+
+void benchmark_voxelize()
+{
+    VoxelGrid vg = make_test_shape(grid_dim);
+
+    const int threads = num_threads > 0 ? num_threads : default_num_threads();
+    cout << grid_dim << "^3 grid, min level 0:" << endl;
+
+    // the streaming builder runs first so the peak RSS growth of the dense
+    // baseline is measured on top of it
+    Octree streaming, parallel, legacy;
+    long rss = peak_rss_kb();
+    caffe::CPUTimer timer;
+    timer.Start();
+    streaming.from_voxel_grid(vg, 0);
+    timer.Stop();
+    report_build("streaming, 1 thread", timer.MilliSeconds(), peak_rss_kb() - rss);
+
+    rss = peak_rss_kb();
+    timer.Start();
+    parallel_from_voxel_grid(parallel, vg, 0, threads);
+    timer.Stop();
+    std::ostringstream label;
+    label << "streaming, " << threads << " threads";
+    report_build(label.str(), timer.MilliSeconds(), peak_rss_kb() - rss);
+
+    rss = peak_rss_kb();
+    timer.Start();
+    legacy_from_voxel_grid(legacy, vg, 0);
+    timer.Stop();
+    report_build("dense baseline", timer.MilliSeconds(), peak_rss_kb() - rss);
+
+    cout << "  " << streaming.num_elements() << " cells" << endl;
+    if(streaming.keys() != legacy.keys() || streaming.values() != legacy.values() ||
+       parallel.keys() != legacy.keys() || parallel.values() != legacy.values())
+        cout << "  ERROR: octrees differ from the dense baseline" << endl;
+}
+
+void benchmark_rasterize()
+{
+    VoxelGrid vg = make_test_shape(grid_dim);
+    Octree octree;
+    octree.from_voxel_grid(vg, 0);
+
+    const int threads = num_threads > 0 ? num_threads : default_num_threads();
+    cout << grid_dim << "^3 grid, " << octree.num_elements() << " cells:" << endl;
+
+    caffe::CPUTimer timer;
+    timer.Start();
+    GeneralVoxelGrid<SignalType> serial = octree.to_voxel_grid();
+    timer.Stop();
+    report_build("to_voxel_grid", timer.MilliSeconds());
+
+    timer.Start();
+    VoxelGrid parallel = parallel_to_voxel_grid(octree, threads);
+    timer.Stop();
+    std::ostringstream label;
+    label << "parallel, " << threads << " threads";
+    report_build(label.str(), timer.MilliSeconds());
+
+    string file_name = "/tmp/ogn_benchmark.binvox";
+    timer.Start();
+    parallel.write_binvox(file_name);
+    timer.Stop();
+    report_build("write_binvox", timer.MilliSeconds());
+    remove(file_name.c_str());
+
+    if(memcmp(serial.data(), vg.data(), vg.size()) || memcmp(parallel.data(), vg.data(), vg.size()))
+        cout << "  ERROR: rasterized grid differs from the input" << endl;
+}
+
+// OGN decoder on the surface of the test shape: dense 8^3 features,
+// upsampled level by level to dim^3, each level a 2^3 deconvolution and a
+// 3^3 convolution, with the cells between levels propagated from the known
+// mixed cells of the shape as in training
+static string conv_net(int stages, const string& engine, bool fuse_batch)
+{
+    std::ostringstream net;
+    const string filler = string(fuse_batch ? " fuse_batch: true" : "") +
+        " weight_filler { type: 'gaussian' std: 0.1 } bias_filler { type: 'gaussian' std: 0.1 } ";
+    net << "layer { name: 'dense' type: 'DummyData' top: 'dense' dummy_data_param { shape { dim: " << batch_size << " dim: "
+        << num_channels << " dim: 8 dim: 8 dim: 8 } data_filler { type: 'constant' value: 0.5 } } }\n"
+        << "layer { name: 'keys' type: 'OGNGenerateKeys' bottom: 'dense' }\n"
+        << "layer { name: 'x' type: 'Reshape' bottom: 'dense' top: 'conv_in0' reshape_param { shape { dim: 0 dim: 0 dim: -1 } } }\n";
+    for(int k=0; k<stages; k++)
+    {
+        string key_layer = "keys";
+        if(k)
+        {
+            // labels are filled in once the cells of the level are known
+            net << "layer { name: 'labels" << k << "' type: 'Input' top: 'labels" << k << "' input_param { shape { dim: " << batch_size << " dim: 1 } } }\n"
+                << "layer { name: 'prop" << k << "' type: 'OGNProp' bottom: 'conv" << k-1 << "' bottom: 'labels" << k << "' top: 'conv_in" << k
+                << "' ogn_prop_param { key_layer: 'deconv" << k-1 << "' prop_mode: PROP_KNOWN } }\n";
+            std::ostringstream prop; prop << "prop" << k;
+            key_layer = prop.str();
+        }
+        net << "layer { name: 'deconv" << k << "' type: 'OGNConv' bottom: 'conv_in" << k << "' top: 'deconv" << k
+            << "' ogn_conv_param { is_deconv: true filter_size: 2 output_channels: " << num_channels
+            << " key_layer: '" << key_layer << "' engine: " << engine << filler << "} }\n"
+            << "layer { name: 'conv" << k << "' type: 'OGNConv' bottom: 'deconv" << k << "' top: 'conv" << k
+            << "' ogn_conv_param { filter_size: 3 output_channels: " << num_channels
+            << " key_layer: 'deconv" << k << "' engine: " << engine << filler << "} }\n";
+    }
+    net << "layer { name: 'loss' type: 'Reduction' bottom: 'conv" << stages-1 << "' top: 'loss' reduction_param { operation: SUMSQ } loss_weight: 1 }\n";
+    return net.str();
+}
+
+// the class of the cell with the given key in the grid
+static SignalType cell_class(VoxelGrid& vg, KeyType key)
+{
+    OctreeCoord c = Octree::compute_coord(key);
+    const int size = vg.depth() >> c.l;
+    int filled = 0;
+    for(int i=0; i<size; i++)
+    {
+        for(int j=0; j<size; j++)
+        {
+            for(int k=0; k<size; k++)
+            {
+                if(vg.get_element(c.x*size + i, c.y*size + j, c.z*size + k) == CLASS_FILLED) filled++;
+            }
+        }
+    }
+    if(!filled) return CLASS_EMPTY;
+    return filled == size*size*size ? CLASS_FILLED : CLASS_MIXED;
+}
+
+static boost::shared_ptr<caffe::Net<float> > make_conv_net(vector<VoxelGrid>& shapes, int stages,
+                                                           const string& engine, bool fuse_batch)
+{
+    caffe::NetParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(conv_net(stages, engine, fuse_batch), &param));
+    param.mutable_state()->set_phase(caffe::TRAIN);
+    caffe::Caffe::set_random_seed(1701);
+    boost::shared_ptr<caffe::Net<float> > net(new caffe::Net<float>(param));
+
+    // a first pass level by level fills the labels of the cells of the
+    // previous level; the keys do not change afterwards
+    for(int k=1; k<stages; k++)
+    {
+        std::ostringstream deconv, labels;
+        deconv << "deconv" << k-1; labels << "labels" << k;
+        const int last = std::find(net->layer_names().begin(), net->layer_names().end(), deconv.str()) - net->layer_names().begin();
+        net->ForwardTo(last);
+        caffe::OGNLayer<float>* keys_layer = dynamic_cast<caffe::OGNLayer<float>*>(net->layer_by_name(deconv.str()).get());
+        caffe::Blob<float>* labels_blob = net->blob_by_name(labels.str()).get();
+        const int pixels = net->blob_by_name(deconv.str())->shape(2);
+        vector<int> shape;
+        shape.push_back(batch_size); shape.push_back(pixels);
+        labels_blob->Reshape(shape);
+        caffe::caffe_set(labels_blob->count(), float(CLASS_EMPTY), labels_blob->mutable_cpu_data());
+        for(int n=0; n<batch_size; n++)
+        {
+            const GeneralOctree<int>& keys = keys_layer->get_keys_octree(n);
+            for(GeneralOctree<int>::const_iterator it=keys.begin(); it!=keys.end(); it++)
+            {
+                labels_blob->mutable_cpu_data()[n * pixels + it->second] = cell_class(shapes[n], it->first);
+            }
+        }
+    }
+    return net;
+}
+
+// times the layers whose type starts with the prefix over the iterations
+static void time_layers(caffe::Net<float>& net, const string& type_prefix, double& forward_ms, double& backward_ms)
+{
+    forward_ms = backward_ms = 0;
+    caffe::CPUTimer timer;
+    for(int it=0; it<iterations; it++)
+    {
+        net.ClearParamDiffs();
+        for(int i=0; i<net.layers().size(); i++)
+        {
+            timer.Start();
+            net.ForwardFromTo(i, i);
+            timer.Stop();
+            if(string(net.layers()[i]->type()).compare(0, type_prefix.size(), type_prefix) == 0) forward_ms += timer.MilliSeconds();
+        }
+        for(int i=net.layers().size()-1; i>=0; i--)
+        {
+            timer.Start();
+            net.BackwardFromTo(i, i);
+            timer.Stop();
+            if(string(net.layers()[i]->type()).compare(0, type_prefix.size(), type_prefix) == 0) backward_ms += timer.MilliSeconds();
+        }
+    }
+    forward_ms /= iterations;
+    backward_ms /= iterations;
+}
+
+static int conv_stages()
+{
+    const int stages = int(log2((float)grid_dim)) - 3;
+    if(stages < 1 || (grid_dim & (grid_dim - 1)))
+    {
+        std::cerr << "ERROR: " << benchmark << " benchmark needs a power of two dim of at least 16" << std::endl;
+        return 0;
+    }
+    return stages;
+}
+
+void benchmark_conv()
+{
+    const int stages = conv_stages();
+    if(!stages) return;
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+
+    // spheres of different sizes, so that the samples are padded
+    vector<VoxelGrid> shapes;
+    for(int n=0; n<batch_size; n++) shapes.push_back(make_test_shape(grid_dim, 0.1f + 0.3f * (n + 1) / batch_size));
+
+    // the gather/scatter engine runs first so the peak RSS growth of the
+    // col buffers is measured on top of it; the last is the reference
+    const int num_configs = 4;
+    const string engines[] = {"GATHER_SCATTER", "GATHER_SCATTER", "IM2COL", "IM2COL"};
+    const bool fuse_batch[] = {false, true, true, false};
+    const string labels[] = {"gather", "gather fused", "im2col fused", "im2col"};
+    boost::shared_ptr<caffe::Net<float> > nets[num_configs];
+    cout << grid_dim << "^3 decoder, " << num_channels << " channels, " << batch_size << " shapes:" << endl;
+    for(int e=0; e<num_configs; e++)
+    {
+        long rss = peak_rss_kb();
+        nets[e] = make_conv_net(shapes, stages, engines[e], fuse_batch[e]);
+        caffe::Net<float>& net = *nets[e];
+        net.Forward();
+        net.ClearParamDiffs();
+        net.Backward();
+
+        double forward_ms, backward_ms;
+        time_layers(net, "OGNConv", forward_ms, backward_ms);
+        report_build(labels[e] + " forward", forward_ms, peak_rss_kb() - rss);
+        report_build(labels[e] + " backward", backward_ms);
+    }
+
+    for(int k=0; k<stages; k++)
+    {
+        std::ostringstream deconv;
+        deconv << "deconv" << k;
+        caffe::OGNLayer<float>* layer = dynamic_cast<caffe::OGNLayer<float>*>(nets[0]->layer_by_name(deconv.str()).get());
+        int cells = 0;
+        for(int n=0; n<batch_size; n++) cells += layer->get_keys_octree(n).num_elements();
+        cout << "  level " << k + 4 << ": " << cells << " cells, "
+             << nets[0]->blob_by_name(deconv.str())->count(0, 3) / num_channels << " padded" << endl;
+    }
+
+    // same weights and cells, so only the summation order differs
+    const caffe::Net<float>& reference = *nets[num_configs - 1];
+    for(int e=0; e<num_configs-1; e++)
+    {
+        for(int p=0; p<reference.learnable_params().size(); p++)
+        {
+            const caffe::Blob<float>& a = *nets[e]->learnable_params()[p];
+            const caffe::Blob<float>& b = *reference.learnable_params()[p];
+            double diff = 0, scale = 0;
+            for(int i=0; i<a.count(); i++)
+            {
+                diff = std::max(diff, fabs(double(a.cpu_diff()[i]) - b.cpu_diff()[i]));
+                scale = std::max(scale, fabs(double(b.cpu_diff()[i])));
+            }
+            if(diff > 1e-3 * scale)
+                cout << "  ERROR: " << labels[e] << " differs in the gradient of " << reference.param_display_names()[p] << endl;
+        }
+    }
+}
+
+// the conv decoder with the CPU loops of all OGN layers on 1, 2, 4, ...
+// threads; the GEMMs are left to the threads of the BLAS library
+void benchmark_threads()
+{
+    const int stages = conv_stages();
+    if(!stages) return;
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+
+    vector<VoxelGrid> shapes;
+    for(int n=0; n<batch_size; n++) shapes.push_back(make_test_shape(grid_dim, 0.1f + 0.3f * (n + 1) / batch_size));
+
+    const int max_threads = num_threads > 0 ? num_threads : default_num_threads();
+    vector<int> thread_counts;
+    for(int t=1; t<max_threads; t*=2) thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    cout << grid_dim << "^3 decoder, " << num_channels << " channels, " << batch_size << " shapes, OGN layers:" << endl;
+    boost::shared_ptr<caffe::Net<float> > reference;
+    double reference_ms = 0;
+    for(int t=0; t<thread_counts.size(); t++)
+    {
+        caffe::set_ogn_threads(thread_counts[t]);
+        boost::shared_ptr<caffe::Net<float> > net = make_conv_net(shapes, stages, "IM2COL", true);
+        net->Forward();
+        net->Backward();
+
+        double forward_ms, backward_ms;
+        time_layers(*net, "OGN", forward_ms, backward_ms);
+        std::ostringstream label;
+        label << thread_counts[t] << (thread_counts[t] == 1 ? " thread" : " threads");
+        report_build(label.str() + " forward", forward_ms);
+        report_build(label.str() + " backward", backward_ms);
+        if(!t)
+        {
+            reference = net;
+            reference_ms = forward_ms + backward_ms;
+            continue;
+        }
+        cout << "  " << setw(22) << left << label.str() + " speedup" << right << fixed << setprecision(2)
+             << setw(10) << reference_ms / (forward_ms + backward_ms) << "x" << endl;
+
+        // the tasks of every loop write disjoint outputs, so the results
+        // must not depend on the number of threads
+        for(int b=0; b<reference->blobs().size(); b++)
+        {
+            const caffe::Blob<float>& x = *net->blobs()[b];
+            const caffe::Blob<float>& y = *reference->blobs()[b];
+            if(x.count() != y.count() || memcmp(x.cpu_data(), y.cpu_data(), sizeof(float) * x.count())
+               || memcmp(x.cpu_diff(), y.cpu_diff(), sizeof(float) * x.count()))
+                cout << "  ERROR: " << label.str() << " differ in " << reference->blob_names()[b] << endl;
+        }
+        for(int p=0; p<reference->learnable_params().size(); p++)
+        {
+            const caffe::Blob<float>& x = *net->learnable_params()[p];
+            const caffe::Blob<float>& y = *reference->learnable_params()[p];
+            if(memcmp(x.cpu_diff(), y.cpu_diff(), sizeof(float) * x.count()))
+                cout << "  ERROR: " << label.str() << " differ in the gradient of " << reference->param_display_names()[p] << endl;
+        }
+    }
+    caffe::set_ogn_threads(num_threads);
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = register_cmd_options(argc, argv);
+    if(ret) return ret > 0 ? 0 : ret;
+
+    if(num_keys <= 0 || iterations <= 0)
+    {
+        std::cerr << "ERROR: num_keys and iterations must be positive" << std::endl;
+        return -1;
+    }
+
+    if(!grid_dim) grid_dim = benchmark == "conv" || benchmark == "threads" ? 64 : 256;
+    caffe::set_ogn_threads(num_threads);
+
+    if(benchmark == "morton") benchmark_morton();
+    else if(benchmark == "voxelize") benchmark_voxelize();
+    else if(benchmark == "rasterize") benchmark_rasterize();
+    else if(benchmark == "conv") benchmark_conv();
+    else if(benchmark == "threads") benchmark_threads();
+    else
+    {
+        std::cerr << "ERROR: unknown benchmark " << benchmark << std::endl;
+        return -1;
+    }
+    return 0;
+}
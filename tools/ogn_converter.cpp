@@ -1,13 +1,29 @@
+#include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <set>
+
+#include "caffe/util/benchmark.hpp"
 
 #include "image_tree_tools/image_tree_tools.h"
+#include "image_tree_tools/octree_parallel.h"
 
 using namespace boost::program_options;
 using namespace std;
+namespace fs = boost::filesystem;
 
 string input_file, output_file;
+string input_list, input_dir, output_dir;
+string output_ext = "ot";
+string output_format = "binary";
 int min_level = 0;
+int num_threads = 0;
+int max_memory_mb = 0;
+bool overwrite = false;
 
 int register_cmd_options(int argc, char* argv[])
 {
@@ -16,21 +32,52 @@ int register_cmd_options(int argc, char* argv[])
         options_description desc("Options");
         desc.add_options()
             ("help,h", "Show help")
-            ("input,i", value<string>(&input_file)->required(), "Input file name for conversion")
-            ("output,o", value<string>(&output_file)->required(), "Output file name for conversion")
-            ("min_level,l", value<int>(&min_level), "Minimum octree level")
+            ("input,i", value<string>(&input_file), "Input file name for conversion")
+            ("output,o", value<string>(&output_file), "Output file name for conversion")
+            ("list,L", value<string>(&input_list), "Batch mode: text file with one input file per line")
+            ("input_dir,I", value<string>(&input_dir), "Batch mode: convert every .ot and .binvox file in this directory")
+            ("output_dir,O", value<string>(&output_dir), "Batch mode: directory for the converted files")
+            ("output_ext,e", value<string>(&output_ext)->default_value("ot"), "Batch mode: output type, ot or binvox")
+            ("overwrite", bool_switch(&overwrite), "Batch mode: convert again even if the output exists")
+            ("max_memory,m", value<int>(&max_memory_mb)->default_value(0), "Batch mode: memory budget in MB for shapes in flight, 0 for no limit")
+            ("min_level,l", value<int>(&min_level)->default_value(0), "Minimum octree level")
+            ("format,f", value<string>(&output_format)->default_value("binary"), "Output .ot format: binary or text")
+            ("threads,j", value<int>(&num_threads)->default_value(0), "Worker threads, 0 for all hardware threads")
         ;
 
         variables_map vm;
         store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
 
-        if (vm.count("help")) cout << desc << endl;
+        if (vm.count("help"))
+        {
+            cout << desc << endl;
+            return 1;
+        }
 
-        input_file = vm["input"].as<string>();
-        output_file = vm["output"].as<string>();
-        min_level = vm["min_level"].as<int>();
+        bool batch = !input_list.empty() || !input_dir.empty();
+        if(batch && output_dir.empty())
+        {
+            std::cerr << "ERROR: batch mode needs --output_dir" << std::endl;
+            return -1;
+        }
+        if(!batch && (input_file.empty() || output_file.empty()))
+        {
+            std::cerr << "ERROR: give --input and --output, or --list / --input_dir for batch mode" << std::endl;
+            return -1;
+        }
+        if(output_format != "binary" && output_format != "text")
+        {
+            std::cerr << "ERROR: unknown output format " << output_format << std::endl;
+            return -1;
+        }
+        if(output_ext != "ot" && output_ext != "binvox")
+        {
+            std::cerr << "ERROR: unknown output type " << output_ext << std::endl;
+            return -1;
+        }
     }
-    catch(boost::program_options::required_option& e)
+    catch(boost::program_options::error& e)
     {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         return -1;
@@ -38,43 +85,345 @@ int register_cmd_options(int argc, char* argv[])
     return 0;
 }
 
-int main(int argc, char* argv[])
+/// Time spent in each stage of a conversion, in milliseconds.
+struct ConversionTimes
+{
+    ConversionTimes() : read(0), convert(0), write(0) {}
+
+    double read, convert, write;
+};
+
+/// Converts one file into an out_ext (ot or binvox) file; threads are used
+/// inside the conversion itself.
+bool convert_file(const string& in_file, const string& out_file, const string& out_ext, int threads,
+                  ConversionTimes& times)
+{
+    Octree octree;
+    caffe::CPUTimer timer;
+
+    //read converter input (binary and text .ot files are told apart by their header)
+    string input_ext = split(in_file, '.').back();
+    if(input_ext == "ot")
+    {
+        timer.Start();
+        bool ok = octree.from_file(in_file);
+        times.read += timer.MilliSeconds();
+        if(!ok) return false;
+    }
+    else if(input_ext == "binvox")
+    {
+        // the runs are converted as they are, without a dense volume
+        RunLengthVoxelGrid grid;
+        timer.Start();
+        bool ok = grid.read_binvox(in_file);
+        times.read += timer.MilliSeconds();
+        if(!ok)
+        {
+            std::cerr << "ERROR: cannot read " << in_file << std::endl;
+            return false;
+        }
+
+        timer.Start();
+        parallel_from_run_length_grid(octree, grid, min_level, threads);
+        times.convert += timer.MilliSeconds();
+    }
+    else
+    {
+        std::cerr << "ERROR: unknown input type " << in_file << std::endl;
+        return false;
+    }
+
+    //generate converter output
+    bool ok = true;
+    if(out_ext == "ot")
+    {
+        timer.Start();
+        if(output_format == "text") ok = octree.to_text_file(out_file);
+        else ok = octree.to_file(out_file);
+        times.write += timer.MilliSeconds();
+    }
+    else if(out_ext == "binvox")
+    {
+        timer.Start();
+        VoxelGrid vg = parallel_to_voxel_grid(octree, threads);
+        times.convert += timer.MilliSeconds();
+
+        timer.Start();
+        ok = vg.write_binvox(out_file);
+        times.write += timer.MilliSeconds();
+    }
+    else
+    {
+        std::cerr << "ERROR: unknown output type " << out_file << std::endl;
+        return false;
+    }
+
+    if(!ok) std::cerr << "ERROR: cannot write " << out_file << std::endl;
+    return ok;
+}
+
+/// Blocks while the shapes in flight would exceed the budget. A single
+/// shape larger than the whole budget is let through on its own.
+class MemoryBudget
+{
+
+public:
+    explicit MemoryBudget(size_t limit) : _limit(limit), _used(0) {}
+
+    size_t acquire(size_t bytes)
+    {
+        if(!_limit) return 0;
+        bytes = std::min(bytes, _limit);
+        boost::mutex::scoped_lock lock(_mutex);
+        while(_used + bytes > _limit) _released.wait(lock);
+        _used += bytes;
+        return bytes;
+    }
+
+    void release(size_t bytes)
+    {
+        if(!bytes) return;
+        boost::mutex::scoped_lock lock(_mutex);
+        _used -= bytes;
+        _released.notify_all();
+    }
+
+private:
+    size_t _limit, _used;
+    boost::mutex _mutex;
+    boost::condition_variable _released;
+};
+
+struct BatchConversion
 {
-    if(!register_cmd_options(argc, argv))
+    BatchConversion(const vector<string>& inputs, const vector<string>& outputs) : inputs(inputs), outputs(outputs),
+        budget(size_t(max_memory_mb) << 20), converted(0), skipped(0), failed(0), bytes_in(0), bytes_out(0) {}
+
+    /// Bytes to reserve for one shape. Runs, octree and the serialized output
+    /// all scale with the input, 16x its size is a generous bound for binary
+    /// input. Binvox output also needs the dense grid of the octree's finest
+    /// level, which a few KB of .ot can expand to; text octrees have no
+    /// header to read it from and run on their own.
+    static size_t shape_bytes(const fs::path& in_path, uintmax_t in_size)
     {
-        Octree octree;
+        size_t bytes = in_size * 16;
+        if(output_ext != "binvox" || in_path.extension() != ".ot") return bytes;
 
-        cout << "Input file: " << input_file << endl;
-        cout << "Output file: " << output_file << endl;
-        cout << "Minimum level: " << min_level << endl;
+        OctreeFileHeader header;
+        if(!read_octree_file_header(in_path.string(), header) || 3 * header.max_level >= int(8 * sizeof(size_t)))
+            return std::numeric_limits<size_t>::max();
+        return header.max_level < 0 ? bytes : bytes + (size_t(1) << 3 * header.max_level);
+    }
 
-        string input_ext = split(input_file, '.').back();
-        string output_ext = split(output_file, '.').back();
+    void operator()(int ind)
+    {
+        const fs::path in_path(inputs[ind]);
+        const fs::path out_path(outputs[ind]);
 
-        //read converter input
-        if(input_ext == "ot")
+        if(!overwrite && fs::exists(out_path))
         {
-            octree.from_file(input_file);
+            boost::mutex::scoped_lock lock(mutex);
+            skipped++;
+            return;
         }
-        else if(input_ext == "binvox")
+
+        // the output only appears under its final name once it is complete,
+        // so an interrupted run never leaves files that would be skipped
+        const fs::path tmp_path(out_path.string() + ".tmp");
+        ConversionTimes shape_times;
+        uintmax_t in_size = 0, out_size = 0;
+        size_t reserved = 0;
+        bool ok = false;
+        try
         {
-            VoxelGrid vg;
-            vg.read_binvox(input_file);
-            octree.from_voxel_grid(vg, min_level);
+            in_size = fs::file_size(in_path);
+            reserved = budget.acquire(shape_bytes(in_path, in_size));
+            ok = convert_file(in_path.string(), tmp_path.string(), output_ext, 1, shape_times);
+            if(ok)
+            {
+                out_size = fs::file_size(tmp_path);
+                fs::rename(tmp_path, out_path);
+            }
         }
+        catch(const std::exception& e)
+        {
+            std::cerr << "ERROR: " << in_path.string() << ": " << e.what() << std::endl;
+            ok = false;
+        }
+        budget.release(reserved);
+        if(!ok)
+        {
+            boost::system::error_code ec;
+            fs::remove(tmp_path, ec);
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        times.read += shape_times.read;
+        times.convert += shape_times.convert;
+        times.write += shape_times.write;
+        if(!ok)
+        {
+            failed++;
+            return;
+        }
+        converted++;
+        bytes_in += in_size;
+        bytes_out += out_size;
+        if(converted % 1000 == 0)
+            cout << "Converted " << converted << " / " << inputs.size() << " shapes" << endl;
+    }
 
+    const vector<string>& inputs;
+    const vector<string>& outputs;
+    MemoryBudget budget;
 
-        //generate converter output
-        if(output_ext == "ot")
+    boost::mutex mutex;
+    int converted, skipped, failed;
+    uintmax_t bytes_in, bytes_out;
+    ConversionTimes times;
+};
+
+bool collect_inputs(vector<string>& inputs)
+{
+    if(!input_list.empty())
+    {
+        std::ifstream list(input_list.c_str());
+        if(!list.good())
         {
-            octree.to_file(output_file);
+            std::cerr << "ERROR: cannot open " << input_list << std::endl;
+            return false;
         }
-        else if(output_ext == "binvox")
+        string line;
+        while(std::getline(list, line))
         {
-            //VoxelGrid vg = octree.to_voxel_grid();
-            //vg.write_binvox(output_string);
+            if(!line.empty()) inputs.push_back(line);
         }
     }
 
-    return 0;
+    if(!input_dir.empty())
+    {
+        if(!fs::is_directory(input_dir))
+        {
+            std::cerr << "ERROR: " << input_dir << " is not a directory" << std::endl;
+            return false;
+        }
+        vector<string> dir_inputs;
+        for(fs::directory_iterator it(input_dir); it != fs::directory_iterator(); ++it)
+        {
+            string ext = it->path().extension().string();
+            if(fs::is_regular_file(it->path()) && (ext == ".ot" || ext == ".binvox"))
+                dir_inputs.push_back(it->path().string());
+        }
+        std::sort(dir_inputs.begin(), dir_inputs.end());
+        inputs.insert(inputs.end(), dir_inputs.begin(), dir_inputs.end());
+    }
+    return true;
+}
+
+/// Output paths that mirror the inputs below output_dir: every input keeps
+/// its path relative to the deepest directory containing all inputs, so
+/// <synset>/<id>/model.binvox trees do not collapse into one model.ot.
+/// Fails if two inputs still map to the same output.
+bool map_outputs(const vector<string>& inputs, vector<string>& outputs)
+{
+    vector<fs::path> paths;
+    for(size_t i=0; i<inputs.size(); i++)
+    {
+        boost::system::error_code ec;
+        const fs::path path = fs::canonical(inputs[i], ec);
+        paths.push_back(ec ? fs::absolute(inputs[i]) : path);
+    }
+
+    vector<fs::path> root;
+    if(!paths.empty())
+    {
+        const fs::path dir = paths[0].parent_path();
+        root.assign(dir.begin(), dir.end());
+    }
+    for(size_t i=1; i<paths.size(); i++)
+    {
+        const fs::path dir = paths[i].parent_path();
+        size_t common = 0;
+        for(fs::path::iterator it=dir.begin(); it!=dir.end() && common<root.size() && *it==root[common]; ++it) common++;
+        root.resize(common);
+    }
+
+    outputs.clear();
+    for(size_t i=0; i<paths.size(); i++)
+    {
+        fs::path out_path(output_dir);
+        fs::path::iterator it = paths[i].begin();
+        for(size_t c=0; c<root.size(); c++) ++it;
+        for(; it!=paths[i].end(); ++it) out_path /= *it;
+        outputs.push_back(out_path.replace_extension("." + output_ext).string());
+    }
+
+    vector<pair<string, string> > sorted;
+    for(size_t i=0; i<outputs.size(); i++) sorted.push_back(make_pair(outputs[i], inputs[i]));
+    std::sort(sorted.begin(), sorted.end());
+    bool ok = true;
+    for(size_t i=1; i<sorted.size(); i++)
+    {
+        if(sorted[i].first != sorted[i-1].first) continue;
+        std::cerr << "ERROR: " << sorted[i-1].second << " and " << sorted[i].second
+                  << " are both converted to " << sorted[i].first << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+int run_batch()
+{
+    vector<string> inputs, outputs;
+    if(!collect_inputs(inputs)) return -1;
+    if(!map_outputs(inputs, outputs)) return -1;
+
+    std::set<string> output_dirs;
+    output_dirs.insert(output_dir);
+    for(size_t i=0; i<outputs.size(); i++) output_dirs.insert(fs::path(outputs[i]).parent_path().string());
+    for(std::set<string>::iterator it=output_dirs.begin(); it!=output_dirs.end(); ++it)
+    {
+        boost::system::error_code ec;
+        fs::create_directories(*it, ec);
+        if(ec)
+        {
+            std::cerr << "ERROR: cannot create " << *it << ": " << ec.message() << std::endl;
+            return -1;
+        }
+    }
+
+    const int threads = num_threads > 0 ? num_threads : default_num_threads();
+    cout << "Converting " << inputs.size() << " shapes to " << output_dir << " on " << threads << " threads" << endl;
+
+    BatchConversion batch(inputs, outputs);
+    caffe::CPUTimer timer;
+    timer.Start();
+    parallel_for(inputs.size(), batch, threads);
+    double seconds = timer.Seconds();
+
+    const double mb = 1024.0 * 1024.0;
+    const int processed = std::max(batch.converted + batch.failed, 1);
+    cout << fixed << setprecision(1);
+    cout << "Converted " << batch.converted << ", skipped " << batch.skipped << ", failed " << batch.failed
+         << " in " << seconds << " s (" << batch.converted / std::max(seconds, 1e-3) << " shapes/s)" << endl;
+    cout << "Read " << batch.bytes_in / mb << " MB, wrote " << batch.bytes_out / mb << " MB" << endl;
+    cout << setprecision(2) << "Per shape: read " << batch.times.read / processed << " ms, convert "
+         << batch.times.convert / processed << " ms, write " << batch.times.write / processed << " ms" << endl;
+    return batch.failed ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = register_cmd_options(argc, argv);
+    if(ret) return ret > 0 ? 0 : ret;
+
+    if(!input_list.empty() || !input_dir.empty()) return run_batch();
+
+    cout << "Input file: " << input_file << endl;
+    cout << "Output file: " << output_file << endl;
+    cout << "Minimum level: " << min_level << endl;
+    cout << "Output format: " << output_format << endl;
+
+    ConversionTimes times;
+    return convert_file(input_file, output_file, split(output_file, '.').back(), num_threads, times) ? 0 : -1;
 }
@@ -0,0 +1,153 @@
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "caffe/util/benchmark.hpp"
+
+#include "image_tree_tools/image_tree_tools.h"
+
+using namespace boost::program_options;
+using namespace std;
+
+string input_list, output_file, info_file;
+
+int register_cmd_options(int argc, char* argv[])
+{
+    try
+    {
+        options_description desc("Options");
+        desc.add_options()
+            ("help,h", "Show help")
+            ("list,L", value<string>(&input_list), "Text file with one .ot file per line, in dataset order")
+            ("output,o", value<string>(&output_file), "Dataset pack to write")
+            ("info", value<string>(&info_file), "Print the index summary of an existing pack")
+        ;
+
+        variables_map vm;
+        store(parse_command_line(argc, argv, desc), vm);
+        notify(vm);
+
+        if (vm.count("help"))
+        {
+            cout << desc << endl;
+            return 1;
+        }
+
+        if(info_file.empty() && (input_list.empty() || output_file.empty()))
+        {
+            std::cerr << "ERROR: give --list and --output, or --info" << std::endl;
+            return -1;
+        }
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/// Appends one model. Binary .ot files are copied as they are, text files
+/// are converted to the binary format first.
+bool add_model(OctreePackWriter& writer, const string& fname)
+{
+    MappedFile file;
+    if(!file.open(fname))
+    {
+        std::cerr << "ERROR: cannot open " << fname << std::endl;
+        return false;
+    }
+    if(is_binary_octree(file.data(), file.size())) return writer.add(file.data(), file.size());
+
+    file.close();
+    Octree octree;
+    return octree.from_file(fname) && writer.add(octree);
+}
+
+int pack()
+{
+    vector<string> inputs;
+    std::ifstream list(input_list.c_str());
+    if(!list.good())
+    {
+        std::cerr << "ERROR: cannot open " << input_list << std::endl;
+        return -1;
+    }
+    string name;
+    while(list >> name) inputs.push_back(name);
+
+    OctreePackWriter writer;
+    if(!writer.open(output_file, inputs.size()))
+    {
+        std::cerr << "ERROR: cannot write " << output_file << std::endl;
+        return -1;
+    }
+
+    caffe::CPUTimer timer;
+    timer.Start();
+    for(size_t i=0; i<inputs.size(); i++)
+    {
+        // models are addressed by their position, so a pack with holes
+        // would silently shift all labels after them
+        if(!add_model(writer, inputs[i]))
+        {
+            std::cerr << "ERROR: cannot add " << inputs[i] << ", no pack written" << std::endl;
+            writer.close();
+            remove(output_file.c_str());
+            return -1;
+        }
+        if((i + 1) % 1000 == 0) cout << "Packed " << i + 1 << " / " << inputs.size() << " models" << endl;
+    }
+    if(!writer.close())
+    {
+        std::cerr << "ERROR: cannot write " << output_file << std::endl;
+        return -1;
+    }
+
+    double seconds = timer.Seconds();
+    cout << fixed << setprecision(1) << "Packed " << inputs.size() << " models into " << output_file << " ("
+         << writer.size() / (1024.0 * 1024.0) << " MB) in " << seconds << " s" << endl;
+    return 0;
+}
+
+int info()
+{
+    OctreePack pack;
+    if(!pack.open(info_file))
+    {
+        std::cerr << "ERROR: " << info_file << " is not a valid dataset pack" << std::endl;
+        return -1;
+    }
+
+    uint64_t total_cells = 0, max_cells = 0, bytes = 0;
+    vector<uint64_t> level_cells(OCTREE_PACK_LEVELS, 0);
+    for(size_t i=0; i<pack.size(); i++)
+    {
+        const OctreePackEntry& entry = pack.entry(i);
+        total_cells += entry.num_cells;
+        max_cells = std::max(max_cells, entry.num_cells);
+        bytes += entry.length;
+        for(int l=0; l<OCTREE_PACK_LEVELS; l++) level_cells[l] += entry.level_cells[l];
+    }
+
+    cout << info_file << ": " << pack.size() << " models, " << total_cells << " cells, "
+         << fixed << setprecision(1) << bytes / (1024.0 * 1024.0) << " MB of octrees" << endl;
+    if(pack.size())
+        cout << "Cells per model: " << double(total_cells) / pack.size() << " mean, " << max_cells << " max" << endl;
+    for(int l=0; l<OCTREE_PACK_LEVELS; l++)
+    {
+        if(level_cells[l]) cout << "  level " << setw(2) << l << setw(14) << level_cells[l] << " cells" << endl;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = register_cmd_options(argc, argv);
+    if(ret) return ret > 0 ? 0 : ret;
+
+    if(!info_file.empty()) return info();
+    return pack();
+}